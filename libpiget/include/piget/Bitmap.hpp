@@ -0,0 +1,85 @@
+#pragma once
+
+#include "piget/MappedFile.hpp"
+#include "piget/Object.hpp"
+#include "piget/ObjectId.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+struct Database;
+struct Pack;
+struct PackObject;
+
+// Uncompressed bitmap; bit n is bit n % 64 of word n / 64, as in git's EWAH bitmaps
+struct Bitmap {
+  std::vector<uint64_t> words;
+  void set(size_t bit);
+  bool test(size_t bit) const;
+  Bitmap& operator|=(const Bitmap& rhs);
+  Bitmap& operator^=(const Bitmap& rhs);
+  // Clears every bit that is set in rhs
+  void andNot(const Bitmap& rhs);
+  template <typename F>
+  void forEach(F&& fn) const {
+    for (size_t word = 0; word < words.size(); word++) {
+      for (uint64_t bits = words[word]; bits; bits &= bits - 1) {
+        fn(word * 64 + __builtin_ctzll(bits));
+      }
+    }
+  }
+};
+
+// git's serialised EWAH: bit count, word count, the run-length encoded words and the position of the last marker word
+std::vector<uint8_t> EwahEncode(const Bitmap& bitmap, size_t bitCount);
+// Decodes the EWAH bitmap at the start of in and returns how many bytes it took
+size_t EwahDecode(std::span<const uint8_t> in, Bitmap& out);
+
+// git's .bitmap for one pack: for selected commits, every object they reach as bits in pack order
+// (objects sorted by offset), plus one bitmap per object type and the name hash of every object
+struct PackBitmap {
+  PackBitmap(const Pack& pack, std::filesystem::path file);
+  // Starts without commit bitmaps, for WritePackBitmap to fill
+  PackBitmap(const Pack& pack);
+  std::optional<uint32_t> bitFor(const ObjectId& id) const;
+  ObjectId idAt(uint32_t bit) const;
+  uint32_t nameHashAt(uint32_t bit) const;
+  // Everything the commit reaches, when it is one of the selected commits
+  std::optional<Bitmap> commitBitmap(const ObjectId& commit) const;
+  const Pack& pack;
+private:
+  friend void WritePackBitmap(const Database& db, const std::filesystem::path& packFile, std::span<const ObjectId> tips);
+  struct Entry {
+    size_t offset;
+    uint8_t xorOffset;
+  };
+  Bitmap decode(size_t entry) const;
+  void orderByOffset();
+  MappedFile mapping;
+  std::vector<uint32_t> indexPositions;
+  std::vector<uint32_t> bits;
+  std::vector<Entry> entries;
+  std::unordered_map<ObjectId, size_t> commits;
+  // Bitmaps of a file being written, in the order they were computed
+  std::vector<std::pair<ObjectId, Bitmap>> built;
+  const uint8_t* nameHashes = nullptr;
+};
+
+// Everything reachable from a set of tips: objects of the bitmapped pack as bits, anything else by id with its name hash
+struct ReachableSet {
+  Bitmap bits;
+  std::unordered_map<ObjectId, uint32_t> extra;
+};
+
+// Walks from the tips into set, taking over whole commit bitmaps where the pack bitmap has them and not
+// descending into anything in exclude. bitmap may be null. visit sees every object the walk itself adds.
+void WalkReachable(const Database& db, const PackBitmap* bitmap, std::span<const ObjectId> tips, ReachableSet& set,
+                   const ReachableSet* exclude = nullptr,
+                   const std::function<void(const ObjectId& id, Object::Type type, uint32_t nameHash)>& visit = {});
+
+// Writes the .bitmap for a pack, with bitmaps for the tips and a spread of the commits below them
+void WritePackBitmap(const Database& db, const std::filesystem::path& packFile, std::span<const ObjectId> tips);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "piget/MappedFile.hpp"
+#include "piget/ObjectId.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <vector>
+
+struct Database;
+
+// git's commit-graph: root tree, parents, generation and commit time of every commit in fixed-width rows,
+// so history walks run over positions instead of inflating and parsing commits
+struct CommitGraph {
+  CommitGraph(std::filesystem::path file);
+  std::optional<uint32_t> find(const ObjectId& id) const;
+  size_t size() const { return commitCount; }
+  ObjectId idAt(uint32_t position) const;
+  ObjectId rootAt(uint32_t position) const;
+  // Length of the longest parent chain down to a root commit, which counts as 1
+  uint32_t generationAt(uint32_t position) const;
+  int64_t timeAt(uint32_t position) const;
+  // Appends the parent positions, first parent first
+  void parentsAt(uint32_t position, std::vector<uint32_t>& out) const;
+  bool isAncestor(uint32_t ancestor, uint32_t descendant) const;
+private:
+  MappedFile mapping;
+  const uint8_t* fanout = nullptr;
+  const uint8_t* ids = nullptr;
+  const uint8_t* commitData = nullptr;
+  const uint8_t* extraEdges = nullptr;
+  size_t extraEdgeCount = 0;
+  size_t commitCount = 0;
+};
+
+// Writes objects/info/commit-graph covering every commit reachable from the tips
+void WriteCommitGraph(const Database& db, std::filesystem::path objectDirectory, std::span<const ObjectId> tips);
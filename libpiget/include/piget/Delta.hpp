@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Rolling-hash index over a delta base, so one base can be tried against many targets
+struct DeltaIndex {
+  DeltaIndex(std::span<const uint8_t> base);
+  std::optional<std::vector<uint8_t>> createDelta(std::span<const uint8_t> target, size_t maxSize = SIZE_MAX) const;
+private:
+  std::span<const uint8_t> base;
+  std::vector<uint32_t> bucketStart;
+  std::vector<uint32_t> blockOffsets;
+  uint32_t mask = 0;
+};
+
+std::optional<std::vector<uint8_t>> CreateDelta(std::span<const uint8_t> base, std::span<const uint8_t> target, size_t maxSize = SIZE_MAX);
+std::vector<uint8_t> ApplyDelta(std::span<const uint8_t> base, std::span<const uint8_t> delta);
+
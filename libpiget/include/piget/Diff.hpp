@@ -0,0 +1,27 @@
+#pragma once
+
+#include "piget/ObjectId.hpp"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct Database;
+
+// One changed path below two trees; subtrees are not reported, only the files in them
+struct TreeChange {
+  enum class Status {
+    Added,
+    Deleted,
+    Modified,
+  };
+  Status status;
+  std::string path;
+  // Zero on the side where the path does not exist
+  uint32_t oldMode = 0, newMode = 0;
+  ObjectId oldId, newId;
+};
+
+// Walks both trees in step over their sorted entries, in git order, and only descends into subtrees whose
+// ids differ, so the cost follows the size of the change. A missing tree compares as empty.
+std::vector<TreeChange> DiffTrees(const Database& db, const std::optional<ObjectId>& oldTree, const std::optional<ObjectId>& newTree);
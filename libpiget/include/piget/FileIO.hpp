@@ -0,0 +1,52 @@
+#pragma once
+
+#include <filesystem>
+#include <span>
+#include <string>
+#include <cstdint>
+
+inline uint32_t ReadBE32(const uint8_t* p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+inline uint64_t ReadBE64(const uint8_t* p) {
+  return (uint64_t(ReadBE32(p)) << 32) | ReadBE32(p + 4);
+}
+
+// Writes all of data, across short writes; errors name the file as `name`
+void WriteAll(int fd, std::span<const uint8_t> data, const std::string& name);
+
+// A fresh read-only file <prefix>XXXXXX in dir, for data that is renamed into place once complete
+int CreateTemporary(const std::filesystem::path& dir, const std::string& prefix, std::string& tempName);
+
+// Closes fd after its contents reached the disk, and closes it as well when that fails
+void SyncAndClose(int fd, const std::string& name);
+
+// Makes the names created or renamed in dir durable
+void SyncDirectory(const std::filesystem::path& dir);
+
+// Contents reach the disk before the name appears, so a crash never leaves a truncated file behind
+void WriteDurably(const std::filesystem::path& target, std::span<const uint8_t> data);
+
+// git's lock protocol: <file>.lock is created exclusively, so a second writer fails instead of overwriting it.
+// commit() syncs the lock and renames it over the file; a lock that is not committed is removed again.
+struct LockFile {
+  LockFile() = default;
+  // Throws when someone else holds the lock
+  LockFile(std::filesystem::path file);
+  LockFile(LockFile&& rhs);
+  LockFile& operator=(LockFile&& rhs);
+  LockFile(const LockFile&) = delete;
+  LockFile& operator=(const LockFile&) = delete;
+  ~LockFile();
+  // False when someone else holds the lock
+  bool tryLock(std::filesystem::path file);
+  bool locked() const { return fd != -1; }
+  void write(std::span<const uint8_t> data);
+  void commit();
+  void rollback();
+private:
+  std::filesystem::path file;
+  std::string lockName;
+  int fd = -1;
+};
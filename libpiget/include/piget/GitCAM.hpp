@@ -1,17 +1,31 @@
 #pragma once
 
+#include "piget/ObjectId.hpp"
+#include "piget/Diff.hpp"
+#include "piget/FileIO.hpp"
 #include <map>
 #include <filesystem>
+#include <functional>
 #include <cstdint>
+#include <ctime>
 #include <optional>
 #include <tl/expected.hpp>
 #include <array>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <span>
 
 struct Object;
+struct ObjectInfo;
 struct GitCAM;
+struct MultiPackIndex;
+struct CommitGraph;
+struct PackBitmap;
+struct PackObject;
 struct DirEntry;
 struct Pack;
+struct Database;
 
 struct Index {
   struct Entry {
@@ -21,40 +35,206 @@ struct Index {
     uint32_t mode;
     uint32_t uid, gid;
     uint32_t filesize;
-    std::array<uint8_t, 20> hash;
+    ObjectId hash;
     uint16_t flags;
     std::string fileName;
   };
-  Index(GitCAM& cam, bool withLock = false);
+  // Hash and entry count of a directory as of the last toTree, from the index TREE extension
+  struct CacheTree {
+    std::string name;
+    // Number of index entries below this directory, or -1 when something below it changed
+    int32_t entryCount = -1;
+    ObjectId hash;
+    std::vector<CacheTree> children;
+  };
+  // Only an index holding .git/index.lock is ever written. IfFree leaves it read-only when another process holds
+  // the lock, like git status does; Required throws then.
+  enum class Lock { None, Required, IfFree };
+  Index(GitCAM& cam, Lock lock = Lock::None);
   ~Index();
-  Object toTree(std::optional<std::array<uint8_t, 20>> parentCommit);
+  // Writes the index back when it changed and the lock is held; changes that are not saved are dropped
+  void save();
+  // Writes the trees for the index contents, reusing every directory the cache tree still has
+  Object toTree();
   void add(std::filesystem::path path);
-  
+  // Adds every regular file below a directory, skipping .git and untracked files that .gitignore or info/exclude
+  // exclude. Scanning, hashing and storing run on threads; the entries are merged in sorted order at the end.
+  void addAll(std::filesystem::path directory, size_t threads = 0);
   void remove(std::filesystem::path path);
+  // Re-stats every tracked file, taking over new stat data for files whose content did not change.
+  // Returns the files that are modified or gone.
+  std::vector<std::filesystem::path> refresh(size_t threads = 0);
+  // Writes a tree out to the worktree and makes the index match it. Directories are created first, then files
+  // are streamed from their objects on threads, in pack order. Tracked files the tree does not have are removed,
+  // and ones it has unchanged are left alone, local changes included. Like git, it throws before touching
+  // anything when a removed or replaced file has local changes or an untracked file or symlink is in the way.
+  void checkout(const Database& db, const ObjectId& tree, size_t threads = 0);
+  const std::map<std::string, Entry>& entries() const { return objects; }
+  struct Status {
+    // HEAD's tree against the index
+    std::vector<TreeChange> staged;
+    // Tracked files whose worktree content differs from the index, and ones that are gone
+    std::vector<std::string> modified, deleted;
+    // Files no entry covers; a directory without tracked files is listed once, with a trailing '/'
+    std::vector<std::string> untracked;
+  };
+  // Compares HEAD's tree against the index and the index against the worktree, like refresh. Directories
+  // are listed on threads, and ones whose mtime is unchanged since the last status come from the untracked cache.
+  // The cache holds whole listings and leaves tracking and exclusion to each status, so neither goes stale when
+  // the index or an exclude file changes.
+  Status status(const Database& db, const std::optional<ObjectId>& headTree, size_t threads = 0);
 
 private:
-  std::map<std::filesystem::path, Entry> objects;
+  // What a directory held when it was last listed: its files and symlinks, tracked or not, and its subdirectories
+  struct CachedDirectory {
+    uint32_t mtime_sec = 0, mtime_ns = 0;
+    std::vector<std::string> files, subdirectories;
+  };
+  struct Listing;
+  // Keyed by path bytes, which is both the index file order and canonical tree order
+  std::map<std::string, Entry> objects;
   GitCAM& cam;
-  bool haveLock = false;
+  LockFile lock;
+  bool changed = false;
+  // mtime of the index file as loaded; entries not older than this are racily clean
+  uint32_t indexMtimeSec = 0, indexMtimeNs = 0;
+  CacheTree cacheTree;
+  // Keyed by directory path, "" for the top of the worktree. Kept in a file of its own next to the index, as git
+  // warns about index extensions it does not know.
+  std::map<std::string, CachedDirectory> untrackedCache;
+  bool untrackedCacheChanged = false;
+  bool isRacy(const Entry& e) const;
+  // Whether any entry lies below directory, given with its trailing '/'
+  bool tracksBelow(const std::string& directory) const;
+  void diffHead(const Database& db, const std::optional<ObjectId>& tree, const std::string& prefix, const CacheTree* node, std::vector<TreeChange>& out) const;
+  Listing listDirectory(const std::string& path, time_t scanStart) const;
+  std::vector<std::string> findUntracked(size_t threads);
+  bool unchanged(const std::string& key, const struct stat& statbuf) const;
+  void store(Entry e);
+  void invalidate(std::string_view path);
   void load();
-  void save();
+  void loadUntrackedCache();
+  void saveUntrackedCache();
 };
 
+ObjectId HashFile(std::filesystem::path path);
+
 struct GitCAM {
   GitCAM(std::filesystem::path root);
-  std::array<uint8_t, 20> add(Object object);
-  std::optional<Object> get(std::array<uint8_t, 20> id) const;
+  GitCAM(GitCAM&&);
+  ~GitCAM();
+  ObjectId add(const Object& object);
+  // Writes the objects from a worker pool and syncs the whole batch at once
+  std::vector<ObjectId> add(std::span<const Object> objects, size_t threads = 0);
+  // Stores a file as a blob in one streaming pass, without holding it in memory
+  ObjectId addFile(std::filesystem::path path);
+  // addFile for many files at once on a worker pool, syncing the touched directories once at the end
+  std::vector<ObjectId> addFiles(std::span<const std::filesystem::path> paths, size_t threads = 0);
+  std::optional<Object> get(ObjectId id) const;
+  // Inflates the object's contents piece by piece into out, without its header; false when it is not stored here
+  bool stream(ObjectId id, const std::function<void(std::span<const uint8_t>)>& out) const;
+  // Type and size from the object's header, inflating no further than that
+  std::optional<ObjectInfo> info(ObjectId id) const;
+  bool contains(ObjectId id) const;
+  // Calls to add and addFiles so far, so a cache of what is stored can tell it was written around
+  size_t writes() const;
 
   std::filesystem::path root;
+  // fsync new object files and their directories before add returns
+  bool durable = true;
+private:
+  struct FanoutCache;
+  std::unique_ptr<FanoutCache> fanout;
+  std::filesystem::path fanoutDirectory(uint8_t firstByte, bool& created);
+};
+
+struct ObjectCachePolicy {
+  size_t byteLimit = 64 << 20;
+  // Largest object of each type worth keeping; 0 never caches the type
+  size_t maxCommitSize = SIZE_MAX;
+  size_t maxTreeSize = SIZE_MAX;
+  size_t maxBlobSize = 0;
+  size_t maxTagSize = SIZE_MAX;
+};
+
+struct ObjectCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t entries = 0;
+  size_t bytes = 0;
+};
+
+struct CommitInfo {
+  ObjectId root;
+  std::vector<ObjectId> parents;
+  int64_t time = 0;
+  // From the commit-graph; 0 for commits it does not cover, which may be at any depth
+  uint32_t generation = 0;
 };
 
 struct Database {
+  enum class ProbeOrder {
+    LooseFirst,
+    PacksFirst,
+  };
   GitCAM cam;
-  std::vector<Pack*> packs;
+  std::vector<std::unique_ptr<Pack>> packs;
+  ProbeOrder probeOrder = ProbeOrder::LooseFirst;
 
   Database(std::filesystem::path root);
-  std::optional<Object> get(std::array<uint8_t, 20> id) const;
+  ~Database();
+  std::optional<Object> get(ObjectId id) const;
+  // The same object without copying it out of the object cache; null when it is missing
+  std::shared_ptr<const Object> getShared(const ObjectId& id) const;
+  // The object's contents in pieces, so large blobs are never held whole; false when the object is missing.
+  // Deltas are still rebuilt in memory.
+  bool stream(const ObjectId& id, const std::function<void(std::span<const uint8_t>)>& out) const;
+  // Type and size without reading the contents, from the loose header or the pack entry headers
+  std::optional<ObjectInfo> info(const ObjectId& id) const;
+  // The pack and offset an object is read from, for visiting many objects in pack order; nullopt for loose ones
+  std::optional<std::pair<const Pack*, size_t>> packLocation(const ObjectId& id) const;
+  bool contains(ObjectId id) const;
+  // Ids starting with an abbreviation, at most limit of them
+  std::vector<ObjectId> findPrefix(std::string_view hex, size_t limit = SIZE_MAX) const;
+  // nullopt when hex is not an abbreviation or matches nothing; throws when it matches more than one object
+  std::optional<ObjectId> resolve(std::string_view hex) const;
+  // Shortest abbreviation length that is unique for every object in the repository
+  size_t uniqueAbbreviationLength() const;
   void add(const Object& object);
   void addPack(Pack p);
+  // Forgets the loose object ids and misses seen so far. Writes through cam are noticed without it; objects
+  // written by another GitCAM or another process are not found until it is called.
+  void refresh();
+  void setObjectCachePolicy(const ObjectCachePolicy& policy);
+  ObjectCacheStats objectCacheStats() const;
+  // Parents, root tree and committer time, from the commit-graph when it has the commit
+  std::optional<CommitInfo> commitInfo(const ObjectId& id) const;
+  bool isAncestor(const ObjectId& ancestor, const ObjectId& descendant) const;
+  // The best common ancestors: common ancestors that are not ancestors of another one
+  std::vector<ObjectId> mergeBases(const ObjectId& lhs, const ObjectId& rhs) const;
+  // Everything reachable from wants but not from haves, with name hashes for packing. Where a pack has a
+  // .bitmap, both sides are taken from its commit bitmaps and subtracted instead of walked.
+  std::vector<PackObject> objectsBetween(std::span<const ObjectId> wants, std::span<const ObjectId> haves = {}) const;
+private:
+  struct LookupCache;
+  struct ObjectCache;
+  std::unique_ptr<LookupCache> lookup;
+  std::unique_ptr<ObjectCache> objectCache;
+  std::optional<Object> load(const ObjectId& id) const;
+  bool maybeLoose(const ObjectId& id) const;
+  std::optional<std::pair<Pack*, size_t>> findPacked(const ObjectId& id) const;
+  void recordMissing(const ObjectId& id) const;
+  bool knownMissing(const ObjectId& id) const;
+  bool looseAfterPacks(const ObjectId& id) const;
+  void foundLoose(const ObjectId& id) const;
+  std::unique_ptr<MultiPackIndex> multiPackIndex;
+  std::unique_ptr<CommitGraph> commitGraph;
+  const PackBitmap* packBitmap() const;
+  // The packs found when opening, in the order of the first entries of packs
+  std::vector<std::filesystem::path> packFiles;
+  mutable std::once_flag bitmapLoaded;
+  mutable std::unique_ptr<PackBitmap> bitmap;
+  // Packs in multi-pack-index order, and the ones it does not cover that still need their own lookup
+  std::vector<Pack*> indexedPacks, unindexedPacks;
 };
 
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "piget/ObjectId.hpp"
+#include <span>
+#include <vector>
+
+// SHA-1 of one buffer; runs on the CPU's SHA extensions when it has them and through Caligo otherwise
+ObjectId HashBuffer(std::span<const uint8_t> data);
+// SHA-1 of every buffer, spread over threads (0 uses every core); bit-identical to HashBuffer
+std::vector<ObjectId> HashBuffers(std::span<const std::span<const uint8_t>> buffers, size_t threads = 0);
+bool HashAccelerated();
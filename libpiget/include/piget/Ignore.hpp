@@ -0,0 +1,40 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The patterns of one exclude file, on top of the ones from the directories above it. Like in git, a deeper
+// .gitignore takes precedence over the ones above it, and they all take precedence over info/exclude; within
+// one file the last matching pattern wins. core.excludesFile is not read. Rules are immutable once read, so
+// threads walking different directories share them.
+struct IgnoreRules {
+  struct Pattern {
+    std::string pattern;
+    bool negated = false;
+    // "dir/" only matches directories
+    bool directoryOnly = false;
+    // A pattern with a '/' matches the whole path below its directory; one without only the last component
+    bool anchored = false;
+  };
+  std::shared_ptr<const IgnoreRules> parent;
+  // Directory the patterns are relative to, with a trailing '/', or "" for the top of the worktree
+  std::string base;
+  std::vector<Pattern> patterns;
+
+  // Whether path, relative to the top of the worktree, is excluded. Paths inside an excluded directory are only
+  // covered by skipping that directory; tracked files are never excluded, which is for callers to check.
+  bool ignored(std::string_view path, bool directory) const;
+};
+
+// Adds the patterns of file for paths below base; parent itself when the file is missing or has none
+std::shared_ptr<const IgnoreRules> ReadIgnoreFile(const std::filesystem::path& file, std::string base, std::shared_ptr<const IgnoreRules> parent);
+
+// info/exclude of a .git directory and the .gitignore of every directory from the top of the worktree, the
+// current directory, down to directory. Never null. Sets excluded when directory or one above it is excluded.
+std::shared_ptr<const IgnoreRules> ReadIgnoreRules(const std::filesystem::path& gitDir, std::string_view directory, bool& excluded);
+
+// git's wildmatch for paths: '*', '?' and [...] stop at '/', while "**" as a whole component spans directories
+bool WildMatch(std::string_view pattern, std::string_view path);
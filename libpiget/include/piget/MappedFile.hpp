@@ -0,0 +1,20 @@
+#pragma once
+
+#include <filesystem>
+#include <span>
+#include <cstdint>
+
+struct MappedFile {
+  MappedFile() = default;
+  MappedFile(std::filesystem::path path);
+  MappedFile(MappedFile&& rhs);
+  MappedFile& operator=(MappedFile&& rhs);
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+  std::span<const uint8_t> data() const { return { ptr, length }; }
+private:
+  const uint8_t* ptr = nullptr;
+  size_t length = 0;
+};
+
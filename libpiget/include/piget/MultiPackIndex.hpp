@@ -0,0 +1,39 @@
+#pragma once
+
+#include "piget/MappedFile.hpp"
+#include "piget/ObjectId.hpp"
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct IdPrefix;
+
+// git's multi-pack-index: one sorted id table covering every pack in a directory
+struct MultiPackIndex {
+  MultiPackIndex(std::filesystem::path file);
+  struct Location {
+    uint32_t pack;
+    size_t offset;
+  };
+  std::optional<Location> find(const ObjectId& id) const;
+  void findPrefix(const IdPrefix& prefix, std::vector<ObjectId>& out, size_t limit) const;
+  ObjectId idAt(size_t n) const;
+  // Names of the .idx files, indexed by Location::pack
+  const std::vector<std::string>& packNames() const { return names; }
+  size_t size() const { return objectCount; }
+private:
+  MappedFile mapping;
+  std::vector<std::string> names;
+  const uint8_t* fanout = nullptr;
+  const uint8_t* ids = nullptr;
+  const uint8_t* objectOffsets = nullptr;
+  const uint8_t* largeOffsets = nullptr;
+  size_t largeOffsetCount = 0;
+  size_t objectCount = 0;
+};
+
+// Covers every pack in the directory that has an .idx; objects in several packs resolve to the newest one
+void WriteMultiPackIndex(std::filesystem::path packDirectory);
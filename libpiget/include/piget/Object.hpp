@@ -1,5 +1,6 @@
 #pragma once
 
+#include "piget/ObjectId.hpp"
 #include "decoco/decoco.hpp"
 #include "caligo/hash.h"
 #include <map>
@@ -9,6 +10,8 @@
 #include <cstdint>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <iterator>
 #include <tl/expected.hpp>
 
 struct Object;
@@ -18,7 +21,7 @@ struct Database;
 struct DirEntry {
   uint16_t fileMode;
   std::string fileName;
-  std::array<uint8_t, 20> hash;
+  ObjectId hash;
 };
 
 struct User {
@@ -62,20 +65,82 @@ struct UserWithTime {
   }
 };
 
+// Canonical git order of tree entries, where a directory sorts as if its name ended in '/'
+bool TreeEntryLess(const DirEntry& lhs, const DirEntry& rhs);
+bool TreeEntryLess(std::string_view lhsName, bool lhsDirectory, std::string_view rhsName, bool rhsDirectory);
+
+// Serialized form of one tree entry, "<octal mode> <name>\0<hash>"; directories are mode 40000
+size_t TreeEntrySize(uint32_t mode, std::string_view name);
+uint8_t* WriteTreeEntry(uint8_t* out, uint32_t mode, std::string_view name, const ObjectId& hash);
+
+// An abbreviated object id of 4 to 40 hex characters
+struct IdPrefix {
+  ObjectId bytes = {};
+  size_t nibbles = 0;
+  static std::optional<IdPrefix> parse(std::string_view hex);
+  bool matches(const uint8_t* id) const;
+};
+
+// Entries of a tree object parsed in place, without allocating; names point into the object, which has to outlive the view
+struct TreeView {
+  struct Entry {
+    uint16_t fileMode;
+    std::string_view fileName;
+    ObjectId hash;
+  };
+  struct iterator {
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Entry;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const Entry*;
+    using reference = const Entry&;
+    iterator() = default;
+    iterator(const uint8_t* p, const uint8_t* end) : p(p), end(end) { parse(); }
+    const Entry& operator*() const { return entry; }
+    const Entry* operator->() const { return &entry; }
+    iterator& operator++() {
+      p = next;
+      parse();
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator rv = *this;
+      ++*this;
+      return rv;
+    }
+    bool operator==(const iterator& rhs) const { return p == rhs.p; }
+  private:
+    void parse();
+    const uint8_t* p = nullptr;
+    const uint8_t* next = nullptr;
+    const uint8_t* end = nullptr;
+    Entry entry = {};
+  };
+  TreeView() = default;
+  TreeView(std::span<const uint8_t> data) : data(data) {}
+  iterator begin() const { return iterator(data.data(), data.data() + data.size()); }
+  iterator end() const { return iterator(data.data() + data.size(), data.data() + data.size()); }
+  std::span<const uint8_t> data;
+};
+
+// Entries are kept in tree order, so lookups and inserts are binary searches
 struct Tree {
   std::vector<DirEntry> entries;
+  // Adds the entry, or replaces the file or directory that has the same name
   void set(std::string fileName, DirEntry entry);
-  std::optional<std::array<uint8_t, 20>> get(std::string fileName);
+  std::optional<ObjectId> get(std::string_view fileName) const;
 };
 
 struct Commit {
   Commit() {}
-  Commit(std::array<uint8_t, 20> root, UserWithTime author) : root(root), author(author), committer(author) {}
-  Commit setParent(std::array<uint8_t, 20> parent) { this->parent = parent; return *this; }
+  Commit(ObjectId root, UserWithTime author) : root(root), author(author), committer(author) {}
+  Commit setParent(ObjectId parent) { this->parent = parent; return *this; }
   Commit setCommitter(UserWithTime ut) { this->committer = ut; return *this; }
   Commit setMessage(std::string message) { this->message = message; return *this; }
-  std::array<uint8_t, 20> root;
-  std::optional<std::array<uint8_t, 20>> parent;
+  ObjectId root;
+  std::optional<ObjectId> parent;
+  // Parents after the first, for merges
+  std::vector<ObjectId> mergeParents;
   std::string message;
   UserWithTime author;
   UserWithTime committer;
@@ -87,36 +152,39 @@ struct Object {
     Commit = 0x1,
     Tree = 0x2,
     Object = 0x3,
+    Tag = 0x4,
   };
   Object(const Object&) = default;
+  Object(Object&&) = default;
+  Object& operator=(const Object&) = default;
+  Object& operator=(Object&&) = default;
   Object(Commit commit);
   Object(std::filesystem::path path);
   Object(Tree tree);
   Object(std::vector<uint8_t> data);
-  Object(Object::Type type, std::vector<uint8_t> data);
+  Object(Object::Type type, std::span<const uint8_t> data);
+  // Takes over payload, putting the header in front of it
+  Object(Object::Type type, std::vector<uint8_t>&& payload);
   std::vector<uint8_t> buffer;
-  Object::Type type() const;
-  std::span<const uint8_t> data() const;
-  std::array<uint8_t, 20> id() const;
-  Tree readAsTree();
-  Commit readAsCommit();
+  Object::Type type() const { return objectType; }
+  std::span<const uint8_t> data() const { return std::span<const uint8_t>(buffer).subspan(payloadOffset); }
+  ObjectId id() const;
+  Tree readAsTree() const;
+  TreeView viewAsTree() const;
+  Commit readAsCommit() const;
+private:
+  uint8_t* allocate(Object::Type type, size_t size);
+  Object::Type objectType = Type::Invalid;
+  size_t payloadOffset = 0;
 };
 
-std::pair<std::vector<uint8_t>, std::vector<uint8_t>> WritePack(const Database& db, std::vector<std::array<uint8_t, 20>> objectIds);
-
-struct Pack {
-  Pack(std::span<const uint8_t> data, std::span<const uint8_t> index);
-  struct IndexEntry {
-    std::array<uint8_t, 20> id;
-    std::array<uint8_t, 4> crc;
-    size_t offset;
-    Object::Type type;
-  };
-  std::optional<Object> get(std::array<uint8_t, 20> id);
-private:
-  void LoadIndex(std::span<const uint8_t> in);
-  void RegenerateIndex();
-  std::span<const uint8_t> data;
-  std::vector<IndexEntry> index;
+// Type and size of an object, as its header has them
+struct ObjectInfo {
+  Object::Type type;
+  size_t size;
 };
 
+// Parses the "<type> <size>" header of a loose object, without its NUL. Unknown types come back as Invalid;
+// nullopt when the header is malformed.
+std::optional<ObjectInfo> ParseObjectHeader(std::string_view header);
+
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <compare>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+// Writes two lowercase hex characters per input byte to out
+void HexEncode(std::span<const uint8_t> in, char* out);
+// Reads in.size() / 2 bytes to out; false when in has an odd length or a non-hex character
+bool HexDecode(std::string_view in, uint8_t* out);
+
+struct ObjectId : std::array<uint8_t, 20> {
+  ObjectId() : std::array<uint8_t, 20>{} {}
+  ObjectId(const std::array<uint8_t, 20>& bytes) : std::array<uint8_t, 20>(bytes) {}
+  static std::optional<ObjectId> fromHex(std::string_view hex) {
+    ObjectId id;
+    if (hex.size() != 40 || not HexDecode(hex, id.data())) return std::nullopt;
+    return id;
+  }
+  void hex(char* out) const { HexEncode(*this, out); }
+  std::string hex() const {
+    std::string rv(40, '\0');
+    hex(rv.data());
+    return rv;
+  }
+  // Big-endian word loads keep the order identical to memcmp; also usable on ids inside mapped tables
+  static std::strong_ordering compare(const uint8_t* lhs, const uint8_t* rhs) {
+    for (size_t n = 0; n < 16; n += 8) {
+      uint64_t l = load64(lhs + n), r = load64(rhs + n);
+      if (l != r) return l <=> r;
+    }
+    return load32(lhs + 16) <=> load32(rhs + 16);
+  }
+  friend std::strong_ordering operator<=>(const ObjectId& lhs, const ObjectId& rhs) {
+    return compare(lhs.data(), rhs.data());
+  }
+  friend bool operator==(const ObjectId& lhs, const ObjectId& rhs) {
+    return memcmp(lhs.data(), rhs.data(), 20) == 0;
+  }
+  // Exact matches for comparisons against plain arrays, which would otherwise be ambiguous with std::array's own
+  friend std::strong_ordering operator<=>(const ObjectId& lhs, const std::array<uint8_t, 20>& rhs) {
+    return compare(lhs.data(), rhs.data());
+  }
+  friend bool operator==(const ObjectId& lhs, const std::array<uint8_t, 20>& rhs) {
+    return memcmp(lhs.data(), rhs.data(), 20) == 0;
+  }
+private:
+  static uint64_t load64(const uint8_t* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    if constexpr (std::endian::native == std::endian::little) word = __builtin_bswap64(word);
+    return word;
+  }
+  static uint32_t load32(const uint8_t* p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    if constexpr (std::endian::native == std::endian::little) word = __builtin_bswap32(word);
+    return word;
+  }
+};
+
+// Ids are SHA-1 output, so their first bytes are already uniformly distributed
+template <>
+struct std::hash<ObjectId> {
+  size_t operator()(const ObjectId& id) const {
+    size_t hash;
+    memcpy(&hash, id.data(), sizeof(hash));
+    return hash;
+  }
+};
@@ -1,7 +1,97 @@
 #pragma once
 
-struct Pack {
+#include "piget/Object.hpp"
+#include "piget/MappedFile.hpp"
+#include "piget/Delta.hpp"
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+struct Database;
 
+struct PackObject {
+  ObjectId id;
+  // From PackNameHash of the path the object was found at; groups likely delta pairs
+  uint32_t nameHash = 0;
 };
 
+struct PackWriteOptions {
+  // Number of preceding candidates each object is tried against; 0 disables deltas
+  size_t window = 10;
+  size_t depth = 50;
+  // Threads that fetch and compress entries; 0 uses every core. The output does not depend on it.
+  size_t threads = 0;
+};
+
+uint32_t PackNameHash(std::string_view path);
+std::pair<std::vector<uint8_t>, std::vector<uint8_t>> WritePack(const Database& db, std::vector<PackObject> objects, const PackWriteOptions& options = {});
+std::pair<std::vector<uint8_t>, std::vector<uint8_t>> WritePack(const Database& db, std::vector<ObjectId> objectIds, const PackWriteOptions& options = {});
+
+// Builds the .idx of a complete pack in one pass over its entries and checks its trailing checksum.
+// Deltas are resolved on threads (0 uses every core) once their base is known; thin packs are rejected.
+std::vector<uint8_t> IndexPack(std::span<const uint8_t> pack, size_t threads = 0);
+// Reads a pack from a file or pipe into packDirectory and writes its .idx next to it, both synced.
+// Returns the path of the new .pack.
+std::filesystem::path IndexPack(int fd, const std::filesystem::path& packDirectory, size_t threads = 0);
+
+// Appends up to limit ids from a sorted idx-style table that start with prefix
+void FindIdsWithPrefix(const uint8_t* fanout, const uint8_t* ids, const IdPrefix& prefix, std::vector<ObjectId>& out, size_t limit);
+
+struct Pack {
+  Pack(std::filesystem::path packFile);
+  Pack(std::span<const uint8_t> data, std::span<const uint8_t> index);
+  Pack(Pack&&);
+  ~Pack();
+  struct IndexEntry {
+    ObjectId id;
+    std::array<uint8_t, 4> crc;
+    size_t offset;
+    Object::Type type;
+  };
+  std::optional<Object> get(ObjectId id);
+  // Reads the entry at a known pack offset, as found through a multi-pack-index
+  Object getAt(size_t offset);
+  // Type and size of the entry at offset, from its header and those of its delta bases
+  ObjectInfo infoAt(size_t offset) const;
+  // Inflates an entry piece by piece into out; false for deltas, which need their base in memory
+  bool streamAt(size_t offset, const std::function<void(std::span<const uint8_t>)>& out) const;
+  std::optional<size_t> find(const ObjectId& id) const;
+  // Where the id is in the index, for idAt and offsetAt
+  std::optional<size_t> position(const ObjectId& id) const;
+  void findPrefix(const IdPrefix& prefix, std::vector<ObjectId>& out, size_t limit) const;
+  size_t size() const { return objectCount; }
+  // Index entries in id order
+  ObjectId idAt(size_t n) const;
+  size_t offsetAt(size_t n) const;
+  // The SHA-1 trailer of the pack data, which names the pack
+  ObjectId checksum() const;
+  void setDeltaBaseCacheLimit(size_t bytes);
+private:
+  struct Unpacked {
+    Object::Type type;
+    std::shared_ptr<const std::vector<uint8_t>> data;
+  };
+  struct DeltaBaseCache;
+  bool LoadIndex(std::span<const uint8_t> in);
+  void RegenerateIndex();
+  std::optional<Unpacked> unpack(size_t offset, size_t depth = 0);
+  std::unique_ptr<DeltaBaseCache> baseCache;
+  MappedFile packMapping, indexMapping;
+  std::span<const uint8_t> data;
+  std::vector<uint8_t> regeneratedIndex;
+  // Tables of the .idx v2 file, referenced in place
+  const uint8_t* fanout = nullptr;
+  const uint8_t* ids = nullptr;
+  const uint8_t* crcs = nullptr;
+  const uint8_t* offsets = nullptr;
+  const uint8_t* largeOffsets = nullptr;
+  size_t largeOffsetCount = 0;
+  size_t objectCount = 0;
+};
 
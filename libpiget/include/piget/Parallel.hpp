@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+// Resolves a thread count knob, where 0 means one per core
+size_t WorkerCount(size_t requested);
+
+// Runs fn(0) .. fn(count - 1) on up to `threads` threads, the caller included. Indices are
+// handed out in increasing order. The first exception stops further work and is rethrown.
+void ParallelFor(size_t count, size_t threads, const std::function<void(size_t)>& fn);
+
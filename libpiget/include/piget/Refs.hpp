@@ -0,0 +1,35 @@
+#pragma once
+
+#include "piget/ObjectId.hpp"
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct Database;
+
+struct PackedRef {
+  std::string name;
+  ObjectId id;
+  // What an annotated tag points to, when packed-refs records it
+  std::optional<ObjectId> peeled;
+};
+
+// The refs in a .git directory's packed-refs file, in file order; empty when there is none
+std::vector<PackedRef> ReadPackedRefs(const std::filesystem::path& gitDir);
+
+// The object a ref such as HEAD or refs/heads/main names, following symbolic refs. Loose ref files take
+// precedence over packed-refs, like in git. nullopt for unknown refs and unborn branches.
+std::optional<ObjectId> ReadRef(const std::filesystem::path& gitDir, const std::string& ref);
+
+// The ref a symbolic ref such as HEAD points to, or nullopt when it is detached or missing
+std::optional<std::string> ReadSymbolicRef(const std::filesystem::path& gitDir, const std::string& ref);
+
+// Every object id the refs, packed-refs, HEAD and reflogs of a .git directory name
+std::vector<ObjectId> ReadRefTips(const std::filesystem::path& gitDir);
+
+// HEAD, a ref, branch or tag name, or an abbreviated object id. Names are tried in git's order, so a tag wins
+// over a branch of the same name. nullopt for names that match nothing, including an unborn HEAD; throws when
+// an abbreviation is ambiguous.
+std::optional<ObjectId> ResolveRevision(const std::filesystem::path& gitDir, const Database& db, std::string_view name);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "piget/GitCAM.hpp"
+#include "piget/Pack.hpp"
+#include "piget/Refs.hpp"
+#include <chrono>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+struct RepackOptions {
+  // Unreachable objects younger than this survive, as another process may be about to reference them
+  std::chrono::seconds gracePeriod = std::chrono::hours(24 * 14);
+  PackWriteOptions pack;
+  // Writes a .bitmap next to the new pack, so later reachability queries can skip the object walk
+  bool writeBitmap = true;
+};
+
+struct RepackResult {
+  size_t packed = 0;
+  // Loose objects deleted, whether now packed or unreachable
+  size_t pruned = 0;
+  // Empty when nothing was reachable and no pack was written
+  std::filesystem::path pack;
+};
+
+// Packs everything reachable from the refs and extraTips into one new pack, then removes the packs it replaces
+// and the loose objects that are now packed or unreachable for longer than the grace period. Packs with a
+// .keep file are left alone.
+RepackResult Repack(const std::filesystem::path& gitDir, std::span<const ObjectId> extraTips = {}, const RepackOptions& options = {});
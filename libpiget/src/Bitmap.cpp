@@ -0,0 +1,404 @@
+#include "piget/Bitmap.hpp"
+#include "piget/GitCAM.hpp"
+#include "piget/Pack.hpp"
+#include "piget/FileIO.hpp"
+#include "bini/writer.h"
+#include <caligo/sha1.h>
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+
+static constexpr uint32_t BITMAP_SIGNATURE = 0x4249544D;
+static constexpr uint16_t BITMAP_OPT_FULL_DAG = 0x1;
+static constexpr uint16_t BITMAP_OPT_HASH_CACHE = 0x4;
+// git refers no further back than this from one entry to the one it is XORed with
+static constexpr size_t MAX_XOR_OFFSET = 160;
+// Below the tips, a bitmap for every this many commits keeps walks to the nearest one short
+static constexpr size_t COMMIT_SPACING = 100;
+
+void Bitmap::set(size_t bit) {
+  if (bit / 64 >= words.size()) words.resize(bit / 64 + 1);
+  words[bit / 64] |= uint64_t(1) << (bit % 64);
+}
+
+bool Bitmap::test(size_t bit) const {
+  return bit / 64 < words.size() && (words[bit / 64] >> (bit % 64)) & 1;
+}
+
+Bitmap& Bitmap::operator|=(const Bitmap& rhs) {
+  if (rhs.words.size() > words.size()) words.resize(rhs.words.size());
+  for (size_t n = 0; n < rhs.words.size(); n++) {
+    words[n] |= rhs.words[n];
+  }
+  return *this;
+}
+
+Bitmap& Bitmap::operator^=(const Bitmap& rhs) {
+  if (rhs.words.size() > words.size()) words.resize(rhs.words.size());
+  for (size_t n = 0; n < rhs.words.size(); n++) {
+    words[n] ^= rhs.words[n];
+  }
+  return *this;
+}
+
+void Bitmap::andNot(const Bitmap& rhs) {
+  for (size_t n = 0; n < std::min(words.size(), rhs.words.size()); n++) {
+    words[n] &= ~rhs.words[n];
+  }
+}
+
+std::vector<uint8_t> EwahEncode(const Bitmap& bitmap, size_t bitCount) {
+  size_t wordCount = (bitCount + 63) / 64;
+  auto word = [&](size_t n) { return n < bitmap.words.size() ? bitmap.words[n] : 0; };
+  // Each marker word holds the fill bit, the length of a run of all-0 or all-1 words and how many literal words follow
+  std::vector<uint64_t> encoded;
+  size_t lastMarker = 0;
+  size_t n = 0;
+  do {
+    lastMarker = encoded.size();
+    encoded.push_back(0);
+    uint64_t fill = word(n) == ~uint64_t(0) ? 1 : 0;
+    uint64_t run = 0;
+    while (n < wordCount && word(n) == (fill ? ~uint64_t(0) : 0) && run < 0xFFFF'FFFF) {
+      run++;
+      n++;
+    }
+    uint64_t literals = 0;
+    while (n < wordCount && word(n) != 0 && word(n) != ~uint64_t(0) && literals < 0x7FFF'FFFF) {
+      encoded.push_back(word(n));
+      literals++;
+      n++;
+    }
+    encoded[lastMarker] = fill | (run << 1) | (literals << 33);
+  } while (n < wordCount);
+
+  Bini::writer out;
+  out.add32be(bitCount);
+  out.add32be(encoded.size());
+  for (auto w : encoded) {
+    out.add64be(w);
+  }
+  out.add32be(lastMarker);
+  return out;
+}
+
+size_t EwahDecode(std::span<const uint8_t> in, Bitmap& out) {
+  if (in.size() < 12) {
+    throw std::runtime_error("Invalid EWAH bitmap");
+  }
+  size_t bitCount = ReadBE32(in.data()), wordCount = ReadBE32(in.data() + 4);
+  if ((in.size() - 12) / 8 < wordCount) {
+    throw std::runtime_error("Invalid EWAH bitmap");
+  }
+  const uint8_t* encoded = in.data() + 8;
+  out.words.assign((bitCount + 63) / 64, 0);
+  size_t position = 0;
+  for (size_t n = 0; n < wordCount;) {
+    uint64_t marker = ReadBE64(encoded + 8 * n++);
+    uint64_t run = (marker >> 1) & 0xFFFF'FFFF, literals = marker >> 33;
+    if (run + literals > out.words.size() - position || literals > wordCount - n) {
+      throw std::runtime_error("Invalid EWAH bitmap");
+    }
+    if (marker & 1) {
+      std::fill_n(out.words.begin() + position, run, ~uint64_t(0));
+    }
+    position += run;
+    for (; literals; literals--) {
+      out.words[position++] = ReadBE64(encoded + 8 * n++);
+    }
+  }
+  return 8 + wordCount * 8 + 4;
+}
+
+// Size of the EWAH bitmap at the start of in, without decoding it
+static size_t ewahSize(std::span<const uint8_t> in) {
+  if (in.size() < 12 || (in.size() - 12) / 8 < ReadBE32(in.data() + 4)) {
+    throw std::runtime_error("Invalid EWAH bitmap");
+  }
+  return 8 + size_t(ReadBE32(in.data() + 4)) * 8 + 4;
+}
+
+PackBitmap::PackBitmap(const Pack& pack)
+: pack(pack)
+{
+  orderByOffset();
+}
+
+PackBitmap::PackBitmap(const Pack& pack, std::filesystem::path file)
+: pack(pack)
+, mapping(file)
+{
+  orderByOffset();
+  static constexpr size_t headerSize = 32;
+  std::span<const uint8_t> in = mapping.data();
+  if (in.size() < headerSize + 20 ||
+      ReadBE32(in.data()) != BITMAP_SIGNATURE ||
+      in[4] != 0 || in[5] != 1 ||
+      memcmp(pack.checksum().data(), in.data() + 12, 20) != 0) {
+    throw std::runtime_error("Invalid pack bitmap");
+  }
+  uint16_t options = (in[6] << 8) | in[7];
+  size_t entryCount = ReadBE32(in.data() + 8);
+  // Everything is checked against the end before the trailer
+  in = in.subspan(headerSize, in.size() - headerSize - 20);
+
+  try {
+    // The per-type bitmaps are not needed to answer reachability, and commit bitmaps are decoded when asked for
+    for (size_t type = 0; type < 4; type++) {
+      in = in.subspan(ewahSize(in));
+    }
+    for (size_t n = 0; n < entryCount; n++) {
+      if (in.size() < 6) {
+        throw std::runtime_error("Invalid pack bitmap");
+      }
+      size_t position = ReadBE32(in.data());
+      uint8_t xorOffset = in[4];
+      if (position >= pack.size() || xorOffset > n || xorOffset > MAX_XOR_OFFSET) {
+        throw std::runtime_error("Invalid pack bitmap");
+      }
+      entries.push_back({size_t(in.data() + 6 - mapping.data().data()), xorOffset});
+      commits.emplace(pack.idAt(position), n);
+      in = in.subspan(6);
+      in = in.subspan(ewahSize(in));
+    }
+  } catch (std::exception&) {
+    throw std::runtime_error("Invalid pack bitmap");
+  }
+  if (options & BITMAP_OPT_HASH_CACHE) {
+    if (in.size() < pack.size() * 4) {
+      throw std::runtime_error("Invalid pack bitmap");
+    }
+    nameHashes = in.data();
+  }
+}
+
+void PackBitmap::orderByOffset() {
+  indexPositions.resize(pack.size());
+  std::iota(indexPositions.begin(), indexPositions.end(), 0);
+  std::sort(indexPositions.begin(), indexPositions.end(), [&](uint32_t lhs, uint32_t rhs) {
+    return pack.offsetAt(lhs) < pack.offsetAt(rhs);
+  });
+  bits.resize(pack.size());
+  for (size_t bit = 0; bit < indexPositions.size(); bit++) {
+    bits[indexPositions[bit]] = bit;
+  }
+}
+
+std::optional<uint32_t> PackBitmap::bitFor(const ObjectId& id) const {
+  auto position = pack.position(id);
+  if (not position) return std::nullopt;
+  return bits[*position];
+}
+
+ObjectId PackBitmap::idAt(uint32_t bit) const {
+  return pack.idAt(indexPositions[bit]);
+}
+
+uint32_t PackBitmap::nameHashAt(uint32_t bit) const {
+  return nameHashes ? ReadBE32(nameHashes + indexPositions[bit] * 4) : 0;
+}
+
+Bitmap PackBitmap::decode(size_t entry) const {
+  Bitmap bitmap;
+  EwahDecode(mapping.data().subspan(entries[entry].offset), bitmap);
+  // entries may be stored as the difference to one before them
+  if (entries[entry].xorOffset) {
+    bitmap ^= decode(entry - entries[entry].xorOffset);
+  }
+  return bitmap;
+}
+
+std::optional<Bitmap> PackBitmap::commitBitmap(const ObjectId& commit) const {
+  auto it = commits.find(commit);
+  if (it == commits.end()) return std::nullopt;
+  if (entries.empty()) return built[it->second].second;
+  return decode(it->second);
+}
+
+void WalkReachable(const Database& db, const PackBitmap* bitmap, std::span<const ObjectId> tips, ReachableSet& set,
+                   const ReachableSet* exclude,
+                   const std::function<void(const ObjectId& id, Object::Type type, uint32_t nameHash)>& visit) {
+  struct Pending {
+    ObjectId id;
+    std::string path;
+    // Invalid for tips and tag targets, whose type is only known once they are read
+    Object::Type type = Object::Type::Invalid;
+  };
+  std::vector<Pending> stack;
+  for (auto& tip : tips) {
+    stack.push_back({tip, "", Object::Type::Invalid});
+  }
+  while (not stack.empty()) {
+    Pending next = std::move(stack.back());
+    stack.pop_back();
+    std::optional<uint32_t> bit = bitmap ? bitmap->bitFor(next.id) : std::nullopt;
+    if (exclude && (bit ? exclude->bits.test(*bit) : exclude->extra.contains(next.id))) continue;
+    if (bit ? set.bits.test(*bit) : set.extra.contains(next.id)) continue;
+    bool mayBeCommit = next.type != Object::Type::Tree && next.type != Object::Type::Object;
+    if (bit && mayBeCommit) {
+      if (auto reachable = bitmap->commitBitmap(next.id)) {
+        set.bits |= *reachable;
+        continue;
+      }
+    }
+
+    // Blobs only have to exist; they are never read
+    std::shared_ptr<const Object> object;
+    std::optional<CommitInfo> commit;
+    Object::Type type = next.type;
+    if (type == Object::Type::Object) {
+      if (not db.contains(next.id)) type = Object::Type::Invalid;
+    } else if (type == Object::Type::Commit) {
+      if (not (commit = db.commitInfo(next.id))) type = Object::Type::Invalid;
+    } else if ((object = db.getShared(next.id))) {
+      type = object->type();
+      if (type == Object::Type::Commit) commit = db.commitInfo(next.id);
+    }
+    if (type == Object::Type::Invalid) {
+      throw std::runtime_error("Reachable object " + next.id.hex() + " is missing");
+    }
+
+    uint32_t nameHash = PackNameHash(next.path);
+    if (bit) {
+      set.bits.set(*bit);
+    } else {
+      set.extra.emplace(next.id, nameHash);
+    }
+    if (visit) visit(next.id, type, nameHash);
+
+    switch (type) {
+    case Object::Type::Commit:
+      stack.push_back({commit->root, "", Object::Type::Tree});
+      for (auto& parent : commit->parents) {
+        stack.push_back({parent, "", Object::Type::Commit});
+      }
+      break;
+    case Object::Type::Tree:
+      for (auto& entry : object->viewAsTree()) {
+        // submodule commits live in another repository
+        if (entry.fileMode == 0160000) continue;
+        std::string path = next.path;
+        if (not path.empty()) path += '/';
+        path += entry.fileName;
+        stack.push_back({entry.hash, std::move(path), entry.fileMode == 040000 ? Object::Type::Tree : Object::Type::Object});
+      }
+      break;
+    case Object::Type::Tag: {
+      std::string_view header((const char*)object->data().data(), object->data().size());
+      if (header.starts_with("object ")) {
+        auto target = ObjectId::fromHex(header.substr(7, 40));
+        if (target) stack.push_back({*target, "", Object::Type::Invalid});
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+}
+
+void WritePackBitmap(const Database& db, const std::filesystem::path& packFile, std::span<const ObjectId> tips) {
+  Pack pack(packFile);
+  PackBitmap bitmap(pack);
+
+  // One plain walk finds the type and name of every object the tips reach
+  std::vector<Object::Type> types(pack.size(), Object::Type::Invalid);
+  std::vector<uint32_t> nameHashes(pack.size());
+  std::vector<ObjectId> tipCommits;
+  std::unordered_set<ObjectId> tipSet(tips.begin(), tips.end());
+  {
+    ReachableSet everything;
+    WalkReachable(db, &bitmap, tips, everything, nullptr, [&](const ObjectId& id, Object::Type type, uint32_t nameHash) {
+      auto position = pack.position(id);
+      if (position) {
+        types[*position] = type;
+        nameHashes[*position] = nameHash;
+      }
+      if (type == Object::Type::Commit && tipSet.contains(id)) tipCommits.push_back(id);
+    });
+  }
+  // and the pack itself knows the rest
+  for (size_t n = 0; n < pack.size(); n++) {
+    if (types[n] == Object::Type::Invalid) types[n] = pack.getAt(pack.offsetAt(n)).type();
+  }
+
+  // Commits of the pack with parents before children, so every bitmap can build on the ones below it
+  std::vector<ObjectId> order;
+  std::unordered_map<ObjectId, CommitInfo> infos;
+  std::unordered_set<ObjectId> done;
+  for (auto& tip : tipCommits) {
+    std::vector<ObjectId> work = { tip };
+    while (not work.empty()) {
+      ObjectId id = work.back();
+      if (done.contains(id)) {
+        work.pop_back();
+        continue;
+      }
+      auto it = infos.find(id);
+      if (it == infos.end()) {
+        it = infos.emplace(id, *db.commitInfo(id)).first;
+        for (auto& parent : it->second.parents) {
+          if (not done.contains(parent) && pack.position(parent)) work.push_back(parent);
+        }
+        continue;
+      }
+      done.insert(id);
+      order.push_back(id);
+      work.pop_back();
+    }
+  }
+
+  std::vector<bool> selected(order.size());
+  for (size_t n = 0; n < order.size(); n++) {
+    selected[n] = tipSet.contains(order[n]) || (order.size() - n) % COMMIT_SPACING == 0;
+  }
+  for (size_t n = 0; n < order.size(); n++) {
+    if (not selected[n] || bitmap.commits.contains(order[n])) continue;
+    ReachableSet reachable;
+    WalkReachable(db, &bitmap, std::span<const ObjectId>(&order[n], 1), reachable);
+    // A bitmap has to cover everything below its commit, so commits that reach outside the pack get none
+    if (not reachable.extra.empty()) continue;
+    bitmap.commits.emplace(order[n], bitmap.built.size());
+    bitmap.built.emplace_back(order[n], std::move(reachable.bits));
+  }
+
+  Bitmap commitBits, treeBits, blobBits, tagBits;
+  for (size_t n = 0; n < pack.size(); n++) {
+    switch (types[n]) {
+    case Object::Type::Commit: commitBits.set(bitmap.bits[n]); break;
+    case Object::Type::Tree: treeBits.set(bitmap.bits[n]); break;
+    case Object::Type::Object: blobBits.set(bitmap.bits[n]); break;
+    case Object::Type::Tag: tagBits.set(bitmap.bits[n]); break;
+    default: break;
+    }
+  }
+
+  Bini::writer out;
+  out.add32be(BITMAP_SIGNATURE);
+  out.add16be(1);
+  out.add16be(BITMAP_OPT_FULL_DAG | BITMAP_OPT_HASH_CACHE);
+  out.add32be(bitmap.built.size());
+  out.add(pack.checksum());
+  for (auto* typeBits : { &commitBits, &treeBits, &blobBits, &tagBits }) {
+    out.add(EwahEncode(*typeBits, pack.size()));
+  }
+  for (auto& [id, bits] : bitmap.built) {
+    out.add32be(*pack.position(id));
+    out.add8(0);
+    out.add8(0);
+    out.add(EwahEncode(bits, pack.size()));
+  }
+  for (auto hash : nameHashes) {
+    out.add32be(hash);
+  }
+  std::array<uint8_t, 20> checksum = Caligo::SHA1(out).data();
+  out.add(checksum);
+
+  std::filesystem::path file = std::filesystem::path(packFile).replace_extension(".bitmap");
+  LockFile lock(file);
+  lock.write(out);
+  lock.commit();
+}
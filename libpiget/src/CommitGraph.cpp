@@ -0,0 +1,267 @@
+#include "piget/CommitGraph.hpp"
+#include "piget/FileIO.hpp"
+#include "piget/GitCAM.hpp"
+#include "piget/Object.hpp"
+#include "bini/writer.h"
+#include <caligo/sha1.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+static constexpr uint32_t GRAPH_SIGNATURE = 0x43475048;
+static constexpr uint32_t GRAPH_CHUNK_OIDFANOUT = 0x4F494446;
+static constexpr uint32_t GRAPH_CHUNK_OIDLOOKUP = 0x4F49444C;
+static constexpr uint32_t GRAPH_CHUNK_DATA = 0x43444154;
+static constexpr uint32_t GRAPH_CHUNK_EXTRAEDGES = 0x45444745;
+static constexpr uint32_t GRAPH_PARENT_NONE = 0x7000'0000;
+static constexpr uint32_t GRAPH_EXTRA_EDGES = 0x8000'0000;
+static constexpr uint32_t GRAPH_LAST_EDGE = 0x8000'0000;
+static constexpr uint32_t GENERATION_MAX = 0x3FFF'FFFF;
+// Root tree, two parents, generation with the top bits of the time, low bits of the time
+static constexpr size_t GRAPH_DATA_SIZE = 36;
+
+CommitGraph::CommitGraph(std::filesystem::path file)
+: mapping(file)
+{
+  static constexpr size_t headerSize = 8, chunkEntrySize = 12;
+  std::span<const uint8_t> in = mapping.data();
+  if (in.size() < headerSize + 20 ||
+      ReadBE32(in.data()) != GRAPH_SIGNATURE ||
+      in[4] != 1 || in[5] != 1) {
+    throw std::runtime_error("Invalid commit-graph");
+  }
+  size_t chunkCount = in[6];
+  if (headerSize + (chunkCount + 1) * chunkEntrySize > in.size() - 20) {
+    throw std::runtime_error("Invalid commit-graph");
+  }
+
+  std::span<const uint8_t> oidFanout, oidLookup, dataTable, edgeTable;
+  for (size_t n = 0; n < chunkCount; n++) {
+    const uint8_t* entry = in.data() + headerSize + n * chunkEntrySize;
+    uint64_t start = ReadBE64(entry + 4), end = ReadBE64(entry + chunkEntrySize + 4);
+    if (start > end || end > in.size() - 20) {
+      throw std::runtime_error("Invalid commit-graph");
+    }
+    std::span<const uint8_t> chunk = in.subspan(start, end - start);
+    switch (ReadBE32(entry)) {
+    case GRAPH_CHUNK_OIDFANOUT: oidFanout = chunk; break;
+    case GRAPH_CHUNK_OIDLOOKUP: oidLookup = chunk; break;
+    case GRAPH_CHUNK_DATA: dataTable = chunk; break;
+    case GRAPH_CHUNK_EXTRAEDGES: edgeTable = chunk; break;
+    default: break;
+    }
+  }
+  if (oidFanout.size() != 256 * 4) {
+    throw std::runtime_error("Invalid commit-graph");
+  }
+  commitCount = ReadBE32(oidFanout.data() + 255 * 4);
+  if (oidLookup.size() != commitCount * 20 || dataTable.size() != commitCount * GRAPH_DATA_SIZE) {
+    throw std::runtime_error("Invalid commit-graph");
+  }
+  fanout = oidFanout.data();
+  ids = oidLookup.data();
+  commitData = dataTable.data();
+  extraEdges = edgeTable.data();
+  extraEdgeCount = edgeTable.size() / 4;
+}
+
+std::optional<uint32_t> CommitGraph::find(const ObjectId& id) const {
+  size_t low = id[0] ? ReadBE32(fanout + (id[0] - 1) * 4) : 0;
+  size_t high = ReadBE32(fanout + id[0] * 4);
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    auto cmp = ObjectId::compare(ids + mid * 20, id.data());
+    if (cmp == 0) return mid;
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return std::nullopt;
+}
+
+ObjectId CommitGraph::idAt(uint32_t position) const {
+  ObjectId id;
+  memcpy(id.data(), ids + position * 20, 20);
+  return id;
+}
+
+ObjectId CommitGraph::rootAt(uint32_t position) const {
+  ObjectId id;
+  memcpy(id.data(), commitData + position * GRAPH_DATA_SIZE, 20);
+  return id;
+}
+
+uint32_t CommitGraph::generationAt(uint32_t position) const {
+  return ReadBE32(commitData + position * GRAPH_DATA_SIZE + 28) >> 2;
+}
+
+int64_t CommitGraph::timeAt(uint32_t position) const {
+  const uint8_t* row = commitData + position * GRAPH_DATA_SIZE;
+  return (int64_t(ReadBE32(row + 28) & 3) << 32) | ReadBE32(row + 32);
+}
+
+void CommitGraph::parentsAt(uint32_t position, std::vector<uint32_t>& out) const {
+  const uint8_t* row = commitData + position * GRAPH_DATA_SIZE;
+  uint32_t first = ReadBE32(row + 20), second = ReadBE32(row + 24);
+  if (first == GRAPH_PARENT_NONE) return;
+  out.push_back(first);
+  if (second == GRAPH_PARENT_NONE) return;
+  if ((second & GRAPH_EXTRA_EDGES) == 0) {
+    out.push_back(second);
+    return;
+  }
+  // octopus merges keep the parents after the first in the extra edge list
+  for (size_t edge = second & ~GRAPH_EXTRA_EDGES; edge < extraEdgeCount; edge++) {
+    uint32_t parent = ReadBE32(extraEdges + edge * 4);
+    out.push_back(parent & ~GRAPH_LAST_EDGE);
+    if (parent & GRAPH_LAST_EDGE) return;
+  }
+  throw std::runtime_error("commit-graph corrupted");
+}
+
+bool CommitGraph::isAncestor(uint32_t ancestor, uint32_t descendant) const {
+  // Generations strictly decrease towards the roots, so nothing at or below the ancestor's level can lead to it
+  uint32_t floor = generationAt(ancestor);
+  std::vector<bool> seen(commitCount);
+  std::vector<uint32_t> stack = { descendant }, parents;
+  while (not stack.empty()) {
+    uint32_t position = stack.back();
+    stack.pop_back();
+    if (position == ancestor) return true;
+    if (seen[position] || generationAt(position) <= floor) continue;
+    seen[position] = true;
+    parentsAt(position, stack);
+  }
+  return false;
+}
+
+void WriteCommitGraph(const Database& db, std::filesystem::path objectDirectory, std::span<const ObjectId> tips) {
+  std::vector<ObjectId> stack;
+  for (auto& tip : tips) {
+    // annotated tags are peeled down to what they point at; trees and blobs are not part of the graph
+    std::optional<ObjectId> id = tip;
+    while (id) {
+      auto object = db.getShared(*id);
+      if (not object || object->type() == Object::Type::Commit) break;
+      std::string_view header((const char*)object->data().data(), object->data().size());
+      id = object->type() == Object::Type::Tag && header.starts_with("object ") ? ObjectId::fromHex(header.substr(7, 40)) : std::nullopt;
+    }
+    if (id) stack.push_back(*id);
+  }
+
+  // Reading through the database reuses rows of an existing graph for the commits it already covers
+  std::unordered_map<ObjectId, CommitInfo> commits;
+  while (not stack.empty()) {
+    ObjectId id = stack.back();
+    stack.pop_back();
+    if (commits.contains(id)) continue;
+    auto info = db.commitInfo(id);
+    if (not info) {
+      throw std::runtime_error("Commit " + id.hex() + " is missing");
+    }
+    stack.insert(stack.end(), info->parents.begin(), info->parents.end());
+    commits.emplace(id, std::move(*info));
+  }
+
+  std::vector<ObjectId> order;
+  for (auto& [id, info] : commits) {
+    order.push_back(id);
+  }
+  std::sort(order.begin(), order.end());
+  std::vector<std::vector<uint32_t>> parents(order.size());
+  for (size_t n = 0; n < order.size(); n++) {
+    for (auto& parent : commits[order[n]].parents) {
+      parents[n].push_back(std::lower_bound(order.begin(), order.end(), parent) - order.begin());
+    }
+  }
+
+  // Parents are finished before their children, without recursing down long histories
+  std::vector<uint32_t> generation(order.size());
+  for (size_t start = 0; start < order.size(); start++) {
+    std::vector<size_t> work = { start };
+    while (not work.empty()) {
+      size_t n = work.back();
+      if (generation[n]) {
+        work.pop_back();
+        continue;
+      }
+      uint32_t level = 1;
+      bool ready = true;
+      for (auto parent : parents[n]) {
+        if (generation[parent] == 0) {
+          work.push_back(parent);
+          ready = false;
+        } else {
+          level = std::max(level, std::min(generation[parent] + 1, GENERATION_MAX));
+        }
+      }
+      if (ready) {
+        generation[n] = level;
+        work.pop_back();
+      }
+    }
+  }
+
+  Bini::writer oidFanout, oidLookup, commitTable, edges;
+  size_t next = 0;
+  for (size_t byte = 0; byte < 256; byte++) {
+    while (next < order.size() && order[next][0] == byte) next++;
+    oidFanout.add32be(next);
+  }
+  for (size_t n = 0; n < order.size(); n++) {
+    const CommitInfo& info = commits[order[n]];
+    oidLookup.add(order[n]);
+    commitTable.add(info.root);
+    commitTable.add32be(parents[n].size() > 0 ? parents[n][0] : GRAPH_PARENT_NONE);
+    if (parents[n].size() <= 2) {
+      commitTable.add32be(parents[n].size() == 2 ? parents[n][1] : GRAPH_PARENT_NONE);
+    } else {
+      commitTable.add32be(GRAPH_EXTRA_EDGES | (edges.size() / 4));
+      for (size_t parent = 1; parent < parents[n].size(); parent++) {
+        edges.add32be(parents[n][parent] | (parent + 1 == parents[n].size() ? GRAPH_LAST_EDGE : 0));
+      }
+    }
+    uint64_t time = info.time;
+    commitTable.add32be((generation[n] << 2) | ((time >> 32) & 3));
+    commitTable.add32be(time & 0xFFFF'FFFF);
+  }
+
+  std::vector<std::pair<uint32_t, const Bini::writer*>> chunks = {
+    { GRAPH_CHUNK_OIDFANOUT, &oidFanout },
+    { GRAPH_CHUNK_OIDLOOKUP, &oidLookup },
+    { GRAPH_CHUNK_DATA, &commitTable },
+  };
+  if (not edges.empty()) {
+    chunks.push_back({ GRAPH_CHUNK_EXTRAEDGES, &edges });
+  }
+
+  Bini::writer out;
+  out.add32be(GRAPH_SIGNATURE);
+  out.add8(1);
+  out.add8(1);
+  out.add8(chunks.size());
+  out.add8(0);
+  uint64_t offset = 8 + (chunks.size() + 1) * 12;
+  for (auto& [id, chunk] : chunks) {
+    out.add32be(id);
+    out.add64be(offset);
+    offset += chunk->size();
+  }
+  out.add32be(0);
+  out.add64be(offset);
+  for (auto& [id, chunk] : chunks) {
+    out.add(*chunk);
+  }
+  std::array<uint8_t, 20> checksum = Caligo::SHA1(out).data();
+  out.add(checksum);
+
+  std::filesystem::path infoDirectory = objectDirectory / "info";
+  std::filesystem::create_directories(infoDirectory);
+  std::filesystem::path file = infoDirectory / "commit-graph";
+  LockFile lock(file);
+  lock.write(out);
+  lock.commit();
+}
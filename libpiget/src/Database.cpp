@@ -1,29 +1,560 @@
 #include "piget/GitCAM.hpp"
 #include "piget/Object.hpp"
+#include "piget/Pack.hpp"
+#include "piget/MultiPackIndex.hpp"
+#include "piget/CommitGraph.hpp"
+#include "piget/Bitmap.hpp"
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+
+// Bounds the memory spent remembering misses; the set simply starts over when full
+static constexpr size_t MAX_MISSING_IDS = 65536;
+
+static std::optional<ObjectId> parseLooseName(uint8_t firstByte, std::string_view name) {
+  ObjectId id;
+  id[0] = firstByte;
+  if (name.size() != 38 || not HexDecode(name, id.data() + 1)) return std::nullopt;
+  return id;
+}
+
+struct Database::LookupCache {
+  // Lists every fanout directory once; the caller holds the mutex
+  void scan(const std::filesystem::path& root) {
+    if (scanned) return;
+    unlisted = false;
+    static constexpr char hex[] = "0123456789abcdef";
+    for (size_t byte = 0; byte < 256; byte++) {
+      std::error_code ec;
+      std::string fanout = { hex[byte >> 4], hex[byte & 0xF] };
+      for (auto& entry : std::filesystem::directory_iterator(root / fanout, ec)) {
+        if (auto looseId = parseLooseName(byte, entry.path().filename().string())) {
+          loose.insert(*looseId);
+        }
+      }
+    }
+    scanned = true;
+  }
+  // Objects written through the GitCAM but not through Database::add can be any of the misses, and missing from
+  // the listing; the caller holds the mutex
+  void noticeWrites(size_t camWrites) {
+    if (camWrites == seenWrites) return;
+    seenWrites = camWrites;
+    missing.clear();
+    unlisted = scanned;
+  }
+  std::mutex mutex;
+  bool scanned = false;
+  // Loose objects may exist that the listing lacks, until the next scan
+  bool unlisted = false;
+  size_t seenWrites = 0;
+  std::unordered_set<ObjectId> loose, missing;
+};
+
+// Decoded objects by id, least recently used first out once over the byte budget
+struct Database::ObjectCache {
+  struct Entry {
+    ObjectId id;
+    std::shared_ptr<const Object> object;
+  };
+  std::shared_ptr<const Object> get(const ObjectId& id) {
+    std::lock_guard<std::mutex> l(m);
+    auto it = entries.find(id);
+    if (it == entries.end()) {
+      misses++;
+      return nullptr;
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->object;
+  }
+  void put(const ObjectId& id, std::shared_ptr<const Object> object) {
+    size_t size = object->buffer.size();
+    std::lock_guard<std::mutex> l(m);
+    if (size > maxSize(object->type()) || size > policy.byteLimit || entries.contains(id)) return;
+    lru.push_front({id, std::move(object)});
+    entries[id] = lru.begin();
+    bytes += size;
+    shrink();
+  }
+  void setPolicy(const ObjectCachePolicy& newPolicy) {
+    std::lock_guard<std::mutex> l(m);
+    policy = newPolicy;
+    // entries of types the new policy no longer wants are dropped right away
+    for (auto it = lru.begin(); it != lru.end();) {
+      if (it->object->buffer.size() > maxSize(it->object->type())) {
+        bytes -= it->object->buffer.size();
+        entries.erase(it->id);
+        it = lru.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    shrink();
+  }
+  ObjectCacheStats stats() {
+    std::lock_guard<std::mutex> l(m);
+    return { hits, misses, entries.size(), bytes };
+  }
+private:
+  size_t maxSize(Object::Type type) const {
+    switch (type) {
+    case Object::Type::Commit: return policy.maxCommitSize;
+    case Object::Type::Tree: return policy.maxTreeSize;
+    case Object::Type::Object: return policy.maxBlobSize;
+    case Object::Type::Tag: return policy.maxTagSize;
+    default: return 0;
+    }
+  }
+  void shrink() {
+    while (bytes > policy.byteLimit) {
+      bytes -= lru.back().object->buffer.size();
+      entries.erase(lru.back().id);
+      lru.pop_back();
+    }
+  }
+  std::mutex m;
+  ObjectCachePolicy policy;
+  std::list<Entry> lru;
+  std::unordered_map<ObjectId, std::list<Entry>::iterator> entries;
+  size_t bytes = 0;
+  size_t hits = 0, misses = 0;
+};
+
 
 Database::Database(std::filesystem::path root) 
 : cam(root)
+, lookup(std::make_unique<LookupCache>())
+, objectCache(std::make_unique<ObjectCache>())
 {
-  // TODO: read all pack indexes
+  std::error_code ec;
+  for (auto& entry : std::filesystem::directory_iterator(root / "pack", ec)) {
+    if (entry.path().extension() == ".pack") {
+      packFiles.push_back(entry.path());
+    }
+  }
+  std::sort(packFiles.begin(), packFiles.end());
+  for (auto& file : packFiles) {
+    packs.push_back(std::make_unique<Pack>(file));
+  }
+
+  if (std::filesystem::is_regular_file(root / "pack" / "multi-pack-index")) {
+    try {
+      multiPackIndex = std::make_unique<MultiPackIndex>(root / "pack" / "multi-pack-index");
+    } catch (std::exception&) {
+      // an unreadable index only costs speed; every pack is still searched on its own
+    }
+  }
+  if (std::filesystem::is_regular_file(root / "info" / "commit-graph")) {
+    try {
+      commitGraph = std::make_unique<CommitGraph>(root / "info" / "commit-graph");
+    } catch (std::exception&) {
+      // commits are then read from their objects
+    }
+  }
+  std::vector<bool> indexed(packs.size());
+  if (multiPackIndex) {
+    for (auto& name : multiPackIndex->packNames()) {
+      std::filesystem::path packFile = (root / "pack" / name).replace_extension(".pack");
+      auto it = std::lower_bound(packFiles.begin(), packFiles.end(), packFile);
+      if (it == packFiles.end() || *it != packFile) {
+        // written before a repack removed one of its packs
+        multiPackIndex.reset();
+        indexedPacks.clear();
+        std::fill(indexed.begin(), indexed.end(), false);
+        break;
+      }
+      indexedPacks.push_back(packs[it - packFiles.begin()].get());
+      indexed[it - packFiles.begin()] = true;
+    }
+  }
+  for (size_t n = 0; n < packs.size(); n++) {
+    if (not indexed[n]) unindexedPacks.push_back(packs[n].get());
+  }
+}
+
+Database::~Database() = default;
+
+bool Database::maybeLoose(const ObjectId& id) const {
+  std::lock_guard<std::mutex> lock(lookup->mutex);
+  lookup->noticeWrites(cam.writes());
+  lookup->scan(cam.root);
+  return lookup->loose.contains(id);
 }
 
-std::optional<Object> Database::get(std::array<uint8_t, 20> id) const {
-  // logic: often-used objects should be in separate files, so we look there first
-  auto rv = cam.get(id);
-  if (rv) return rv;
-  for (auto& p : packs) {
-    auto obj = p->get(id);
-    if (obj) return obj;
+std::optional<std::pair<Pack*, size_t>> Database::findPacked(const ObjectId& id) const {
+  if (multiPackIndex) {
+    auto location = multiPackIndex->find(id);
+    if (location) return std::make_pair(indexedPacks[location->pack], location->offset);
+  }
+  for (auto& p : unindexedPacks) {
+    auto offset = p->find(id);
+    if (offset) return std::make_pair(p, *offset);
   }
   return std::nullopt;
 }
 
+void Database::recordMissing(const ObjectId& id) const {
+  std::lock_guard<std::mutex> lock(lookup->mutex);
+  if (lookup->missing.size() >= MAX_MISSING_IDS) {
+    lookup->missing.clear();
+  }
+  lookup->missing.insert(id);
+}
+
+bool Database::knownMissing(const ObjectId& id) const {
+  std::lock_guard<std::mutex> lock(lookup->mutex);
+  lookup->noticeWrites(cam.writes());
+  return lookup->missing.contains(id);
+}
+
+// Whether id is loose, once the packs turned out not to have it. Under LooseFirst the listing was asked already;
+// the disk is only checked when cam was written around the database since the listing.
+bool Database::looseAfterPacks(const ObjectId& id) const {
+  if (probeOrder == ProbeOrder::PacksFirst && maybeLoose(id)) return true;
+  {
+    std::lock_guard<std::mutex> lock(lookup->mutex);
+    lookup->noticeWrites(cam.writes());
+    if (not lookup->unlisted) return false;
+  }
+  if (not cam.contains(id)) return false;
+  foundLoose(id);
+  return true;
+}
+
+void Database::foundLoose(const ObjectId& id) const {
+  std::lock_guard<std::mutex> lock(lookup->mutex);
+  if (lookup->scanned) lookup->loose.insert(id);
+  lookup->missing.erase(id);
+}
+
+std::optional<Object> Database::get(ObjectId id) const {
+  auto object = getShared(id);
+  if (not object) return std::nullopt;
+  return *object;
+}
+
+std::shared_ptr<const Object> Database::getShared(const ObjectId& id) const {
+  if (auto object = objectCache->get(id)) return object;
+  auto loaded = load(id);
+  if (not loaded) return nullptr;
+  auto object = std::make_shared<const Object>(std::move(*loaded));
+  objectCache->put(id, object);
+  return object;
+}
+
+std::optional<Object> Database::load(const ObjectId& id) const {
+  if (knownMissing(id)) return std::nullopt;
+  bool probedLoose = false;
+  if (probeOrder == ProbeOrder::LooseFirst && maybeLoose(id)) {
+    auto rv = cam.get(id);
+    if (rv) return rv;
+    probedLoose = true;
+  }
+  if (auto packed = findPacked(id)) {
+    return packed->first->getAt(packed->second);
+  }
+  if (not probedLoose && looseAfterPacks(id)) {
+    auto rv = cam.get(id);
+    if (rv) return rv;
+  }
+  recordMissing(id);
+  return std::nullopt;
+}
+
+bool Database::stream(const ObjectId& id, const std::function<void(std::span<const uint8_t>)>& out) const {
+  bool probedLoose = false;
+  if (probeOrder == ProbeOrder::LooseFirst && maybeLoose(id)) {
+    if (cam.stream(id, out)) return true;
+    probedLoose = true;
+  }
+  if (auto packed = findPacked(id)) {
+    if (packed->first->streamAt(packed->second, out)) return true;
+    Object object = packed->first->getAt(packed->second);
+    out(object.data());
+    return true;
+  }
+  return not probedLoose && looseAfterPacks(id) && cam.stream(id, out);
+}
+
+std::optional<ObjectInfo> Database::info(const ObjectId& id) const {
+  bool probedLoose = false;
+  if (probeOrder == ProbeOrder::LooseFirst && maybeLoose(id)) {
+    if (auto rv = cam.info(id)) return rv;
+    probedLoose = true;
+  }
+  if (auto packed = findPacked(id)) {
+    return packed->first->infoAt(packed->second);
+  }
+  if (probedLoose || not looseAfterPacks(id)) return std::nullopt;
+  return cam.info(id);
+}
+
+std::optional<std::pair<const Pack*, size_t>> Database::packLocation(const ObjectId& id) const {
+  if (probeOrder == ProbeOrder::LooseFirst && maybeLoose(id)) return std::nullopt;
+  return findPacked(id);
+}
+
+bool Database::contains(ObjectId id) const {
+  if (knownMissing(id)) return false;
+  if (maybeLoose(id) || findPacked(id) || looseAfterPacks(id)) return true;
+  recordMissing(id);
+  return false;
+}
+
+std::vector<ObjectId> Database::findPrefix(std::string_view hex, size_t limit) const {
+  auto prefix = IdPrefix::parse(hex);
+  if (not prefix) {
+    throw std::runtime_error("Invalid object id abbreviation " + std::string(hex));
+  }
+  std::vector<ObjectId> found;
+  // only the one fanout directory the prefix falls in is listed
+  static constexpr char hexDigits[] = "0123456789abcdef";
+  uint8_t first = prefix->bytes[0];
+  std::string fanout = { hexDigits[first >> 4], hexDigits[first & 0xF] };
+  std::error_code ec;
+  size_t looseFound = 0;
+  for (auto& entry : std::filesystem::directory_iterator(cam.root / fanout, ec)) {
+    auto looseId = parseLooseName(first, entry.path().filename().string());
+    if (looseId && prefix->matches(looseId->data()) && looseFound++ < limit) {
+      found.push_back(*looseId);
+    }
+  }
+  if (multiPackIndex) {
+    multiPackIndex->findPrefix(*prefix, found, limit);
+  }
+  for (auto& p : unindexedPacks) {
+    p->findPrefix(*prefix, found, limit);
+  }
+  // an object can be both loose and packed
+  std::sort(found.begin(), found.end());
+  found.erase(std::unique(found.begin(), found.end()), found.end());
+  if (found.size() > limit) found.resize(limit);
+  return found;
+}
+
+std::optional<ObjectId> Database::resolve(std::string_view hex) const {
+  // branch names and the like are not an error, they just name no object
+  if (not IdPrefix::parse(hex)) return std::nullopt;
+  auto found = findPrefix(hex, 2);
+  if (found.size() > 1) {
+    throw std::runtime_error("Object id abbreviation " + std::string(hex) + " is ambiguous");
+  }
+  if (found.empty()) return std::nullopt;
+  return found.front();
+}
+
+size_t Database::uniqueAbbreviationLength() const {
+  std::vector<ObjectId> all;
+  {
+    std::lock_guard<std::mutex> lock(lookup->mutex);
+    lookup->scan(cam.root);
+    all.assign(lookup->loose.begin(), lookup->loose.end());
+  }
+  if (multiPackIndex) {
+    for (size_t n = 0; n < multiPackIndex->size(); n++) {
+      all.push_back(multiPackIndex->idAt(n));
+    }
+  }
+  for (auto& p : unindexedPacks) {
+    for (size_t n = 0; n < p->size(); n++) {
+      all.push_back(p->idAt(n));
+    }
+  }
+  std::sort(all.begin(), all.end());
+  all.erase(std::unique(all.begin(), all.end()), all.end());
+  // git never abbreviates below 4 characters
+  size_t length = 4;
+  for (size_t n = 1; n < all.size(); n++) {
+    size_t common = 0;
+    while (common < 40) {
+      uint8_t lhs = all[n - 1][common / 2], rhs = all[n][common / 2];
+      if (common % 2 == 0 ? (lhs >> 4) != (rhs >> 4) : (lhs & 0xF) != (rhs & 0xF)) break;
+      common++;
+    }
+    length = std::max(length, std::min<size_t>(common + 1, 40));
+  }
+  return length;
+}
+
 void Database::add(const Object& object) {
-  cam.add(object);
+  auto id = cam.add(object);
+  std::lock_guard<std::mutex> lock(lookup->mutex);
+  // this write is accounted for; any other one since is still noticed
+  lookup->seenWrites++;
+  if (lookup->scanned) lookup->loose.insert(id);
+  lookup->missing.erase(id);
 }
 
 void Database::addPack(Pack p) {
-  packs.push_back(new Pack(std::move(p)));
+  packs.push_back(std::make_unique<Pack>(std::move(p)));
+  unindexedPacks.push_back(packs.back().get());
+  std::lock_guard<std::mutex> lock(lookup->mutex);
+  lookup->missing.clear();
+}
+
+void Database::refresh() {
+  std::lock_guard<std::mutex> lock(lookup->mutex);
+  lookup->scanned = false;
+  lookup->unlisted = false;
+  lookup->seenWrites = cam.writes();
+  lookup->loose.clear();
+  lookup->missing.clear();
+}
+
+void Database::setObjectCachePolicy(const ObjectCachePolicy& policy) {
+  objectCache->setPolicy(policy);
+}
+
+ObjectCacheStats Database::objectCacheStats() const {
+  return objectCache->stats();
+}
+
+std::optional<CommitInfo> Database::commitInfo(const ObjectId& id) const {
+  if (commitGraph) {
+    if (auto position = commitGraph->find(id)) {
+      CommitInfo info{commitGraph->rootAt(*position), {}, commitGraph->timeAt(*position), commitGraph->generationAt(*position)};
+      std::vector<uint32_t> parents;
+      commitGraph->parentsAt(*position, parents);
+      for (auto parent : parents) {
+        info.parents.push_back(commitGraph->idAt(parent));
+      }
+      return info;
+    }
+  }
+  auto object = getShared(id);
+  if (not object || object->type() != Object::Type::Commit) return std::nullopt;
+  Commit commit = object->readAsCommit();
+  CommitInfo info{commit.root, {}, commit.committer.time, 0};
+  if (commit.parent) info.parents.push_back(*commit.parent);
+  info.parents.insert(info.parents.end(), commit.mergeParents.begin(), commit.mergeParents.end());
+  return info;
 }
 
+bool Database::isAncestor(const ObjectId& ancestor, const ObjectId& descendant) const {
+  std::optional<uint32_t> ancestorPosition;
+  if (commitGraph) ancestorPosition = commitGraph->find(ancestor);
+  std::unordered_set<ObjectId> seen;
+  std::vector<ObjectId> stack = { descendant };
+  while (not stack.empty()) {
+    ObjectId id = stack.back();
+    stack.pop_back();
+    if (id == ancestor) return true;
+    if (not seen.insert(id).second) continue;
+    // The parents of a graph commit are all in the graph, so from there on the walk runs over its rows
+    std::optional<uint32_t> position;
+    if (commitGraph) position = commitGraph->find(id);
+    if (position) {
+      if (ancestorPosition && commitGraph->isAncestor(*ancestorPosition, *position)) return true;
+      continue;
+    }
+    auto info = commitInfo(id);
+    if (not info) {
+      throw std::runtime_error("Commit " + id.hex() + " is missing");
+    }
+    stack.insert(stack.end(), info->parents.begin(), info->parents.end());
+  }
+  return false;
+}
 
+std::vector<ObjectId> Database::mergeBases(const ObjectId& lhs, const ObjectId& rhs) const {
+  if (lhs == rhs) return { lhs };
+  enum : uint8_t { LEFT = 1, RIGHT = 2, STALE = 4, RESULT = 8 };
+  struct Queued {
+    uint32_t generation;
+    int64_t time;
+    ObjectId id;
+  };
+  // Highest generation first; commits outside the graph have none and can be above anything in it
+  auto before = [](const Queued& a, const Queued& b) {
+    return std::tie(a.generation, a.time) < std::tie(b.generation, b.time);
+  };
+  std::unordered_map<ObjectId, uint8_t> flags;
+  std::unordered_map<ObjectId, CommitInfo> commits;
+  std::vector<Queued> queue;
+  auto push = [&](const ObjectId& id, uint8_t paint) {
+    auto it = commits.find(id);
+    if (it == commits.end()) {
+      auto info = commitInfo(id);
+      if (not info) {
+        throw std::runtime_error("Commit " + id.hex() + " is missing");
+      }
+      it = commits.emplace(id, std::move(*info)).first;
+    }
+    flags[id] |= paint;
+    queue.push_back({it->second.generation ? it->second.generation : UINT32_MAX, it->second.time, id});
+    std::push_heap(queue.begin(), queue.end(), before);
+  };
+  push(lhs, LEFT);
+  push(rhs, RIGHT);
+
+  // Paint down from both sides; a commit reached from both is a candidate and everything below it is stale
+  std::vector<ObjectId> candidates;
+  while (std::any_of(queue.begin(), queue.end(), [&](const Queued& q) { return not (flags[q.id] & STALE); })) {
+    std::pop_heap(queue.begin(), queue.end(), before);
+    ObjectId id = queue.back().id;
+    queue.pop_back();
+    uint8_t paint = flags[id] & (LEFT | RIGHT | STALE);
+    if ((paint & (LEFT | RIGHT)) == (LEFT | RIGHT)) {
+      if (not (flags[id] & RESULT)) {
+        flags[id] |= RESULT;
+        candidates.push_back(id);
+      }
+      paint |= STALE;
+    }
+    for (auto& parent : commits[id].parents) {
+      if ((flags[parent] & paint) == paint) continue;
+      push(parent, paint);
+    }
+  }
+  std::erase_if(candidates, [&](const ObjectId& id) { return flags[id] & STALE; });
+
+  std::vector<ObjectId> bases;
+  for (auto& candidate : candidates) {
+    bool redundant = std::any_of(candidates.begin(), candidates.end(), [&](const ObjectId& other) {
+      return other != candidate && isAncestor(candidate, other);
+    });
+    if (not redundant) bases.push_back(candidate);
+  }
+  return bases;
+}
+
+// Loading one means sorting its pack by offset, so commands that never walk history do not pay for it
+const PackBitmap* Database::packBitmap() const {
+  std::call_once(bitmapLoaded, [this] {
+    // Like git, only one pack's bitmap is used; after a repack there is only one pack to begin with
+    for (size_t n = 0; n < packFiles.size(); n++) {
+      std::filesystem::path bitmapFile = std::filesystem::path(packFiles[n]).replace_extension(".bitmap");
+      if (not std::filesystem::is_regular_file(bitmapFile)) continue;
+      try {
+        bitmap = std::make_unique<PackBitmap>(*packs[n], bitmapFile);
+        break;
+      } catch (std::exception&) {
+        // reachability is then walked object by object
+      }
+    }
+  });
+  return bitmap.get();
+}
+
+std::vector<PackObject> Database::objectsBetween(std::span<const ObjectId> wants, std::span<const ObjectId> haves) const {
+  const PackBitmap* packed = packBitmap();
+  ReachableSet excluded, wanted;
+  WalkReachable(*this, packed, haves, excluded);
+  WalkReachable(*this, packed, wants, wanted, &excluded);
+  // commit bitmaps taken over whole still contain what the haves reach
+  wanted.bits.andNot(excluded.bits);
+
+  std::vector<PackObject> objects;
+  wanted.bits.forEach([&](size_t bit) {
+    objects.push_back({packed->idAt(bit), packed->nameHashAt(bit)});
+  });
+  for (auto& [id, nameHash] : wanted.extra) {
+    objects.push_back({id, nameHash});
+  }
+  return objects;
+}
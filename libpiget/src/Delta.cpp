@@ -0,0 +1,182 @@
+#include "piget/Delta.hpp"
+#include "bini/reader.h"
+#include "bini/writer.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+static constexpr size_t BLOCK_SIZE = 16;
+static constexpr size_t MAX_BUCKET_ENTRIES = 64;
+static constexpr size_t MAX_COPY_SIZE = 0xFF'FFFF;
+static constexpr uint32_t HASH_MULTIPLIER = 0x0100'0193;
+
+static constexpr uint32_t outgoingFactor() {
+  uint32_t factor = 1;
+  for (size_t n = 0; n < BLOCK_SIZE; n++) factor *= HASH_MULTIPLIER;
+  return factor;
+}
+
+static uint32_t blockHash(const uint8_t* p) {
+  uint32_t hash = 0;
+  for (size_t n = 0; n < BLOCK_SIZE; n++) {
+    hash = hash * HASH_MULTIPLIER + p[n];
+  }
+  return hash;
+}
+
+static uint32_t rollHash(uint32_t hash, uint8_t out, uint8_t in) {
+  return hash * HASH_MULTIPLIER + in - out * outgoingFactor();
+}
+
+DeltaIndex::DeltaIndex(std::span<const uint8_t> base)
+: base(base)
+{
+  // Offsets are stored in 32 bits, same as the copy instruction can address
+  size_t blocks = std::min<size_t>(base.size(), 0xFFFF'FFFF) / BLOCK_SIZE;
+  size_t buckets = 1;
+  while (buckets < blocks) buckets <<= 1;
+  mask = buckets - 1;
+
+  std::vector<uint32_t> hashes(blocks);
+  bucketStart.assign(buckets + 1, 0);
+  for (size_t n = 0; n < blocks; n++) {
+    hashes[n] = blockHash(base.data() + n * BLOCK_SIZE);
+    bucketStart[(hashes[n] & mask) + 1]++;
+  }
+  for (size_t n = 0; n < buckets; n++) {
+    bucketStart[n + 1] = bucketStart[n] + std::min<size_t>(bucketStart[n + 1], MAX_BUCKET_ENTRIES);
+  }
+  blockOffsets.resize(bucketStart[buckets]);
+  std::vector<uint32_t> fill(bucketStart.begin(), bucketStart.end() - 1);
+  for (size_t n = 0; n < blocks; n++) {
+    uint32_t bucket = hashes[n] & mask;
+    if (fill[bucket] < bucketStart[bucket + 1]) {
+      blockOffsets[fill[bucket]++] = n * BLOCK_SIZE;
+    }
+  }
+}
+
+static void addInsert(Bini::writer& w, std::span<const uint8_t> literal) {
+  while (not literal.empty()) {
+    size_t chunk = std::min<size_t>(literal.size(), 0x7F);
+    w.add8(chunk);
+    w.add(literal.first(chunk));
+    literal = literal.subspan(chunk);
+  }
+}
+
+static void addCopy(Bini::writer& w, size_t offset, size_t size) {
+  uint8_t cmd = 0x80;
+  uint8_t args[7];
+  size_t count = 0;
+  for (size_t n = 0; n < 4; n++) {
+    if (uint8_t b = offset >> (8 * n)) {
+      cmd |= 1 << n;
+      args[count++] = b;
+    }
+  }
+  for (size_t n = 0; n < 3; n++) {
+    if (uint8_t b = size >> (8 * n)) {
+      cmd |= 0x10 << n;
+      args[count++] = b;
+    }
+  }
+  w.add8(cmd);
+  w.add(std::span<const uint8_t>(args, count));
+}
+
+std::optional<std::vector<uint8_t>> DeltaIndex::createDelta(std::span<const uint8_t> target, size_t maxSize) const {
+  Bini::writer w;
+  w.addPB(base.size());
+  w.addPB(target.size());
+  size_t insertStart = 0, pos = 0;
+  uint32_t hash = target.size() >= BLOCK_SIZE ? blockHash(target.data()) : 0;
+  while (not blockOffsets.empty() && pos + BLOCK_SIZE <= target.size()) {
+    size_t bestOffset = 0, bestLength = 0;
+    uint32_t bucket = hash & mask;
+    for (size_t n = bucketStart[bucket]; n < bucketStart[bucket + 1]; n++) {
+      size_t offset = blockOffsets[n];
+      if (memcmp(base.data() + offset, target.data() + pos, BLOCK_SIZE) != 0) continue;
+      size_t length = BLOCK_SIZE;
+      size_t limit = std::min({base.size() - offset, target.size() - pos, MAX_COPY_SIZE});
+      while (length < limit && base[offset + length] == target[pos + length]) length++;
+      if (length > bestLength) {
+        bestOffset = offset;
+        bestLength = length;
+      }
+    }
+
+    if (bestLength == 0) {
+      if (w.size() + (pos - insertStart) > maxSize) return std::nullopt;
+      if (pos + BLOCK_SIZE < target.size()) {
+        hash = rollHash(hash, target[pos], target[pos + BLOCK_SIZE]);
+      }
+      pos++;
+      continue;
+    }
+
+    // Take back bytes that were going to be inserted literally, if they match the base too
+    while (bestOffset > 0 && pos > insertStart && bestLength < MAX_COPY_SIZE &&
+           base[bestOffset - 1] == target[pos - 1]) {
+      bestOffset--;
+      pos--;
+      bestLength++;
+    }
+    addInsert(w, target.subspan(insertStart, pos - insertStart));
+    addCopy(w, bestOffset, bestLength);
+    pos += bestLength;
+    insertStart = pos;
+    if (w.size() > maxSize) return std::nullopt;
+    if (pos + BLOCK_SIZE <= target.size()) {
+      hash = blockHash(target.data() + pos);
+    }
+  }
+  addInsert(w, target.subspan(insertStart));
+  if (w.size() > maxSize) return std::nullopt;
+  return std::vector<uint8_t>(std::move(w));
+}
+
+std::optional<std::vector<uint8_t>> CreateDelta(std::span<const uint8_t> base, std::span<const uint8_t> target, size_t maxSize) {
+  return DeltaIndex(base).createDelta(target, maxSize);
+}
+
+std::vector<uint8_t> ApplyDelta(std::span<const uint8_t> base, std::span<const uint8_t> delta) {
+  Bini::reader r(delta);
+  size_t baseSize = r.getPB();
+  size_t resultSize = r.getPB();
+  if (baseSize != base.size()) {
+    throw std::runtime_error("Delta does not apply to this base");
+  }
+  std::vector<uint8_t> result;
+  result.reserve(resultSize);
+  while (r.sizeleft()) {
+    uint8_t cmd = r.read8();
+    if (cmd & 0x80) {
+      size_t offset = 0, size = 0;
+      for (size_t n = 0; n < 4; n++) {
+        if (cmd & (1 << n)) offset |= size_t(r.read8()) << (8 * n);
+      }
+      for (size_t n = 0; n < 3; n++) {
+        if (cmd & (0x10 << n)) size |= size_t(r.read8()) << (8 * n);
+      }
+      if (size == 0) size = 0x10000;
+      if (offset > base.size() || size > base.size() - offset) {
+        throw std::runtime_error("Delta copies outside of its base");
+      }
+      result.insert(result.end(), base.begin() + offset, base.begin() + offset + size);
+    } else if (cmd) {
+      auto literal = r.get(cmd);
+      result.insert(result.end(), literal.begin(), literal.end());
+    } else {
+      throw std::runtime_error("Invalid delta instruction");
+    }
+    if (r.fail()) {
+      throw std::runtime_error("Truncated delta");
+    }
+  }
+  if (result.size() != resultSize) {
+    throw std::runtime_error("Delta result has the wrong size");
+  }
+  return result;
+}
+
@@ -0,0 +1,64 @@
+#include "piget/Diff.hpp"
+#include "piget/GitCAM.hpp"
+#include "piget/Object.hpp"
+#include <stdexcept>
+
+static std::shared_ptr<const Object> readTree(const Database& db, const std::optional<ObjectId>& id) {
+  if (not id) return nullptr;
+  auto object = db.getShared(*id);
+  if (not object) {
+    throw std::runtime_error("Tree " + id->hex() + " is missing");
+  }
+  return object;
+}
+
+static void diffTrees(const Database& db, const std::optional<ObjectId>& oldTree, const std::optional<ObjectId>& newTree,
+                      const std::string& prefix, std::vector<TreeChange>& out) {
+  auto oldObject = readTree(db, oldTree), newObject = readTree(db, newTree);
+  TreeView before = oldObject ? oldObject->viewAsTree() : TreeView(), after = newObject ? newObject->viewAsTree() : TreeView();
+  auto changed = [&](const TreeView::Entry* lhs, const TreeView::Entry* rhs) {
+    const TreeView::Entry& entry = lhs ? *lhs : *rhs;
+    // a file and a directory of the same name are different entries in git order, so both sides are trees here
+    if (entry.fileMode == 040000) {
+      diffTrees(db, lhs ? std::optional(lhs->hash) : std::nullopt, rhs ? std::optional(rhs->hash) : std::nullopt,
+                prefix + std::string(entry.fileName) + "/", out);
+      return;
+    }
+    TreeChange change{lhs && rhs ? TreeChange::Status::Modified : lhs ? TreeChange::Status::Deleted : TreeChange::Status::Added,
+                      prefix + std::string(entry.fileName), 0, 0, {}, {}};
+    if (lhs) {
+      change.oldMode = lhs->fileMode;
+      change.oldId = lhs->hash;
+    }
+    if (rhs) {
+      change.newMode = rhs->fileMode;
+      change.newId = rhs->hash;
+    }
+    out.push_back(std::move(change));
+  };
+
+  auto less = [](const TreeView::Entry& lhs, const TreeView::Entry& rhs) {
+    return TreeEntryLess(lhs.fileName, lhs.fileMode == 040000, rhs.fileName, rhs.fileMode == 040000);
+  };
+  auto lhs = before.begin(), rhs = after.begin();
+  while (lhs != before.end() || rhs != after.end()) {
+    if (rhs == after.end() || (lhs != before.end() && less(*lhs, *rhs))) {
+      changed(&*lhs, nullptr);
+      ++lhs;
+    } else if (lhs == before.end() || less(*rhs, *lhs)) {
+      changed(nullptr, &*rhs);
+      ++rhs;
+    } else {
+      // identical entries, including whole unchanged subtrees, are skipped without being read
+      if (lhs->hash != rhs->hash || lhs->fileMode != rhs->fileMode) changed(&*lhs, &*rhs);
+      ++lhs;
+      ++rhs;
+    }
+  }
+}
+
+std::vector<TreeChange> DiffTrees(const Database& db, const std::optional<ObjectId>& oldTree, const std::optional<ObjectId>& newTree) {
+  std::vector<TreeChange> changes;
+  if (oldTree != newTree) diffTrees(db, oldTree, newTree, "", changes);
+  return changes;
+}
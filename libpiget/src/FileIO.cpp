@@ -0,0 +1,130 @@
+#include "piget/FileIO.hpp"
+#include <stdexcept>
+#include <utility>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void WriteAll(int fd, std::span<const uint8_t> data, const std::string& name) {
+  while (not data.empty()) {
+    ssize_t written = write(fd, data.data(), data.size());
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      throw std::runtime_error("error " + std::to_string(errno) + " writing " + name);
+    }
+    data = data.subspan(written);
+  }
+}
+
+int CreateTemporary(const std::filesystem::path& dir, const std::string& prefix, std::string& tempName) {
+  tempName = (dir / (prefix + "XXXXXX")).string();
+  int fd = mkstemp(tempName.data());
+  if (fd == -1) {
+    throw std::runtime_error("error " + std::to_string(errno) + " creating " + tempName);
+  }
+  // Objects and packs are immutable, like git's own
+  fchmod(fd, 0444);
+  return fd;
+}
+
+void SyncAndClose(int fd, const std::string& name) {
+  if (fsync(fd) == -1) {
+    int error = errno;
+    close(fd);
+    throw std::runtime_error("error " + std::to_string(error) + " syncing " + name);
+  }
+  close(fd);
+}
+
+void SyncDirectory(const std::filesystem::path& dir) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1 || fsync(fd) == -1) {
+    int error = errno;
+    if (fd != -1) close(fd);
+    throw std::runtime_error("error " + std::to_string(error) + " syncing " + dir.string());
+  }
+  close(fd);
+}
+
+void WriteDurably(const std::filesystem::path& target, std::span<const uint8_t> data) {
+  std::string tempName;
+  int fd = CreateTemporary(target.parent_path(), "tmp_pack_", tempName);
+  try {
+    WriteAll(fd, data, target.string());
+  } catch (...) {
+    close(fd);
+    unlink(tempName.c_str());
+    throw;
+  }
+  try {
+    SyncAndClose(fd, target.string());
+  } catch (...) {
+    unlink(tempName.c_str());
+    throw;
+  }
+  std::filesystem::rename(tempName, target);
+}
+
+LockFile::LockFile(std::filesystem::path file) {
+  if (not tryLock(std::move(file))) {
+    throw std::runtime_error("Unable to create " + lockName + ": another process holds the lock");
+  }
+}
+
+LockFile::LockFile(LockFile&& rhs)
+: file(std::move(rhs.file))
+, lockName(std::move(rhs.lockName))
+, fd(std::exchange(rhs.fd, -1))
+{
+}
+
+LockFile& LockFile::operator=(LockFile&& rhs) {
+  std::swap(file, rhs.file);
+  std::swap(lockName, rhs.lockName);
+  std::swap(fd, rhs.fd);
+  return *this;
+}
+
+LockFile::~LockFile() {
+  rollback();
+}
+
+bool LockFile::tryLock(std::filesystem::path target) {
+  rollback();
+  file = std::move(target);
+  lockName = file.string() + ".lock";
+  fd = open(lockName.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    if (errno == EEXIST) return false;
+    throw std::runtime_error("error " + std::to_string(errno) + " creating " + lockName);
+  }
+  return true;
+}
+
+void LockFile::write(std::span<const uint8_t> data) {
+  if (fd == -1) {
+    throw std::runtime_error("Writing " + file.string() + " without holding its lock");
+  }
+  WriteAll(fd, data, lockName);
+}
+
+void LockFile::commit() {
+  if (fd == -1) {
+    throw std::runtime_error("Writing " + file.string() + " without holding its lock");
+  }
+  // the descriptor is gone either way; a failed commit leaves the lock to be removed
+  SyncAndClose(std::exchange(fd, -1), lockName);
+  if (rename(lockName.c_str(), file.c_str()) == -1) {
+    int error = errno;
+    unlink(lockName.c_str());
+    throw std::runtime_error("error " + std::to_string(error) + " renaming " + lockName);
+  }
+  SyncDirectory(file.has_parent_path() ? file.parent_path() : std::filesystem::path("."));
+}
+
+void LockFile::rollback() {
+  if (fd == -1) return;
+  close(std::exchange(fd, -1));
+  unlink(lockName.c_str());
+}
@@ -1,47 +1,297 @@
 #include "piget/GitCAM.hpp"
+#include "piget/FileIO.hpp"
 #include "piget/Object.hpp"
+#include "piget/Hash.hpp"
+#include "piget/Parallel.hpp"
 #include "tl/expected.hpp"
 #include "caligo/sha1.h"
 #include "decoco/decoco.hpp"
+#include <atomic>
 #include <optional>
 #include <filesystem>
 #include <fstream>
+#include <algorithm>
+#include <functional>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct GitCAM::FanoutCache {
+  std::atomic<bool> rootExists = false;
+  std::array<std::atomic<bool>, 256> exists = {};
+  std::atomic<size_t> writes = 0;
+};
 
 GitCAM::GitCAM(std::filesystem::path root)
 : root(root)
+, fanout(std::make_unique<FanoutCache>())
 {
 }
 
-static std::string asId(std::span<const uint8_t> input) {
-  char hextab[17] = "0123456789abcdef";
-  std::string rv;
-  for (auto& c : input) {
-    rv.push_back(hextab[c >> 4]);
-    rv.push_back(hextab[c & 0xF]);
-  }
-  return rv;
+GitCAM::GitCAM(GitCAM&&) = default;
+
+GitCAM::~GitCAM() = default;
+
+static std::string fanoutName(uint8_t firstByte) {
+  std::string name(2, '\0');
+  HexEncode(std::span<const uint8_t>(&firstByte, 1), name.data());
+  return name;
 }
 
-std::array<uint8_t, 20> GitCAM::add(Object object) {
-  auto hash = object.id();
-  std::string id = asId(hash);
-  std::filesystem::path filename = root / id.substr(0, 2) / id.substr(2);
-  if (std::filesystem::is_regular_file(filename)) {
-    // soft error, already exists
-    return hash;
-  } else if (std::filesystem::exists(filename)) {
-    // expected!
-    throw std::runtime_error("broken repository");
+static void finishTemporary(int fd, const std::string& tempName, bool durable) {
+  if (durable) {
+    SyncAndClose(fd, tempName);
   } else {
-    std::filesystem::create_directories(filename.parent_path());
-    std::vector<uint8_t> compressedData = Decoco::compress(Decoco::ZlibCompressor(), object.buffer);
-    std::ofstream(filename).write(reinterpret_cast<const char*>(compressedData.data()), compressedData.size());
-    return hash;
+    close(fd);
+  }
+}
+
+// One sync per directory that received objects, and of the root when it got new directories
+static void syncFanouts(const std::filesystem::path& root, const std::array<std::atomic<bool>, 256>& touched, bool createdFanout) {
+  for (size_t n = 0; n < touched.size(); n++) {
+    if (touched[n]) SyncDirectory(root / fanoutName(n));
+  }
+  if (createdFanout) SyncDirectory(root);
+}
+
+// Only the first object going into a fanout directory pays for making sure it exists
+std::filesystem::path GitCAM::fanoutDirectory(uint8_t firstByte, bool& created) {
+  std::filesystem::path dir = root / fanoutName(firstByte);
+  if (not fanout->exists[firstByte]) {
+    if (not fanout->rootExists) {
+      std::filesystem::create_directories(root);
+      fanout->rootExists = true;
+    }
+    if (mkdir(dir.c_str(), 0777) == 0) {
+      created = true;
+    } else if (errno != EEXIST) {
+      throw std::runtime_error("error " + std::to_string(errno) + " creating " + dir.string());
+    }
+    fanout->exists[firstByte] = true;
+  }
+  return dir;
+}
+
+ObjectId GitCAM::add(const Object& object) {
+  return add(std::span<const Object>(&object, 1), 1)[0];
+}
+
+std::vector<ObjectId> GitCAM::add(std::span<const Object> objects, size_t threads) {
+  std::vector<ObjectId> hashes(objects.size());
+  std::vector<std::string> tempNames(objects.size());
+  std::array<std::atomic<bool>, 256> touched = {};
+  std::atomic<bool> createdFanout = false;
+  try {
+    ParallelFor(objects.size(), threads, [&](size_t n) {
+      hashes[n] = objects[n].id();
+      std::string id = hashes[n].hex();
+      std::filesystem::path filename = root / id.substr(0, 2) / id.substr(2);
+      struct stat statbuf;
+      if (lstat(filename.c_str(), &statbuf) == 0) {
+        if (not S_ISREG(statbuf.st_mode)) {
+          throw std::runtime_error("broken repository");
+        }
+        // soft error, already exists
+        return;
+      }
+      bool created = false;
+      auto dir = fanoutDirectory(hashes[n][0], created);
+      if (created) createdFanout = true;
+      int fd = CreateTemporary(dir, "tmp_obj_", tempNames[n]);
+      try {
+        WriteAll(fd, Decoco::compress(Decoco::ZlibCompressor(), objects[n].buffer), tempNames[n]);
+      } catch (...) {
+        close(fd);
+        throw;
+      }
+      finishTemporary(fd, tempNames[n], durable);
+      touched[hashes[n][0]] = true;
+    });
+
+    // Contents are synced before any rename, so no name can ever point at a partial object
+    for (size_t n = 0; n < objects.size(); n++) {
+      if (tempNames[n].empty()) continue;
+      std::string id = hashes[n].hex();
+      std::filesystem::rename(tempNames[n], root / id.substr(0, 2) / id.substr(2));
+      tempNames[n].clear();
+    }
+  } catch (...) {
+    for (auto& tempName : tempNames) {
+      if (not tempName.empty()) unlink(tempName.c_str());
+    }
+    // some of them may be in place already
+    fanout->writes++;
+    throw;
+  }
+  fanout->writes++;
+
+  if (durable) syncFanouts(root, touched, createdFanout);
+  return hashes;
+}
+
+static size_t readChunks(int fd, const std::filesystem::path& path, const std::function<void(std::span<const uint8_t>)>& sink) {
+  static constexpr size_t chunkSize = 64 * 1024;
+  std::vector<uint8_t> chunk(chunkSize);
+  size_t total = 0;
+  ssize_t bytesRead;
+  while ((bytesRead = read(fd, chunk.data(), chunk.size())) != 0) {
+    if (bytesRead < 0) {
+      if (errno == EINTR) continue;
+      throw std::runtime_error("error " + std::to_string(errno) + " reading " + path.string());
+    }
+    sink(std::span<const uint8_t>(chunk.data(), bytesRead));
+    total += bytesRead;
   }
+  return total;
 }
 
-std::optional<Object> GitCAM::get(std::array<uint8_t, 20> hash) const {
-  std::string id = asId(hash);
+ObjectId HashFile(std::filesystem::path path) {
+  // Files up to this size are read whole and hashed in one call
+  static constexpr size_t smallFileSize = 64 * 1024;
+  int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    throw std::runtime_error("error " + std::to_string(errno) + " opening " + path.string());
+  }
+  Caligo::SHA1 hasher;
+  std::vector<uint8_t> whole;
+  try {
+    struct stat statbuf;
+    if (fstat(in, &statbuf) == -1) {
+      throw std::runtime_error("error " + std::to_string(errno) + " reading " + path.string());
+    }
+    std::string header = "blob " + std::to_string(statbuf.st_size);
+    std::span<const uint8_t> headerBytes((const uint8_t*)header.data(), header.size() + 1);
+    bool small = (size_t)statbuf.st_size <= smallFileSize;
+    if (small) {
+      whole.reserve(headerBytes.size() + statbuf.st_size);
+      whole.insert(whole.end(), headerBytes.begin(), headerBytes.end());
+    } else {
+      hasher.add(headerBytes);
+    }
+    size_t total = readChunks(in, path, [&](std::span<const uint8_t> data) {
+      if (small) {
+        whole.insert(whole.end(), data.begin(), data.end());
+      } else {
+        hasher.add(data);
+      }
+    });
+    if (total != (size_t)statbuf.st_size) {
+      throw std::runtime_error(path.string() + " changed while being hashed");
+    }
+    if (small) {
+      close(in);
+      return HashBuffer(whole);
+    }
+  } catch (...) {
+    close(in);
+    throw;
+  }
+  close(in);
+  return hasher.data();
+}
+
+// Streams a file into a new temporary object in dir; the caller renames it into place or removes it
+static ObjectId streamFile(const std::filesystem::path& dir, const std::filesystem::path& path, bool durable, std::string& tempName) {
+  int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    throw std::runtime_error("error " + std::to_string(errno) + " opening " + path.string());
+  }
+  int out;
+  try {
+    out = CreateTemporary(dir, "tmp_obj_", tempName);
+  } catch (...) {
+    close(in);
+    throw;
+  }
+
+  Caligo::SHA1 hasher;
+  auto compressor = Decoco::ZlibCompressor();
+  try {
+    struct stat statbuf;
+    if (fstat(in, &statbuf) == -1) {
+      throw std::runtime_error("error " + std::to_string(errno) + " reading " + path.string());
+    }
+    std::string header = "blob " + std::to_string(statbuf.st_size);
+    std::span<const uint8_t> headerBytes((const uint8_t*)header.data(), header.size() + 1);
+    hasher.add(headerBytes);
+    WriteAll(out, compressor->add(headerBytes), tempName);
+
+    size_t total = readChunks(in, path, [&](std::span<const uint8_t> data) {
+      hasher.add(data);
+      WriteAll(out, compressor->add(data), tempName);
+    });
+    if (total != (size_t)statbuf.st_size) {
+      throw std::runtime_error(path.string() + " changed while being added");
+    }
+    WriteAll(out, compressor->finish(), tempName);
+  } catch (...) {
+    close(in);
+    close(out);
+    unlink(tempName.c_str());
+    tempName.clear();
+    throw;
+  }
+  close(in);
+  try {
+    finishTemporary(out, tempName, durable);
+  } catch (...) {
+    unlink(tempName.c_str());
+    tempName.clear();
+    throw;
+  }
+  return hasher.data();
+}
+
+ObjectId GitCAM::addFile(std::filesystem::path path) {
+  return addFiles(std::span<const std::filesystem::path>(&path, 1), 1)[0];
+}
+
+std::vector<ObjectId> GitCAM::addFiles(std::span<const std::filesystem::path> paths, size_t threads) {
+  if (not fanout->rootExists) {
+    std::filesystem::create_directories(root);
+    fanout->rootExists = true;
+  }
+  std::vector<ObjectId> hashes(paths.size());
+  std::vector<std::string> tempNames(paths.size());
+  std::array<std::atomic<bool>, 256> touched = {};
+  std::atomic<bool> createdFanout = false;
+  try {
+    ParallelFor(paths.size(), threads, [&](size_t n) {
+      hashes[n] = streamFile(root, paths[n], durable, tempNames[n]);
+      std::string id = hashes[n].hex();
+      struct stat statbuf;
+      if (lstat((root / id.substr(0, 2) / id.substr(2)).c_str(), &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+        unlink(tempNames[n].c_str());
+        tempNames[n].clear();
+        return;
+      }
+      bool created = false;
+      auto dir = fanoutDirectory(hashes[n][0], created);
+      if (created) createdFanout = true;
+      // the contents are synced already, so only the directory entries are left for the end
+      std::filesystem::rename(tempNames[n], dir / id.substr(2));
+      tempNames[n].clear();
+      touched[hashes[n][0]] = true;
+    });
+  } catch (...) {
+    for (auto& tempName : tempNames) {
+      if (not tempName.empty()) unlink(tempName.c_str());
+    }
+    // some of them may be in place already
+    fanout->writes++;
+    throw;
+  }
+  fanout->writes++;
+  if (durable) syncFanouts(root, touched, createdFanout);
+  return hashes;
+}
+
+size_t GitCAM::writes() const {
+  return fanout->writes;
+}
+
+std::optional<Object> GitCAM::get(ObjectId hash) const {
+  std::string id = hash.hex();
   std::filesystem::path file = root / id.substr(0, 2) / id.substr(2);
   std::error_code ec;
   size_t size = std::filesystem::file_size(file, ec);
@@ -52,3 +302,79 @@ std::optional<Object> GitCAM::get(std::array<uint8_t, 20> hash) const {
   return Object(Decoco::decompress(Decoco::ZlibDecompressor(), buffer));
 }
 
+bool GitCAM::stream(ObjectId hash, const std::function<void(std::span<const uint8_t>)>& out) const {
+  std::string id = hash.hex();
+  std::filesystem::path file = root / id.substr(0, 2) / id.substr(2);
+  int in = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) return false;
+  auto decompressor = Decoco::ZlibDecompressor();
+  // The header ends at the first NUL, which may come in any piece
+  std::string header;
+  bool inHeader = true;
+  size_t expected = 0, total = 0;
+  try {
+    readChunks(in, file, [&](std::span<const uint8_t> compressed) {
+      std::vector<uint8_t> data = decompressor->add(compressed);
+      std::span<const uint8_t> rest(data);
+      if (inHeader) {
+        auto end = std::find(rest.begin(), rest.end(), 0);
+        header.append(rest.begin(), end);
+        if (end == rest.end()) return;
+        inHeader = false;
+        size_t space = header.find(' ');
+        expected = space == std::string::npos ? 0 : std::stoull(header.substr(space + 1));
+        rest = rest.subspan(end - rest.begin() + 1);
+      }
+      total += rest.size();
+      if (not rest.empty()) out(rest);
+    });
+  } catch (...) {
+    close(in);
+    throw;
+  }
+  close(in);
+  if (inHeader || not decompressor->done() || total != expected) {
+    throw std::runtime_error("Object " + id + " is corrupt");
+  }
+  return true;
+}
+
+std::optional<ObjectInfo> GitCAM::info(ObjectId hash) const {
+  // Small reads, as the header is all that is needed of the inflated data
+  static constexpr size_t chunkSize = 64;
+  std::string id = hash.hex();
+  std::filesystem::path file = root / id.substr(0, 2) / id.substr(2);
+  int in = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) return std::nullopt;
+  auto decompressor = Decoco::ZlibDecompressor();
+  std::string header;
+  try {
+    uint8_t chunk[chunkSize];
+    while (header.find('\0') == std::string::npos && not decompressor->done()) {
+      ssize_t bytesRead = read(in, chunk, sizeof(chunk));
+      if (bytesRead < 0) {
+        if (errno == EINTR) continue;
+        throw std::runtime_error("error " + std::to_string(errno) + " reading " + file.string());
+      }
+      if (bytesRead == 0) break;
+      std::vector<uint8_t> data = decompressor->add(std::span<const uint8_t>(chunk, bytesRead));
+      header.append(data.begin(), data.end());
+    }
+  } catch (...) {
+    close(in);
+    throw;
+  }
+  close(in);
+  size_t nul = header.find('\0');
+  auto info = nul == std::string::npos ? std::nullopt : ParseObjectHeader(std::string_view(header).substr(0, nul));
+  if (not info || info->type == Object::Type::Invalid) {
+    throw std::runtime_error("Object " + id + " is corrupt");
+  }
+  return info;
+}
+
+bool GitCAM::contains(ObjectId hash) const {
+  std::string id = hash.hex();
+  struct stat statbuf;
+  return lstat((root / id.substr(0, 2) / id.substr(2)).c_str(), &statbuf) == 0;
+}
@@ -0,0 +1,136 @@
+#include "piget/Hash.hpp"
+#include "piget/Parallel.hpp"
+#include "caligo/sha1.h"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define PIGET_SHA_NI 1
+#endif
+
+#ifdef PIGET_SHA_NI
+
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+namespace {
+
+struct ShaNiState {
+  __m128i abcd, e0, e1;
+  __m128i msg[4];
+};
+
+// Four rounds of the message schedule as laid out in Intel's SHA extensions reference
+template <int Group>
+SHA_NI_TARGET inline void shaNiRounds(ShaNiState& s) {
+  __m128i& e = (Group % 2) ? s.e1 : s.e0;
+  __m128i& other = (Group % 2) ? s.e0 : s.e1;
+  __m128i& current = s.msg[Group % 4];
+  if constexpr (Group == 0) {
+    e = _mm_add_epi32(e, current);
+  } else {
+    e = _mm_sha1nexte_epu32(e, current);
+  }
+  other = s.abcd;
+  if constexpr (Group >= 3 && Group <= 18) {
+    s.msg[(Group + 1) % 4] = _mm_sha1msg2_epu32(s.msg[(Group + 1) % 4], current);
+  }
+  s.abcd = _mm_sha1rnds4_epu32(s.abcd, e, Group / 5);
+  if constexpr (Group >= 1 && Group <= 16) {
+    s.msg[(Group + 3) % 4] = _mm_sha1msg1_epu32(s.msg[(Group + 3) % 4], current);
+  }
+  if constexpr (Group >= 2 && Group <= 17) {
+    s.msg[(Group + 2) % 4] = _mm_xor_si128(s.msg[(Group + 2) % 4], current);
+  }
+}
+
+template <size_t... Groups>
+SHA_NI_TARGET inline void shaNiBlock(ShaNiState& s, const uint8_t* block, std::index_sequence<Groups...>) {
+  const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  for (size_t n = 0; n < 4; n++) {
+    s.msg[n] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + n * 16)), byteSwap);
+  }
+  (shaNiRounds<Groups>(s), ...);
+}
+
+SHA_NI_TARGET void shaNiCompress(uint32_t state[5], const uint8_t* blocks, size_t count) {
+  ShaNiState s;
+  s.abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1B);
+  s.e0 = _mm_set_epi32(state[4], 0, 0, 0);
+  for (size_t n = 0; n < count; n++) {
+    __m128i abcdSave = s.abcd, e0Save = s.e0;
+    shaNiBlock(s, blocks + n * 64, std::make_index_sequence<20>());
+    s.e0 = _mm_sha1nexte_epu32(s.e0, e0Save);
+    s.abcd = _mm_add_epi32(s.abcd, abcdSave);
+  }
+  _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(s.abcd, 0x1B));
+  state[4] = _mm_extract_epi32(s.e0, 3);
+}
+
+bool detectShaNi() {
+  unsigned a, b, c, d;
+  if (not __get_cpuid(1, &a, &b, &c, &d)) return false;
+  bool ssse3 = c & (1 << 9), sse41 = c & (1 << 19);
+  if (not __get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+  return ssse3 && sse41 && (b & (1 << 29));
+}
+
+}
+
+#endif
+
+bool HashAccelerated() {
+#ifdef PIGET_SHA_NI
+  static const bool supported = detectShaNi();
+  return supported;
+#else
+  return false;
+#endif
+}
+
+ObjectId HashBuffer(std::span<const uint8_t> data) {
+#ifdef PIGET_SHA_NI
+  if (HashAccelerated()) {
+    uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    size_t fullBlocks = data.size() / 64;
+    shaNiCompress(state, data.data(), fullBlocks);
+
+    // The tail, the 0x80 terminator and the 64-bit bit length take one or two more blocks
+    uint8_t tail[128] = {};
+    size_t left = data.size() - fullBlocks * 64;
+    if (left) memcpy(tail, data.data() + fullBlocks * 64, left);
+    tail[left] = 0x80;
+    size_t tailBlocks = left < 56 ? 1 : 2;
+    uint64_t bits = uint64_t(data.size()) * 8;
+    for (size_t n = 0; n < 8; n++) {
+      tail[tailBlocks * 64 - 1 - n] = bits >> (n * 8);
+    }
+    shaNiCompress(state, tail, tailBlocks);
+
+    ObjectId id;
+    for (size_t n = 0; n < 5; n++) {
+      id[n * 4] = state[n] >> 24;
+      id[n * 4 + 1] = state[n] >> 16;
+      id[n * 4 + 2] = state[n] >> 8;
+      id[n * 4 + 3] = state[n];
+    }
+    return id;
+  }
+#endif
+  return Caligo::SHA1(data).data();
+}
+
+std::vector<ObjectId> HashBuffers(std::span<const std::span<const uint8_t>> buffers, size_t threads) {
+  // Small objects are handed out in groups so the per-task overhead stays below the hashing itself
+  static constexpr size_t groupSize = 64;
+  std::vector<ObjectId> ids(buffers.size());
+  ParallelFor((buffers.size() + groupSize - 1) / groupSize, threads, [&](size_t group) {
+    size_t end = std::min(buffers.size(), (group + 1) * groupSize);
+    for (size_t n = group * groupSize; n < end; n++) {
+      ids[n] = HashBuffer(buffers[n]);
+    }
+  });
+  return ids;
+}
@@ -0,0 +1,163 @@
+#include "piget/Ignore.hpp"
+#include <cctype>
+#include <fstream>
+#include <optional>
+
+static bool classMatches(std::string_view name, unsigned char c) {
+  if (name == "alnum") return isalnum(c);
+  if (name == "alpha") return isalpha(c);
+  if (name == "blank") return c == ' ' || c == '\t';
+  if (name == "cntrl") return iscntrl(c);
+  if (name == "digit") return isdigit(c);
+  if (name == "graph") return isgraph(c);
+  if (name == "lower") return islower(c);
+  if (name == "print") return isprint(c);
+  if (name == "punct") return ispunct(c);
+  if (name == "space") return isspace(c);
+  if (name == "upper") return isupper(c);
+  if (name == "xdigit") return isxdigit(c);
+  return false;
+}
+
+// Matches the bracket expression at pattern[p] against c and moves p past it. nullopt when it is never closed,
+// which matches nothing, as in git.
+static std::optional<bool> matchBracket(std::string_view pattern, size_t& p, unsigned char c) {
+  size_t i = p + 1;
+  bool negated = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+  if (negated) i++;
+  bool matched = false;
+  // a ']' right at the start is a literal one
+  for (bool first = true; i < pattern.size() && (first || pattern[i] != ']'); first = false) {
+    if (pattern.compare(i, 2, "[:") == 0) {
+      size_t end = pattern.find(":]", i + 2);
+      if (end != std::string_view::npos) {
+        matched |= classMatches(pattern.substr(i + 2, end - i - 2), c);
+        i = end + 2;
+        continue;
+      }
+    }
+    unsigned char low = pattern[i];
+    if (low == '\\' && i + 1 < pattern.size()) low = pattern[++i];
+    unsigned char high = low;
+    if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+      i += 2;
+      high = pattern[i];
+      if (high == '\\' && i + 1 < pattern.size()) high = pattern[++i];
+    }
+    matched |= low <= c && c <= high;
+    i++;
+  }
+  if (i >= pattern.size()) return std::nullopt;
+  p = i + 1;
+  return matched != negated;
+}
+
+static bool wildMatch(std::string_view pattern, size_t p, std::string_view text, size_t t) {
+  while (p < pattern.size()) {
+    char c = pattern[p];
+    if (c == '*') {
+      size_t stars = std::min(pattern.find_first_not_of('*', p), pattern.size());
+      bool componentStart = p == 0 || pattern[p - 1] == '/';
+      bool componentEnd = stars == pattern.size() || pattern[stars] == '/';
+      if (stars - p >= 2 && componentStart && componentEnd) {
+        // a trailing "/**" takes everything below; "**/" stands for any number of whole directories
+        if (stars == pattern.size()) return true;
+        for (size_t from = t;; from++) {
+          if (wildMatch(pattern, stars + 1, text, from)) return true;
+          from = text.find('/', from);
+          if (from == std::string_view::npos) return false;
+        }
+      }
+      for (size_t end = t;; end++) {
+        if (wildMatch(pattern, stars, text, end)) return true;
+        if (end == text.size() || text[end] == '/') return false;
+      }
+    }
+    if (t == text.size() || ((c == '?' || c == '[') && text[t] == '/')) return false;
+    if (c == '[') {
+      auto matched = matchBracket(pattern, p, text[t]);
+      if (not matched || not *matched) return false;
+      t++;
+      continue;
+    }
+    if (c == '\\' && p + 1 < pattern.size()) c = pattern[++p];
+    if (c != '?' && c != text[t]) return false;
+    p++;
+    t++;
+  }
+  return t == text.size();
+}
+
+bool WildMatch(std::string_view pattern, std::string_view path) {
+  return wildMatch(pattern, 0, path, 0);
+}
+
+static std::optional<IgnoreRules::Pattern> parsePattern(std::string line) {
+  if (line.ends_with('\r')) line.pop_back();
+  // trailing spaces are dropped unless escaped
+  while (line.ends_with(' ') && not line.ends_with("\\ ")) line.pop_back();
+  if (line.empty() || line.starts_with('#')) return std::nullopt;
+  IgnoreRules::Pattern pattern;
+  if (line.starts_with('!')) {
+    pattern.negated = true;
+    line.erase(0, 1);
+  }
+  if (line.ends_with('/')) {
+    pattern.directoryOnly = true;
+    line.pop_back();
+  }
+  if (line.find('/') != std::string::npos) {
+    pattern.anchored = true;
+    if (line.starts_with('/')) line.erase(0, 1);
+  }
+  if (line.empty()) return std::nullopt;
+  pattern.pattern = std::move(line);
+  return pattern;
+}
+
+bool IgnoreRules::ignored(std::string_view path, bool directory) const {
+  for (const IgnoreRules* rules = this; rules; rules = rules->parent.get()) {
+    if (not path.starts_with(rules->base)) continue;
+    std::string_view relative = path.substr(rules->base.size());
+    std::string_view name = relative.substr(relative.rfind('/') + 1);
+    for (auto it = rules->patterns.rbegin(); it != rules->patterns.rend(); ++it) {
+      if (it->directoryOnly && not directory) continue;
+      if (WildMatch(it->pattern, it->anchored ? relative : name)) return not it->negated;
+    }
+  }
+  return false;
+}
+
+std::shared_ptr<const IgnoreRules> ReadIgnoreFile(const std::filesystem::path& file, std::string base, std::shared_ptr<const IgnoreRules> parent) {
+  std::ifstream in(file);
+  if (not in) return parent;
+  auto rules = std::make_shared<IgnoreRules>();
+  std::string line;
+  while (std::getline(in, line)) {
+    if (auto pattern = parsePattern(std::move(line))) rules->patterns.push_back(std::move(*pattern));
+  }
+  if (rules->patterns.empty()) return parent;
+  rules->parent = std::move(parent);
+  rules->base = std::move(base);
+  return rules;
+}
+
+std::shared_ptr<const IgnoreRules> ReadIgnoreRules(const std::filesystem::path& gitDir, std::string_view directory, bool& excluded) {
+  excluded = false;
+  auto rules = ReadIgnoreFile(gitDir / "info" / "exclude", "", std::make_shared<const IgnoreRules>());
+  rules = ReadIgnoreFile(".gitignore", "", std::move(rules));
+  std::string base;
+  while (not directory.empty()) {
+    size_t slash = directory.find('/');
+    base += directory.substr(0, slash);
+    // nothing below an excluded directory can be included again
+    if (rules->ignored(base, true)) {
+      excluded = true;
+      return rules;
+    }
+    base += '/';
+    rules = ReadIgnoreFile(base + ".gitignore", base, std::move(rules));
+    directory = slash == std::string_view::npos ? std::string_view() : directory.substr(slash + 1);
+  }
+  return rules;
+}
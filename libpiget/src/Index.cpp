@@ -1,120 +1,899 @@
 #include "piget/GitCAM.hpp"
+#include "piget/FileIO.hpp"
+#include "piget/Ignore.hpp"
 #include "piget/Object.hpp"
+#include "piget/Parallel.hpp"
 #include "tl/expected.hpp"
 #include <optional>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
 #include <ranges>
+#include <numeric>
+#include <set>
+#include <unordered_set>
 #include <bini/reader.h>
 #include <bini/writer.h>
 #include "caligo/sha1.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <cstring>
+#include <ctime>
+#include <strings.h>
 
 static constexpr const uint32_t DIRCACHE_MAGIC_NUMBER = 0x44495243;
 static constexpr const uint32_t DIRCACHE_CURRENT_VERSION = 2;
+static constexpr const uint32_t CACHE_TREE_SIGNATURE = 0x54524545;
+// piget's own file rather than git's UNTR index extension, which holds listings with exclusion already applied
+static constexpr const char* UNTRACKED_CACHE_FILE = ".git/piget-untracked";
+static constexpr const uint32_t UNTRACKED_CACHE_SIGNATURE = 0x554E5450;
+static constexpr const uint32_t UNTRACKED_CACHE_VERSION = 1;
 
-Index::Index(GitCAM& cam, bool withLock)
+static Index::CacheTree readCacheTree(Bini::reader& r) {
+  Index::CacheTree node;
+  node.name = r.getStringNT();
+  std::string counts;
+  for (uint8_t c = r.read8(); c != '\n' && not r.fail(); c = r.read8()) {
+    counts.push_back(c);
+  }
+  size_t space = counts.find(' ');
+  if (space == std::string::npos) {
+    throw std::runtime_error("Invalid cache tree in index");
+  }
+  node.entryCount = std::stol(counts.substr(0, space));
+  size_t subtrees = std::stoul(counts.substr(space + 1));
+  if (node.entryCount >= 0) {
+    node.hash = r.getArray<20>();
+  }
+  for (size_t n = 0; n < subtrees && not r.fail(); n++) {
+    node.children.push_back(readCacheTree(r));
+  }
+  return node;
+}
+
+static void writeCacheTree(Bini::writer& w, const Index::CacheTree& node) {
+  w.addNT(node.name);
+  std::string counts = std::to_string(node.entryCount) + " " + std::to_string(node.children.size()) + "\n";
+  w.add(std::span<const uint8_t>((const uint8_t*)counts.data(), counts.size()));
+  if (node.entryCount >= 0) {
+    w.add(node.hash);
+  }
+  // git keeps subtrees ordered by name length first, and writes them that way
+  std::vector<const Index::CacheTree*> children;
+  for (auto& child : node.children) {
+    children.push_back(&child);
+  }
+  std::sort(children.begin(), children.end(), [](const Index::CacheTree* lhs, const Index::CacheTree* rhs) {
+    return std::pair(lhs->name.size(), std::string_view(lhs->name)) < std::pair(rhs->name.size(), std::string_view(rhs->name));
+  });
+  for (auto* child : children) {
+    writeCacheTree(w, *child);
+  }
+}
+
+Index::Index(GitCAM& cam, Lock locking)
 : cam(cam)
 {
-  if (withLock) {
-
-    haveLock = true;
+  // taken before reading, so nothing changes the index between load and save
+  if (locking == Lock::Required) {
+    lock = LockFile(".git/index");
+  } else if (locking == Lock::IfFree) {
+    lock.tryLock(".git/index");
   }
   load();
+  loadUntrackedCache();
 }
 
-Index::~Index() {
-  save();
-  if (haveLock) {
+Index::~Index() = default;
 
-  }
+// Directories compare as if their names ended in '/', as they do in a tree
+static bool dirNameLess(std::string_view lhs, std::string_view rhs) {
+  size_t common = std::min(lhs.size(), rhs.size());
+  int cmp = memcmp(lhs.data(), rhs.data(), common);
+  if (cmp != 0) return cmp < 0;
+  uint8_t l = common < lhs.size() ? lhs[common] : '/';
+  uint8_t r = common < rhs.size() ? rhs[common] : '/';
+  return l < r;
 }
 
-Object Index::toTree(std::optional<std::array<uint8_t, 20>> parentCommit) {
-  std::map<std::filesystem::path, Tree> pendingTrees;
+static void appendTreeEntry(std::vector<uint8_t>& body, uint32_t mode, std::string_view name, const ObjectId& hash) {
+  size_t offset = body.size();
+  body.resize(offset + TreeEntrySize(mode, name));
+  WriteTreeEntry(body.data() + offset, mode, name, hash);
+}
 
-  if (parentCommit) {
-    auto parent = cam.get(parentCommit.value());
-    if (not parent) {
-      throw std::runtime_error("Invalid parent commit");
+Object Index::toTree() {
+  if (cacheTree.entryCount >= 0) {
+    auto root = cam.get(cacheTree.hash);
+    if (not root) {
+      throw std::runtime_error("Corrupted storage; backing file for tree deleted");
     }
-    pendingTrees[""] = parent->readAsTree();
-  } else {
-    pendingTrees[""];
-  }
-  for (const auto& [name, obj] : objects) {
-    std::vector<std::filesystem::path> treesToLoad;
-    treesToLoad.push_back(name.parent_path());
-    while (not treesToLoad.empty()) {
-      auto path = treesToLoad.back();
-      if (auto it = pendingTrees.find(path.parent_path()); it != pendingTrees.end()) {
-        auto file = it->second.get(path.filename());
-        if (file) {
-          auto blob = cam.get(file.value());
-          if (not blob) {
-            throw std::runtime_error("Corrupted storage; backing file for tree deleted");
-          }
-          // load tree
-          pendingTrees[path] = cam.get(file.value())->readAsTree();
-        } else {
-          // create new empty tree for this folder
-          pendingTrees[path];
-        }
-        treesToLoad.pop_back();
+    return *root;
+  }
+
+  // One frame per directory that is open on the path to the current entry
+  struct Frame {
+    std::string_view prefix;
+    CacheTree node;
+    size_t firstEntry;
+    size_t nextChild = 0;
+    std::vector<CacheTree> children;
+    std::vector<uint8_t> body;
+  };
+  auto open = [](std::string_view prefix, CacheTree node, size_t firstEntry) {
+    std::sort(node.children.begin(), node.children.end(), [](const CacheTree& lhs, const CacheTree& rhs) {
+      return dirNameLess(lhs.name, rhs.name);
+    });
+    return Frame{prefix, std::move(node), firstEntry, 0, {}, {}};
+  };
+
+  std::vector<const Entry*> entries;
+  entries.reserve(objects.size());
+  for (auto& [_, e] : objects) {
+    entries.push_back(&e);
+  }
+
+  // The new trees are stored together at the end, so a durable store syncs once rather than once per tree
+  std::vector<Object> written;
+  std::vector<Frame> stack;
+  stack.push_back(open("", std::move(cacheTree), 0));
+  size_t n = 0;
+  while (true) {
+    Frame& top = stack.back();
+    if (n < entries.size() && entries[n]->fileName.starts_with(top.prefix)) {
+      std::string_view name = entries[n]->fileName;
+      std::string_view rest = name.substr(top.prefix.size());
+      size_t slash = rest.find('/');
+      if (slash == std::string_view::npos) {
+        appendTreeEntry(top.body, entries[n]->mode, rest, entries[n]->hash);
+        n++;
+        continue;
+      }
+      // Subdirectories come up in the same order as the sorted old cache tree children
+      std::string_view dirName = rest.substr(0, slash);
+      auto& oldChildren = top.node.children;
+      while (top.nextChild < oldChildren.size() && dirNameLess(oldChildren[top.nextChild].name, dirName)) {
+        top.nextChild++;
+      }
+      CacheTree child;
+      if (top.nextChild < oldChildren.size() && oldChildren[top.nextChild].name == dirName) {
+        child = std::move(oldChildren[top.nextChild++]);
+      } else {
+        child.name = dirName;
+      }
+      if (child.entryCount >= 0 && n + child.entryCount <= entries.size()) {
+        appendTreeEntry(top.body, 040000, dirName, child.hash);
+        n += child.entryCount;
+        top.children.push_back(std::move(child));
       } else {
-        treesToLoad.push_back(path.parent_path());
+        stack.push_back(open(name.substr(0, top.prefix.size() + slash + 1), std::move(child), n));
       }
+      continue;
     }
-    pendingTrees[name.parent_path()].set(name.filename(), DirEntry{static_cast<uint16_t>(obj.mode), name, obj.hash});
-  }
-  while (pendingTrees.size() > 1) {
-    auto it = --pendingTrees.end();
-    auto [path, tree] = *it;
-    pendingTrees.erase(it);
-    Object obj(tree);
-    pendingTrees[path.parent_path()].set(path.filename(), { 040000, path.filename(), obj.id() });
-    cam.add(obj);
+
+    written.emplace_back(Object::Type::Tree, top.body);
+    top.node.hash = written.back().id();
+    top.node.entryCount = n - top.firstEntry;
+    top.node.children = std::move(top.children);
+    CacheTree done = std::move(top.node);
+    stack.pop_back();
+    if (stack.empty()) {
+      cacheTree = std::move(done);
+      break;
+    }
+    appendTreeEntry(stack.back().body, 040000, done.name, done.hash);
+    stack.back().children.push_back(std::move(done));
   }
-  return Object(pendingTrees[""]);
+  cam.add(written);
+  changed = true;
+  return std::move(written.back());
 }
 
-void Index::add(std::filesystem::path path) {
-  struct stat statbuf;
-  if (stat(path.c_str(), &statbuf) == -1) {
-    throw std::runtime_error("error " + std::to_string(errno));
+void Index::invalidate(std::string_view path) {
+  CacheTree* node = &cacheTree;
+  while (node) {
+    node->entryCount = -1;
+    size_t slash = path.find('/');
+    if (slash == std::string_view::npos) return;
+    std::string_view dirName = path.substr(0, slash);
+    path = path.substr(slash + 1);
+    auto it = std::find_if(node->children.begin(), node->children.end(), [&](const CacheTree& child) { return child.name == dirName; });
+    node = it == node->children.end() ? nullptr : &*it;
   }
-  Entry e;
+}
+
+// Index entries only carry the modes a tree can hold
+static uint32_t gitMode(mode_t mode) {
+  if (S_ISLNK(mode)) return 0120000;
+  if (S_ISDIR(mode)) return 0160000;
+  return (mode & 0111) ? 0100755 : 0100644;
+}
+
+static void setStat(Index::Entry& e, const struct stat& statbuf) {
   e.ctime_sec = statbuf.st_ctim.tv_sec;
   e.ctime_ns = statbuf.st_ctim.tv_nsec;
   e.mtime_sec = statbuf.st_mtim.tv_sec;
   e.mtime_ns = statbuf.st_mtim.tv_nsec;
   e.dev = statbuf.st_dev;
   e.ino = statbuf.st_ino;
-  e.mode = statbuf.st_mode;
+  e.mode = gitMode(statbuf.st_mode);
   e.uid = statbuf.st_uid;
   e.gid = statbuf.st_gid;
   e.filesize = statbuf.st_size;
-  e.flags = path.string().size() > 0xFFF ? 0xFFF : path.string().size();
-  e.fileName = path;
+}
+
+// Compared the way the index stores them, truncated to 32 bits
+static bool statMatches(const Index::Entry& e, const struct stat& statbuf) {
+  return e.ctime_sec == (uint32_t)statbuf.st_ctim.tv_sec &&
+         e.ctime_ns == (uint32_t)statbuf.st_ctim.tv_nsec &&
+         e.mtime_sec == (uint32_t)statbuf.st_mtim.tv_sec &&
+         e.mtime_ns == (uint32_t)statbuf.st_mtim.tv_nsec &&
+         e.dev == (uint32_t)statbuf.st_dev &&
+         e.ino == (uint32_t)statbuf.st_ino &&
+         e.mode == gitMode(statbuf.st_mode) &&
+         e.filesize == (uint32_t)statbuf.st_size;
+}
+
+// The id of an empty blob; a size of zero only means "smudged" for entries with other content
+static const ObjectId emptyBlobId = *ObjectId::fromHex("e69de29bb2d1d6434b8b29ae775ad8c2e48c5391");
+
+static bool isSmudged(const Index::Entry& e) {
+  return e.filesize == 0 && e.hash != emptyBlobId;
+}
+
+bool Index::isRacy(const Entry& e) const {
+  return e.mtime_sec > indexMtimeSec ||
+         (e.mtime_sec == indexMtimeSec && e.mtime_ns >= indexMtimeNs);
+}
+
+bool Index::tracksBelow(const std::string& directory) const {
+  auto it = objects.lower_bound(directory);
+  return it != objects.end() && it->first.starts_with(directory);
+}
+
+// A size of zero is how racily clean entries are stored, so those always get verified
+bool Index::unchanged(const std::string& key, const struct stat& statbuf) const {
+  auto it = objects.find(key);
+  return it != objects.end() && statMatches(it->second, statbuf) && not isSmudged(it->second) && not isRacy(it->second);
+}
+
+static Index::Entry makeEntry(const std::string& fileName, const struct stat& statbuf, const ObjectId& hash) {
+  Index::Entry e;
+  setStat(e, statbuf);
+  e.flags = fileName.size() > 0xFFF ? 0xFFF : fileName.size();
+  e.fileName = fileName;
+  e.hash = hash;
+  return e;
+}
 
-  Object obj(path);
-  e.hash = obj.id();
-  cam.add(obj);
-  objects.insert(std::make_pair(path, std::move(e)));
+static std::string parentDirectory(std::string_view path) {
+  size_t slash = path.rfind('/');
+  return std::string(path.substr(0, slash == std::string_view::npos ? 0 : slash));
+}
+
+void Index::store(Entry e) {
+  auto it = objects.lower_bound(e.fileName);
+  bool exists = it != objects.end() && it->first == e.fileName;
+  if (not exists || it->second.hash != e.hash || it->second.mode != e.mode) {
+    invalidate(e.fileName);
+  }
+  if (exists) {
+    it->second = std::move(e);
+  } else {
+    std::string key = e.fileName;
+    objects.emplace_hint(it, std::move(key), std::move(e));
+  }
+  changed = true;
+}
+
+// A symlink is stored as a blob of its target, like in git
+static Object symlinkBlob(const std::filesystem::path& path) {
+  std::error_code ec;
+  std::string target = std::filesystem::read_symlink(path, ec).string();
+  if (ec) {
+    throw std::runtime_error("error " + std::to_string(ec.value()) + " reading " + path.string());
+  }
+  return Object(Object::Type::Object, std::span<const uint8_t>((const uint8_t*)target.data(), target.size()));
+}
+
+void Index::add(std::filesystem::path path) {
+  struct stat statbuf;
+  if (lstat(path.c_str(), &statbuf) == -1) {
+    throw std::runtime_error("error " + std::to_string(errno));
+  }
+  std::string key = path.string();
+  if (unchanged(key, statbuf)) return;
+  store(makeEntry(key, statbuf, S_ISLNK(statbuf.st_mode) ? cam.add(symlinkBlob(path)) : cam.addFile(path)));
+}
+
+void Index::addAll(std::filesystem::path directory, size_t threads) {
+  directory = directory.lexically_normal();
+  if (directory == ".") directory.clear();
+  std::string top = directory.string();
+  if (top.ends_with('/')) top.pop_back();
+
+  // Inside an excluded directory only the files that are tracked already are added again
+  struct Directory {
+    std::filesystem::path path;
+    std::shared_ptr<const IgnoreRules> rules;
+    bool excluded;
+  };
+  bool excluded;
+  auto rules = ReadIgnoreRules(".git", top, excluded);
+  if (excluded && not tracksBelow(top + "/")) return;
+
+  // Breadth first, listing all directories of one level in parallel
+  std::vector<Directory> level = { { directory, std::move(rules), excluded } };
+  std::vector<std::filesystem::path> files;
+  while (not level.empty()) {
+    std::vector<std::vector<Directory>> subdirs(level.size());
+    std::vector<std::vector<std::filesystem::path>> found(level.size());
+    ParallelFor(level.size(), threads, [&](size_t n) {
+      Directory& dir = level[n];
+      for (auto& entry : std::filesystem::directory_iterator(dir.path.empty() ? "." : dir.path)) {
+        std::string name = entry.path().filename().string();
+        if (name == ".git") continue;
+        std::filesystem::path path = dir.path / name;
+        std::string key = path.string();
+        auto status = entry.symlink_status();
+        if (std::filesystem::is_directory(status)) {
+          bool excluded = dir.excluded || dir.rules->ignored(key, true);
+          if (excluded && not tracksBelow(key + "/")) continue;
+          auto rules = excluded ? dir.rules : ReadIgnoreFile(path / ".gitignore", key + "/", dir.rules);
+          subdirs[n].push_back({ std::move(path), std::move(rules), excluded });
+        } else if (std::filesystem::is_regular_file(status) || std::filesystem::is_symlink(status)) {
+          if ((dir.excluded || dir.rules->ignored(key, false)) && not objects.contains(key)) continue;
+          found[n].push_back(std::move(path));
+        }
+      }
+    });
+    level.clear();
+    for (size_t n = 0; n < subdirs.size(); n++) {
+      std::move(subdirs[n].begin(), subdirs[n].end(), std::back_inserter(level));
+      files.insert(files.end(), found[n].begin(), found[n].end());
+    }
+  }
+
+  // Stat data decides which files need their contents read at all
+  std::vector<struct stat> stats(files.size());
+  std::vector<uint8_t> needed(files.size());
+  ParallelFor(files.size(), threads, [&](size_t n) {
+    if (lstat(files[n].c_str(), &stats[n]) == -1) {
+      throw std::runtime_error("error " + std::to_string(errno) + " reading " + files[n].string());
+    }
+    needed[n] = not unchanged(files[n].string(), stats[n]);
+  });
+  std::vector<std::filesystem::path> toStore;
+  std::vector<size_t> toStoreIndex, linkIndex;
+  std::vector<Object> links;
+  for (size_t n = 0; n < files.size(); n++) {
+    if (not needed[n]) continue;
+    if (S_ISLNK(stats[n].st_mode)) {
+      links.push_back(symlinkBlob(files[n]));
+      linkIndex.push_back(n);
+    } else {
+      toStore.push_back(files[n]);
+      toStoreIndex.push_back(n);
+    }
+  }
+  std::vector<ObjectId> hashes = cam.addFiles(toStore, threads);
+  std::vector<ObjectId> linkHashes = cam.add(links, threads);
+
+  std::vector<Entry> entries;
+  entries.reserve(toStore.size() + links.size());
+  for (size_t n = 0; n < toStore.size(); n++) {
+    entries.push_back(makeEntry(toStore[n].string(), stats[toStoreIndex[n]], hashes[n]));
+  }
+  for (size_t n = 0; n < links.size(); n++) {
+    entries.push_back(makeEntry(files[linkIndex[n]].string(), stats[linkIndex[n]], linkHashes[n]));
+  }
+  std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+    return lhs.fileName < rhs.fileName;
+  });
+  for (auto& e : entries) {
+    store(std::move(e));
+  }
 }
 
 void Index::remove(std::filesystem::path path) {
-  objects.erase(path);
+  if (objects.erase(path.string())) {
+    invalidate(path.string());
+    changed = true;
+  }
+}
+
+std::vector<std::filesystem::path> Index::refresh(size_t threads) {
+  std::vector<Entry*> entries;
+  entries.reserve(objects.size());
+  for (auto& [_, e] : objects) {
+    entries.push_back(&e);
+  }
+
+  enum class State { Clean, Updated, Modified, Missing };
+  std::vector<State> states(entries.size());
+  std::vector<struct stat> stats(entries.size());
+  ParallelFor(entries.size(), threads, [&](size_t n) {
+    Entry& e = *entries[n];
+    if (lstat(e.fileName.c_str(), &stats[n]) == -1) {
+      states[n] = State::Missing;
+    } else if (statMatches(e, stats[n]) && not isSmudged(e) && not isRacy(e)) {
+      states[n] = State::Clean;
+    } else if (e.mode == 0160000 && S_ISDIR(stats[n].st_mode)) {
+      // submodules are checked out by their own repository
+      states[n] = State::Clean;
+    } else if (S_ISLNK(stats[n].st_mode) && e.mode == 0120000) {
+      states[n] = symlinkBlob(e.fileName).id() == e.hash ? State::Updated : State::Modified;
+    } else if (not S_ISREG(stats[n].st_mode) || e.mode == 0120000) {
+      states[n] = State::Modified;
+    } else {
+      states[n] = HashFile(e.fileName) == e.hash ? State::Updated : State::Modified;
+    }
+  });
+
+  std::vector<std::filesystem::path> modified;
+  for (size_t n = 0; n < entries.size(); n++) {
+    switch (states[n]) {
+    case State::Clean:
+      break;
+    case State::Updated:
+      setStat(*entries[n], stats[n]);
+      changed = true;
+      break;
+    case State::Modified:
+    case State::Missing:
+      modified.push_back(entries[n]->fileName);
+      break;
+    }
+  }
+  return modified;
+}
+
+void Index::diffHead(const Database& db, const std::optional<ObjectId>& tree, const std::string& prefix, const CacheTree* node,
+                     std::vector<TreeChange>& out) const {
+  std::shared_ptr<const Object> object;
+  TreeView before;
+  if (tree) {
+    object = db.getShared(*tree);
+    if (not object) {
+      throw std::runtime_error("Tree " + tree->hex() + " is missing");
+    }
+    before = object->viewAsTree();
+  }
+  auto change = [&](const std::string& path, const TreeView::Entry* lhs, const Entry* rhs) {
+    TreeChange c{lhs && rhs ? TreeChange::Status::Modified : lhs ? TreeChange::Status::Deleted : TreeChange::Status::Added, path, 0, 0, {}, {}};
+    if (lhs) {
+      c.oldMode = lhs->fileMode;
+      c.oldId = lhs->hash;
+    }
+    if (rhs) {
+      c.newMode = rhs->mode;
+      c.newId = rhs->hash;
+    }
+    out.push_back(std::move(c));
+  };
+
+  // Both sides in tree order: index keys sort like full paths, so a directory is compared by its name plus '/'
+  auto entry = before.begin();
+  auto it = objects.lower_bound(prefix);
+  while (true) {
+    bool haveIndex = it != objects.end() && it->first.starts_with(prefix);
+    if (entry == before.end() && not haveIndex) break;
+    std::string_view indexName;
+    if (haveIndex) {
+      indexName = std::string_view(it->first).substr(prefix.size());
+      if (size_t slash = indexName.find('/'); slash != std::string_view::npos) indexName = indexName.substr(0, slash + 1);
+    }
+    std::string treeName;
+    if (entry != before.end()) {
+      treeName = entry->fileName;
+      if (entry->fileMode == 040000) treeName += '/';
+    }
+    int cmp = entry == before.end() ? 1 : not haveIndex ? -1 : treeName.compare(indexName);
+    bool directory = cmp <= 0 ? treeName.ends_with('/') : indexName.ends_with('/');
+    std::string path = prefix + std::string(cmp <= 0 ? treeName : indexName);
+    if (directory) {
+      const CacheTree* child = nullptr;
+      if (cmp == 0 && node) {
+        auto found = std::find_if(node->children.begin(), node->children.end(), [&](const CacheTree& c) { return c.name == entry->fileName; });
+        if (found != node->children.end()) child = &*found;
+      }
+      // a subtree the cache tree still has at HEAD's id is identical, without looking at its entries
+      if (not child || child->entryCount < 0 || child->hash != entry->hash) {
+        diffHead(db, cmp <= 0 ? std::optional(entry->hash) : std::nullopt, path, child, out);
+      }
+      // '0' follows '/', so this is the first key past the directory
+      if (cmp >= 0) it = objects.lower_bound(path.substr(0, path.size() - 1) + "0");
+    } else if (cmp < 0) {
+      change(path, &*entry, nullptr);
+    } else if (cmp > 0) {
+      change(path, nullptr, &it->second);
+    } else if (entry->hash != it->second.hash || entry->fileMode != it->second.mode) {
+      change(path, &*entry, &it->second);
+    }
+    if (cmp <= 0) ++entry;
+    if (cmp >= 0 && not directory) it++;
+  }
+}
+
+struct Index::Listing {
+  const CachedDirectory* cached = nullptr;
+  // Set when the directory was read; recent ones are not cached, as they may still change within the same mtime
+  std::optional<CachedDirectory> fresh;
+  bool recent = false;
+};
+
+Index::Listing Index::listDirectory(const std::string& path, time_t scanStart) const {
+  Listing listing;
+  const char* name = path.empty() ? "." : path.c_str();
+  struct stat statbuf;
+  if (lstat(name, &statbuf) == -1 || not S_ISDIR(statbuf.st_mode)) return listing;
+  // Adding, removing or renaming a file changes the mtime of its directory; new content does not
+  auto cached = untrackedCache.find(path);
+  if (cached != untrackedCache.end() &&
+      cached->second.mtime_sec == (uint32_t)statbuf.st_mtim.tv_sec &&
+      cached->second.mtime_ns == (uint32_t)statbuf.st_mtim.tv_nsec) {
+    listing.cached = &cached->second;
+    return listing;
+  }
+
+  CachedDirectory& dir = listing.fresh.emplace();
+  dir.mtime_sec = statbuf.st_mtim.tv_sec;
+  dir.mtime_ns = statbuf.st_mtim.tv_nsec;
+  listing.recent = statbuf.st_mtim.tv_sec >= scanStart;
+  int fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error("error " + std::to_string(errno) + " opening " + std::string(name));
+  }
+  std::string prefix = path.empty() ? "" : path + "/";
+  alignas(struct dirent64) char buffer[32768];
+  ssize_t size;
+  while ((size = getdents64(fd, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t offset = 0; offset < size;) {
+      auto* entry = (struct dirent64*)(buffer + offset);
+      offset += entry->d_reclen;
+      std::string_view fileName = entry->d_name;
+      if (fileName == "." || fileName == ".." || fileName == ".git") continue;
+      unsigned char type = entry->d_type;
+      // some filesystems leave the type out of the listing
+      if (type == DT_UNKNOWN) {
+        struct stat entryStat;
+        if (fstatat(fd, entry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) == -1) continue;
+        type = S_ISDIR(entryStat.st_mode) ? DT_DIR : S_ISREG(entryStat.st_mode) ? DT_REG : S_ISLNK(entryStat.st_mode) ? DT_LNK : DT_UNKNOWN;
+      }
+      if (type == DT_DIR) {
+        dir.subdirectories.emplace_back(fileName);
+      } else if (type == DT_REG || type == DT_LNK) {
+        dir.files.emplace_back(fileName);
+      }
+    }
+  }
+  int error = errno;
+  close(fd);
+  if (size < 0) {
+    throw std::runtime_error("error " + std::to_string(error) + " listing " + std::string(name));
+  }
+  std::sort(dir.files.begin(), dir.files.end());
+  std::sort(dir.subdirectories.begin(), dir.subdirectories.end());
+  return listing;
+}
+
+std::vector<std::string> Index::findUntracked(size_t threads) {
+  time_t scanStart = time(nullptr);
+  bool excluded;
+  std::vector<std::string> level = { "" }, untracked;
+  std::vector<std::shared_ptr<const IgnoreRules>> levelRules = { ReadIgnoreRules(".git", "", excluded) };
+  std::set<std::string> listed;
+  // Breadth first, listing all directories of one level in parallel
+  while (not level.empty()) {
+    std::vector<Listing> listings(level.size());
+    ParallelFor(level.size(), threads, [&](size_t n) {
+      listings[n] = listDirectory(level[n], scanStart);
+      if (not level[n].empty()) {
+        levelRules[n] = ReadIgnoreFile(level[n] + "/.gitignore", level[n] + "/", std::move(levelRules[n]));
+      }
+    });
+    std::vector<std::string> next;
+    std::vector<std::shared_ptr<const IgnoreRules>> nextRules;
+    for (size_t n = 0; n < level.size(); n++) {
+      const CachedDirectory* dir = listings[n].fresh ? &*listings[n].fresh : listings[n].cached;
+      if (not dir) continue;
+      listed.insert(level[n]);
+      std::string prefix = level[n].empty() ? "" : level[n] + "/";
+      const IgnoreRules& rules = *levelRules[n];
+      for (auto& name : dir->files) {
+        std::string path = prefix + name;
+        if (not objects.contains(path) && not rules.ignored(path, false)) untracked.push_back(std::move(path));
+      }
+      for (auto& name : dir->subdirectories) {
+        auto it = objects.find(prefix + name);
+        // submodules are walked by their own repository
+        if (it != objects.end() && it->second.mode == 0160000) continue;
+        // everything untracked below an excluded directory is excluded too
+        if (rules.ignored(prefix + name, true)) continue;
+        next.push_back(prefix + name);
+        nextRules.push_back(levelRules[n]);
+      }
+    }
+    for (size_t n = 0; n < level.size(); n++) {
+      if (not listings[n].fresh) continue;
+      if (listings[n].recent) {
+        untrackedCache.erase(level[n]);
+      } else {
+        untrackedCache[level[n]] = std::move(*listings[n].fresh);
+      }
+      untrackedCacheChanged = true;
+    }
+    level = std::move(next);
+    levelRules = std::move(nextRules);
+  }
+  untrackedCacheChanged |= std::erase_if(untrackedCache, [&](auto& dir) { return not listed.contains(dir.first); }) > 0;
+  std::sort(untracked.begin(), untracked.end());
+  return untracked;
+}
+
+Index::Status Index::status(const Database& db, const std::optional<ObjectId>& headTree, size_t threads) {
+  Status status;
+  if (cacheTree.entryCount < 0 || not headTree || cacheTree.hash != *headTree) {
+    diffHead(db, headTree, "", &cacheTree, status.staged);
+  }
+
+  for (auto& path : refresh(threads)) {
+    struct stat statbuf;
+    if (lstat(path.c_str(), &statbuf) == -1) {
+      status.deleted.push_back(path.string());
+    } else {
+      status.modified.push_back(path.string());
+    }
+  }
+
+  // A directory with nothing tracked below it is reported as a whole
+  for (auto& path : findUntracked(threads)) {
+    std::string shown = path;
+    for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+      if (not tracksBelow(path.substr(0, slash + 1))) {
+        shown = path.substr(0, slash + 1);
+        break;
+      }
+    }
+    if (status.untracked.empty() || status.untracked.back() != shown) status.untracked.push_back(std::move(shown));
+  }
+  return status;
+}
+
+// Names that would leave the worktree or reach into the repository are refused, as git does
+static bool safeTreeEntryName(std::string_view name) {
+  return not name.empty() && name != "." && name != ".." && name.find('/') == std::string_view::npos &&
+         not (name.size() == 4 && strncasecmp(name.data(), ".git", 4) == 0);
+}
+
+// Whether a directory on the way to path is a symlink or not a directory at all, so that writing or removing
+// path would follow it, possibly out of the worktree. Like git's has_symlink_leading_path.
+static bool hasSymlinkLeadingPath(std::string_view path) {
+  for (size_t slash = path.find('/'); slash != std::string_view::npos; slash = path.find('/', slash + 1)) {
+    std::string dir(path.substr(0, slash));
+    struct stat statbuf;
+    // nothing below a missing directory exists either
+    if (lstat(dir.c_str(), &statbuf) == -1) return false;
+    if (not S_ISDIR(statbuf.st_mode)) return true;
+  }
+  return false;
+}
+
+void Index::checkout(const Database& db, const ObjectId& tree, size_t threads) {
+  struct File {
+    std::string path;
+    uint32_t mode;
+    ObjectId id;
+    // Tracked already with this content and still present, so it is left as it is
+    bool keep = false;
+    const Pack* pack = nullptr;
+    size_t offset = 0;
+    struct stat statbuf = {};
+  };
+  std::vector<std::string> directories;
+  std::vector<File> files;
+
+  // Depth first in tree order, which is index order; the cache tree comes out of the same walk
+  auto flatten = [&](auto& self, const ObjectId& id, std::string name, const std::string& prefix) -> CacheTree {
+    auto object = db.getShared(id);
+    if (not object) {
+      throw std::runtime_error("Tree " + id.hex() + " is missing");
+    }
+    CacheTree node;
+    node.name = std::move(name);
+    node.hash = id;
+    size_t firstFile = files.size();
+    for (auto& entry : object->viewAsTree()) {
+      std::string path = prefix;
+      path += entry.fileName;
+      if (not safeTreeEntryName(entry.fileName)) {
+        throw std::runtime_error("Invalid path " + path + " in tree " + id.hex());
+      }
+      if (entry.fileMode == 040000) {
+        directories.push_back(path);
+        node.children.push_back(self(self, entry.hash, std::string(entry.fileName), path + "/"));
+      } else {
+        files.push_back({std::move(path), entry.fileMode, entry.hash});
+      }
+    }
+    node.entryCount = files.size() - firstFile;
+    return node;
+  };
+  CacheTree root = flatten(flatten, tree, "", "");
+  for (auto& file : files) {
+    // submodules get the empty directory git leaves for them
+    if (file.mode == 0160000) directories.push_back(file.path);
+  }
+
+  // Nothing is touched before it is clear that no local change and no untracked file is lost, like in git.
+  // Local changes are found with the stat data, so that has to be current first.
+  std::unordered_set<std::string> dirty;
+  for (auto& path : refresh(threads)) {
+    struct stat statbuf;
+    // a tracked file that is gone has nothing left to lose
+    if (lstat(path.c_str(), &statbuf) == 0) dirty.insert(path.string());
+  }
+  std::vector<std::string> localChanges, untracked;
+  std::unordered_set<std::string_view> newPaths;
+  for (auto& file : files) {
+    newPaths.insert(file.path);
+    auto it = objects.find(file.path);
+    if (it == objects.end()) {
+      struct stat statbuf;
+      if (hasSymlinkLeadingPath(file.path) || lstat(file.path.c_str(), &statbuf) == -1) continue;
+      if (file.mode == 0160000 && S_ISDIR(statbuf.st_mode)) continue;
+      // a directory in the way may only hold tracked files, which all go as the tree has a file there
+      bool inTheWay = not S_ISDIR(statbuf.st_mode);
+      std::error_code ec;
+      for (auto& entry : std::filesystem::recursive_directory_iterator(file.path, ec)) {
+        if (not entry.is_directory(ec) && not objects.contains(entry.path().string())) inTheWay = true;
+      }
+      if (inTheWay) untracked.push_back(file.path);
+    } else if (it->second.hash == file.id && it->second.mode == file.mode) {
+      // an unchanged file keeps its local changes, and a missing one is written again
+      struct stat statbuf;
+      file.keep = lstat(file.path.c_str(), &statbuf) == 0;
+    } else if (dirty.contains(file.path)) {
+      localChanges.push_back(file.path);
+    }
+  }
+  std::vector<std::string> removed;
+  for (auto& [path, entry] : objects) {
+    if (newPaths.contains(path)) continue;
+    if (dirty.contains(path)) localChanges.push_back(path);
+    removed.push_back(path);
+  }
+  // every leading directory of every file is in directories, so this also keeps writes from following symlinks
+  std::unordered_set<std::string_view> removedPaths(removed.begin(), removed.end());
+  for (auto& dir : directories) {
+    struct stat statbuf;
+    if (lstat(dir.c_str(), &statbuf) == 0 && not S_ISDIR(statbuf.st_mode) && not removedPaths.contains(dir)) {
+      untracked.push_back(dir);
+    }
+  }
+  if (not localChanges.empty() || not untracked.empty()) {
+    std::string message;
+    if (not localChanges.empty()) {
+      std::sort(localChanges.begin(), localChanges.end());
+      message += "Your local changes to the following files would be overwritten by checkout:\n";
+      for (auto& path : localChanges) message += "\t" + path + "\n";
+    }
+    if (not untracked.empty()) {
+      std::sort(untracked.begin(), untracked.end());
+      message += "The following untracked working tree files would be overwritten by checkout:\n";
+      for (auto& path : untracked) message += "\t" + path + "\n";
+    }
+    throw std::runtime_error(message + "Aborting");
+  }
+
+  // Tracked files that are not in the new tree go first, as one of them may be in the way of a new directory
+  for (auto& path : removed) {
+    // never through a symlink, which could point out of the worktree
+    if (hasSymlinkLeadingPath(path)) continue;
+    if (objects.at(path).mode == 0160000 ? rmdir(path.c_str()) == -1 : unlink(path.c_str()) == -1) continue;
+    // directories it leaves empty go too; rmdir fails on the first one that is not
+    std::string dir = parentDirectory(path);
+    while (not dir.empty() && rmdir(dir.c_str()) == 0) {
+      dir = parentDirectory(dir);
+    }
+  }
+
+  for (auto& dir : directories) {
+    struct stat statbuf;
+    if (mkdir(dir.c_str(), 0777) == -1 && not (errno == EEXIST && lstat(dir.c_str(), &statbuf) == 0 && S_ISDIR(statbuf.st_mode))) {
+      throw std::runtime_error("error " + std::to_string(errno) + " creating directory " + dir);
+    }
+  }
+  // Reading blobs in pack order keeps each worker's reads sequential; loose blobs go last
+  ParallelFor(files.size(), threads, [&](size_t n) {
+    if (files[n].keep) return;
+    if (auto location = db.packLocation(files[n].id)) std::tie(files[n].pack, files[n].offset) = *location;
+  });
+  std::vector<size_t> order;
+  for (size_t n = 0; n < files.size(); n++) {
+    if (not files[n].keep) order.push_back(n);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+    const File& l = files[lhs];
+    const File& r = files[rhs];
+    if ((l.pack == nullptr) != (r.pack == nullptr)) return r.pack == nullptr;
+    if (l.pack != r.pack) return std::less<const Pack*>()(l.pack, r.pack);
+    return l.offset < r.offset;
+  });
+
+  // Workers take runs of neighbouring blobs rather than single files
+  static constexpr size_t batchSize = 64;
+  ParallelFor((order.size() + batchSize - 1) / batchSize, threads, [&](size_t batch) {
+    for (size_t n = batch * batchSize; n < std::min(order.size(), (batch + 1) * batchSize); n++) {
+      File& file = files[order[n]];
+      const char* path = file.path.c_str();
+      bool found = true;
+      if (file.mode == 0120000) {
+        std::string target;
+        found = db.stream(file.id, [&](std::span<const uint8_t> data) { target.append(data.begin(), data.end()); });
+        unlink(path);
+        if (found && symlink(target.c_str(), path) == -1) {
+          throw std::runtime_error("error " + std::to_string(errno) + " creating " + file.path);
+        }
+      } else if (file.mode != 0160000) {
+        // A new file rather than a truncated old one, so the mode it is created with applies
+        unlink(path);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, file.mode == 0100755 ? 0777 : 0666);
+        if (fd == -1) {
+          throw std::runtime_error("error " + std::to_string(errno) + " creating " + file.path);
+        }
+        try {
+          found = db.stream(file.id, [&](std::span<const uint8_t> data) { WriteAll(fd, data, file.path); });
+        } catch (...) {
+          close(fd);
+          throw;
+        }
+        close(fd);
+      }
+      if (not found) {
+        throw std::runtime_error("Blob " + file.id.hex() + " for " + file.path + " is missing");
+      }
+      if (lstat(path, &file.statbuf) == -1) {
+        throw std::runtime_error("error " + std::to_string(errno) + " reading " + file.path);
+      }
+    }
+  });
+
+  std::map<std::string, Entry> updated;
+  for (auto& file : files) {
+    if (file.keep) {
+      updated.emplace_hint(updated.end(), file.path, std::move(objects[file.path]));
+      continue;
+    }
+    Entry e = makeEntry(file.path, file.statbuf, file.id);
+    e.mode = file.mode;
+    updated.emplace_hint(updated.end(), std::move(file.path), std::move(e));
+  }
+  objects = std::move(updated);
+  cacheTree = std::move(root);
+  // Every file was written or checked, and its stat data taken, before now. File times come from the coarse
+  // clock, so ones written within its current tick stay racily clean, as they would against the index file.
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  indexMtimeSec = now.tv_sec;
+  indexMtimeNs = now.tv_nsec;
+  changed = true;
 }
 
 void Index::load() {
   if (not std::filesystem::is_regular_file(".git/index")) 
     return;
 
-  size_t indexsize = std::filesystem::file_size(".git/index");
+  struct stat statbuf;
+  if (stat(".git/index", &statbuf) == -1) {
+    throw std::runtime_error("error " + std::to_string(errno));
+  }
+  indexMtimeSec = statbuf.st_mtim.tv_sec;
+  indexMtimeNs = statbuf.st_mtim.tv_nsec;
+  size_t indexsize = statbuf.st_size;
   std::vector<uint8_t> file;
   file.resize(indexsize);
   std::ifstream(".git/index").read((char*)file.data(), file.size());
@@ -144,7 +923,7 @@ void Index::load() {
     e.mode = r.read32be();
     e.uid = r.read32be();
     e.gid = r.read32be();
-    e.filesize = r.read32le();
+    e.filesize = r.read32be();
     e.hash = r.getArray<20>();
     e.flags = r.read16be();
     e.fileName = r.getStringNT();
@@ -157,9 +936,31 @@ void Index::load() {
     std::string fileName = e.fileName;
     objects[fileName] = std::move(e);
   }
+
+  while (r.sizeleft() > 20) {
+    uint32_t signature = r.read32be();
+    uint32_t size = r.read32be();
+    Bini::reader extension(r.get(size));
+    if (r.fail()) {
+      throw std::runtime_error("Truncated index extension");
+    }
+    if (signature == CACHE_TREE_SIGNATURE) {
+      cacheTree = readCacheTree(extension);
+      if (extension.fail()) {
+        throw std::runtime_error("Invalid cache tree in index");
+      }
+    } else if ((signature >> 24) < 'A' || (signature >> 24) > 'Z') {
+      // Extensions that do not start with an uppercase letter cannot be ignored
+      throw std::runtime_error("Unsupported index extension");
+    }
+  }
 }
 
 void Index::save() {
+  if (not lock.locked()) return;
+  // before the index, whose commit gives up the lock that covers both
+  if (untrackedCacheChanged) saveUntrackedCache();
+  if (not changed) return;
   Bini::writer w;
   w.add32be(DIRCACHE_MAGIC_NUMBER);
   w.add32be(DIRCACHE_CURRENT_VERSION);
@@ -174,14 +975,76 @@ void Index::save() {
     w.add32be(e.mode);
     w.add32be(e.uid);
     w.add32be(e.gid);
-    w.add32be(e.filesize);
+    // Racily clean entries are smudged so that a later index with a newer mtime still rechecks them
+    w.add32be(indexMtimeSec && isRacy(e) ? 0 : e.filesize);
     w.add(e.hash);
     uint16_t length = (e.fileName.size() > 0xFFF ? 0xFFF : e.fileName.size());
     w.add16be((e.flags & 0xF000) | length);
     w.addNT(e.fileName);
     w.addpadding(7 - ((e.fileName.size() + 6) % 8), '\0');
   }
+  if (cacheTree.entryCount >= 0 || not cacheTree.children.empty()) {
+    Bini::writer tree;
+    writeCacheTree(tree, cacheTree);
+    w.add32be(CACHE_TREE_SIGNATURE);
+    w.add32be(tree.size());
+    w.add(tree);
+  }
   w.add(Caligo::SHA1(w).data());
+  lock.write(w);
+  lock.commit();
+  changed = false;
 }
 
+// Only a cache: a file that does not read back is dropped, and status lists every directory again
+void Index::loadUntrackedCache() {
+  std::ifstream in(UNTRACKED_CACHE_FILE, std::ios::binary);
+  if (not in) return;
+  std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  if (file.size() < 28) return;
+  std::array<uint8_t, 20> calculatedHash = Caligo::SHA1(std::span<const uint8_t>(file.data(), file.size() - 20));
+  if (memcmp(calculatedHash.data(), file.data() + file.size() - 20, 20) != 0) return;
+  Bini::reader r(std::span<const uint8_t>(file.data(), file.size() - 20));
+  if (r.read32be() != UNTRACKED_CACHE_SIGNATURE || r.read32be() != UNTRACKED_CACHE_VERSION) return;
+  while (r.sizeleft() && not r.fail()) {
+    std::string path(r.getStringNT());
+    CachedDirectory dir;
+    dir.mtime_sec = r.read32be();
+    dir.mtime_ns = r.read32be();
+    size_t files = r.read32be(), subdirectories = r.read32be();
+    for (size_t n = 0; n < files && not r.fail(); n++) {
+      dir.files.emplace_back(r.getStringNT());
+    }
+    for (size_t n = 0; n < subdirectories && not r.fail(); n++) {
+      dir.subdirectories.emplace_back(r.getStringNT());
+    }
+    untrackedCache.emplace(std::move(path), std::move(dir));
+  }
+  if (r.fail()) untrackedCache.clear();
+}
 
+// Written under the index lock; a lock left behind by a crash only means the cache is not updated
+void Index::saveUntrackedCache() {
+  LockFile cacheLock;
+  if (not cacheLock.tryLock(UNTRACKED_CACHE_FILE)) return;
+  Bini::writer w;
+  w.add32be(UNTRACKED_CACHE_SIGNATURE);
+  w.add32be(UNTRACKED_CACHE_VERSION);
+  for (auto& [path, dir] : untrackedCache) {
+    w.addNT(path);
+    w.add32be(dir.mtime_sec);
+    w.add32be(dir.mtime_ns);
+    w.add32be(dir.files.size());
+    w.add32be(dir.subdirectories.size());
+    for (auto& name : dir.files) {
+      w.addNT(name);
+    }
+    for (auto& name : dir.subdirectories) {
+      w.addNT(name);
+    }
+  }
+  w.add(Caligo::SHA1(w).data());
+  cacheLock.write(w);
+  cacheLock.commit();
+  untrackedCacheChanged = false;
+}
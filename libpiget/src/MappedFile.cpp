@@ -0,0 +1,49 @@
+#include "piget/MappedFile.hpp"
+#include <stdexcept>
+#include <utility>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(std::filesystem::path path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error("Cannot open " + path.string());
+  }
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) == -1) {
+    close(fd);
+    throw std::runtime_error("Cannot stat " + path.string());
+  }
+  length = statbuf.st_size;
+  if (length) {
+    void* p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Cannot map " + path.string());
+    }
+    ptr = static_cast<const uint8_t*>(p);
+  }
+  // the mapping stays valid after the descriptor is closed
+  close(fd);
+}
+
+MappedFile::MappedFile(MappedFile&& rhs)
+: ptr(std::exchange(rhs.ptr, nullptr))
+, length(std::exchange(rhs.length, 0))
+{
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& rhs) {
+  std::swap(ptr, rhs.ptr);
+  std::swap(length, rhs.length);
+  return *this;
+}
+
+MappedFile::~MappedFile() {
+  if (ptr) {
+    munmap(const_cast<uint8_t*>(ptr), length);
+  }
+}
+
@@ -0,0 +1,215 @@
+#include "piget/MultiPackIndex.hpp"
+#include "piget/FileIO.hpp"
+#include "piget/Pack.hpp"
+#include "bini/writer.h"
+#include <caligo/sha1.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+static constexpr uint32_t MIDX_SIGNATURE = 0x4D494458;
+static constexpr uint32_t MIDX_CHUNK_PACKNAMES = 0x504E414D;
+static constexpr uint32_t MIDX_CHUNK_OIDFANOUT = 0x4F494446;
+static constexpr uint32_t MIDX_CHUNK_OIDLOOKUP = 0x4F49444C;
+static constexpr uint32_t MIDX_CHUNK_OBJECTOFFSETS = 0x4F4F4646;
+static constexpr uint32_t MIDX_CHUNK_LARGEOFFSETS = 0x4C4F4646;
+
+MultiPackIndex::MultiPackIndex(std::filesystem::path file)
+: mapping(file)
+{
+  static constexpr size_t headerSize = 12, chunkEntrySize = 12;
+  std::span<const uint8_t> in = mapping.data();
+  if (in.size() < headerSize + 20 ||
+      ReadBE32(in.data()) != MIDX_SIGNATURE ||
+      in[4] != 1 || in[5] != 1) {
+    throw std::runtime_error("Invalid multi-pack-index");
+  }
+  size_t chunkCount = in[6];
+  size_t packCount = ReadBE32(in.data() + 8);
+  if (headerSize + (chunkCount + 1) * chunkEntrySize > in.size() - 20) {
+    throw std::runtime_error("Invalid multi-pack-index");
+  }
+
+  std::span<const uint8_t> packNames, oidFanout, oidLookup, offsetTable, largeOffsetTable;
+  for (size_t n = 0; n < chunkCount; n++) {
+    const uint8_t* entry = in.data() + headerSize + n * chunkEntrySize;
+    uint64_t start = ReadBE64(entry + 4), end = ReadBE64(entry + chunkEntrySize + 4);
+    if (start > end || end > in.size() - 20) {
+      throw std::runtime_error("Invalid multi-pack-index");
+    }
+    std::span<const uint8_t> chunk = in.subspan(start, end - start);
+    switch (ReadBE32(entry)) {
+    case MIDX_CHUNK_PACKNAMES: packNames = chunk; break;
+    case MIDX_CHUNK_OIDFANOUT: oidFanout = chunk; break;
+    case MIDX_CHUNK_OIDLOOKUP: oidLookup = chunk; break;
+    case MIDX_CHUNK_OBJECTOFFSETS: offsetTable = chunk; break;
+    case MIDX_CHUNK_LARGEOFFSETS: largeOffsetTable = chunk; break;
+    default: break;
+    }
+  }
+  if (oidFanout.size() != 256 * 4) {
+    throw std::runtime_error("Invalid multi-pack-index");
+  }
+  objectCount = ReadBE32(oidFanout.data() + 255 * 4);
+  if (oidLookup.size() != objectCount * 20 || offsetTable.size() != objectCount * 8) {
+    throw std::runtime_error("Invalid multi-pack-index");
+  }
+  fanout = oidFanout.data();
+  ids = oidLookup.data();
+  objectOffsets = offsetTable.data();
+  largeOffsets = largeOffsetTable.data();
+  largeOffsetCount = largeOffsetTable.size() / 8;
+
+  // Names are NUL-terminated, with padding to a multiple of four at the end of the chunk
+  const char* name = (const char*)packNames.data();
+  const char* namesEnd = name + packNames.size();
+  while (names.size() < packCount) {
+    const char* nul = std::find(name, namesEnd, '\0');
+    if (nul == namesEnd || nul == name) {
+      throw std::runtime_error("Invalid multi-pack-index");
+    }
+    names.emplace_back(name, nul);
+    name = nul + 1;
+  }
+}
+
+std::optional<MultiPackIndex::Location> MultiPackIndex::find(const ObjectId& id) const {
+  if (objectCount == 0) return std::nullopt;
+  size_t low = id[0] ? ReadBE32(fanout + (id[0] - 1) * 4) : 0;
+  size_t high = ReadBE32(fanout + id[0] * 4);
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    auto cmp = ObjectId::compare(ids + mid * 20, id.data());
+    if (cmp == 0) {
+      uint32_t pack = ReadBE32(objectOffsets + mid * 8);
+      uint32_t offset = ReadBE32(objectOffsets + mid * 8 + 4);
+      if (pack >= names.size()) {
+        throw std::runtime_error("multi-pack-index corrupted");
+      }
+      if ((offset & 0x8000'0000) == 0) return Location{pack, offset};
+      size_t large = offset & 0x7FFF'FFFF;
+      if (large >= largeOffsetCount) {
+        throw std::runtime_error("multi-pack-index corrupted");
+      }
+      return Location{pack, ReadBE64(largeOffsets + large * 8)};
+    }
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return std::nullopt;
+}
+
+void MultiPackIndex::findPrefix(const IdPrefix& prefix, std::vector<ObjectId>& out, size_t limit) const {
+  if (objectCount == 0) return;
+  FindIdsWithPrefix(fanout, ids, prefix, out, limit);
+}
+
+ObjectId MultiPackIndex::idAt(size_t n) const {
+  ObjectId id;
+  memcpy(id.data(), ids + n * 20, 20);
+  return id;
+}
+
+void WriteMultiPackIndex(std::filesystem::path packDirectory) {
+  struct PackFile {
+    std::string indexName;
+    std::filesystem::path packFile;
+    std::filesystem::file_time_type mtime;
+  };
+  std::vector<PackFile> packFiles;
+  for (auto& entry : std::filesystem::directory_iterator(packDirectory)) {
+    std::filesystem::path packFile = entry.path();
+    if (packFile.extension() != ".idx") continue;
+    packFile.replace_extension(".pack");
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(packFile, ec);
+    if (ec) continue;
+    packFiles.push_back({entry.path().filename().string(), packFile, mtime});
+  }
+  std::sort(packFiles.begin(), packFiles.end(), [](const PackFile& lhs, const PackFile& rhs) {
+    return lhs.indexName < rhs.indexName;
+  });
+
+  struct Entry {
+    ObjectId id;
+    uint32_t pack;
+    size_t offset;
+  };
+  std::vector<Entry> entries;
+  for (uint32_t n = 0; n < packFiles.size(); n++) {
+    Pack pack(packFiles[n].packFile);
+    entries.reserve(entries.size() + pack.size());
+    for (size_t i = 0; i < pack.size(); i++) {
+      entries.push_back({pack.idAt(i), n, pack.offsetAt(i)});
+    }
+  }
+  // Of the copies of an object, the one in the most recently written pack sorts first and is kept
+  std::sort(entries.begin(), entries.end(), [&](const Entry& lhs, const Entry& rhs) {
+    if (lhs.id != rhs.id) return lhs.id < rhs.id;
+    if (packFiles[lhs.pack].mtime != packFiles[rhs.pack].mtime) return packFiles[lhs.pack].mtime > packFiles[rhs.pack].mtime;
+    return lhs.pack < rhs.pack;
+  });
+  entries.erase(std::unique(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+    return lhs.id == rhs.id;
+  }), entries.end());
+
+  Bini::writer packNames, oidFanout, oidLookup, objectOffsets, largeOffsets;
+  for (auto& packFile : packFiles) {
+    packNames.addNT(packFile.indexName);
+  }
+  while (packNames.size() % 4) packNames.add8(0);
+  size_t next = 0;
+  for (size_t byte = 0; byte < 256; byte++) {
+    while (next < entries.size() && entries[next].id[0] == byte) next++;
+    oidFanout.add32be(next);
+  }
+  for (auto& entry : entries) {
+    oidLookup.add(entry.id);
+    objectOffsets.add32be(entry.pack);
+    if (entry.offset < 0x8000'0000) {
+      objectOffsets.add32be(entry.offset);
+    } else {
+      objectOffsets.add32be(0x8000'0000 | (largeOffsets.size() / 8));
+      largeOffsets.add64be(entry.offset);
+    }
+  }
+
+  std::vector<std::pair<uint32_t, const Bini::writer*>> chunks = {
+    { MIDX_CHUNK_PACKNAMES, &packNames },
+    { MIDX_CHUNK_OIDFANOUT, &oidFanout },
+    { MIDX_CHUNK_OIDLOOKUP, &oidLookup },
+    { MIDX_CHUNK_OBJECTOFFSETS, &objectOffsets },
+  };
+  if (not largeOffsets.empty()) {
+    chunks.push_back({ MIDX_CHUNK_LARGEOFFSETS, &largeOffsets });
+  }
+
+  Bini::writer out;
+  out.add32be(MIDX_SIGNATURE);
+  out.add8(1);
+  out.add8(1);
+  out.add8(chunks.size());
+  out.add8(0);
+  out.add32be(packFiles.size());
+  uint64_t offset = 12 + (chunks.size() + 1) * 12;
+  for (auto& [id, chunk] : chunks) {
+    out.add32be(id);
+    out.add64be(offset);
+    offset += chunk->size();
+  }
+  out.add32be(0);
+  out.add64be(offset);
+  for (auto& [id, chunk] : chunks) {
+    out.add(*chunk);
+  }
+  std::array<uint8_t, 20> checksum = Caligo::SHA1(out).data();
+  out.add(checksum);
+
+  std::filesystem::path file = packDirectory / "multi-pack-index";
+  LockFile lock(file);
+  lock.write(out);
+  lock.commit();
+}
@@ -1,11 +1,15 @@
 #include "piget/Object.hpp"
+#include "piget/Hash.hpp"
 #include "tl/expected.hpp"
-#include "caligo/sha1.h"
 #include "decoco/decoco.hpp"
 #include "bini/reader.h"
+#include <algorithm>
 #include <optional>
 #include <filesystem>
 #include <fstream>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
 
 std::vector<std::string_view> split(std::string_view sv, char split = ' ') {
   std::vector<std::string_view> rv;
@@ -21,107 +25,213 @@ std::vector<std::string_view> split(std::string_view sv, char split = ' ') {
   return rv;
 }
 
-std::array<uint8_t, 20> fromId(std::string_view sv) {
-  static std::array<int, 256> lookup = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0, 0, 0, 0, 0, 0, 
-    0,10,11,12,13,14,15, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0,10,11,12,13,14,15, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
-  };
-  if (sv.size() != 40) throw std::runtime_error("invalid id");
-  std::array<uint8_t, 20> rv;
-  for (size_t n = 0; n < 40; n+=2) {
-    rv[n/2] = (lookup[sv[n]] << 4) | (lookup[sv[n+1]]);
+static ObjectId fromId(std::string_view sv) {
+  auto id = ObjectId::fromHex(sv);
+  if (not id) throw std::runtime_error("invalid id");
+  return *id;
+}
+
+std::optional<IdPrefix> IdPrefix::parse(std::string_view hex) {
+  if (hex.size() < 4 || hex.size() > 40) return std::nullopt;
+  IdPrefix prefix;
+  for (size_t n = 0; n < hex.size(); n++) {
+    uint8_t nibble;
+    if (hex[n] >= '0' && hex[n] <= '9') nibble = hex[n] - '0';
+    else if (hex[n] >= 'a' && hex[n] <= 'f') nibble = hex[n] - 'a' + 10;
+    else if (hex[n] >= 'A' && hex[n] <= 'F') nibble = hex[n] - 'A' + 10;
+    else return std::nullopt;
+    prefix.bytes[n / 2] |= (n % 2) ? nibble : nibble << 4;
   }
-  return rv;
+  prefix.nibbles = hex.size();
+  return prefix;
 }
 
-std::string asId(std::span<const uint8_t> input) {
-  char hextab[17] = "0123456789abcdef";
-  std::string rv;
-  for (auto& c : input) {
-    rv.push_back(hextab[c >> 4]);
-    rv.push_back(hextab[c & 0xF]);
+bool IdPrefix::matches(const uint8_t* id) const {
+  size_t fullBytes = nibbles / 2;
+  if (memcmp(id, bytes.data(), fullBytes) != 0) return false;
+  return nibbles % 2 == 0 || (id[fullBytes] & 0xF0) == bytes[fullBytes];
+}
+
+ObjectId Object::id() const {
+  return HashBuffer(buffer);
+}
+
+static std::string_view typeName(Object::Type type) {
+  switch(type) {
+    case Object::Type::Tree: return "tree";
+    case Object::Type::Commit: return "commit";
+    case Object::Type::Object: return "blob";
+    case Object::Type::Tag: return "tag";
+    case Object::Type::Invalid: break;
+  }
+  return "invalid";
+}
+
+static Object::Type typeFromName(std::string_view sv) {
+  if (sv == "tree") {
+    return Object::Type::Tree;
+  } else if (sv == "commit") {
+    return Object::Type::Commit;
+  } else if (sv == "blob") {
+    return Object::Type::Object;
+  } else if (sv == "tag") {
+    return Object::Type::Tag;
+  } else {
+    return Object::Type::Invalid;
   }
-  return rv;
 }
 
-std::array<uint8_t, 20> Object::id() const {
-  return Caligo::SHA1(buffer).data();
+std::optional<ObjectInfo> ParseObjectHeader(std::string_view header) {
+  size_t space = header.find(' ');
+  if (space == std::string_view::npos) return std::nullopt;
+  ObjectInfo info{typeFromName(header.substr(0, space)), 0};
+  const char* end = header.data() + header.size();
+  auto [last, ec] = std::from_chars(header.data() + space + 1, end, info.size);
+  if (ec != std::errc() || last != end) return std::nullopt;
+  return info;
+}
+
+uint8_t* Object::allocate(Object::Type type, size_t size) {
+  std::string prefix = std::string(typeName(type)) + " " + std::to_string(size);
+  buffer.resize(prefix.size() + 1 + size);
+  memcpy(buffer.data(), prefix.data(), prefix.size() + 1);
+  objectType = type;
+  payloadOffset = prefix.size() + 1;
+  return buffer.data() + payloadOffset;
 }
 
 Object::Object(std::filesystem::path path) {
   size_t length = std::filesystem::file_size(path);
-  std::string prefix = "blob " + std::to_string(length);
-  buffer.resize(prefix.size() + 1 + length);
-  memcpy(buffer.data(), prefix.data(), prefix.size() + 1);
-  std::ifstream(path).read((char*)buffer.data() + prefix.size() + 1, length);
+  uint8_t* p = allocate(Object::Type::Object, length);
+  std::ifstream(path).read((char*)p, length);
+}
+
+static size_t octalDigits(uint32_t mode) {
+  size_t digits = 1;
+  while (mode >>= 3) digits++;
+  return digits;
+}
+
+size_t TreeEntrySize(uint32_t mode, std::string_view name) {
+  return octalDigits(mode) + 1 + name.size() + 1 + 20;
+}
+
+uint8_t* WriteTreeEntry(uint8_t* p, uint32_t mode, std::string_view name, const ObjectId& hash) {
+  size_t digits = octalDigits(mode);
+  for (size_t n = digits; n > 0; n--) {
+    p[n - 1] = '0' + (mode & 7);
+    mode >>= 3;
+  }
+  p += digits;
+  *p++ = ' ';
+  memcpy(p, name.data(), name.size());
+  p += name.size();
+  *p++ = '\0';
+  memcpy(p, hash.data(), 20);
+  return p + 20;
 }
 
 Object::Object(Tree tree) {
-  std::string prefix = "tree ";
   size_t dataLength = 0;
   for (auto& entry : tree.entries) {
-    dataLength += 28 + entry.fileName.size();
+    dataLength += TreeEntrySize(entry.fileMode, entry.fileName);
   }
-  prefix += std::to_string(dataLength);
-  buffer.resize(dataLength + prefix.size() + 1);
-  memcpy(buffer.data(), prefix.data(), prefix.size() + 1);
-  uint8_t* p = buffer.data() + prefix.size() + 1;
+  uint8_t* p = allocate(Object::Type::Tree, dataLength);
   for (auto& entry : tree.entries) {
-    char modeBuffer[20];
-    sprintf(modeBuffer, "%06o ", entry.fileMode);
-    memcpy(p, modeBuffer, 7);
-    p += 7;
-    memcpy(p, entry.fileName.c_str(), entry.fileName.size() + 1);
-    p += entry.fileName.size() + 1;
-    memcpy(p, entry.hash.data(), 20);
-    p += 20;
+    p = WriteTreeEntry(p, entry.fileMode, entry.fileName, entry.hash);
+  }
+}
+
+bool TreeEntryLess(std::string_view lhsName, bool lhsDirectory, std::string_view rhsName, bool rhsDirectory) {
+  size_t common = std::min(lhsName.size(), rhsName.size());
+  int cmp = memcmp(lhsName.data(), rhsName.data(), common);
+  if (cmp != 0) return cmp < 0;
+  auto next = [common](std::string_view name, bool directory) -> uint8_t {
+    if (common < name.size()) return name[common];
+    return directory ? '/' : '\0';
+  };
+  return next(lhsName, lhsDirectory) < next(rhsName, rhsDirectory);
+}
+
+bool TreeEntryLess(const DirEntry& lhs, const DirEntry& rhs) {
+  return TreeEntryLess(lhs.fileName, lhs.fileMode == 040000, rhs.fileName, rhs.fileMode == 040000);
+}
+
+void Tree::set(std::string fileName, DirEntry entry) {
+  entry.fileName = std::move(fileName);
+  auto position = [this, &entry](bool directory) {
+    return std::lower_bound(entries.begin(), entries.end(), entry.fileName, [directory](const DirEntry& e, const std::string& name) {
+      return TreeEntryLess(e.fileName, e.fileMode == 040000, name, directory);
+    });
+  };
+  // a file and a directory of the same name sort apart, so either may be the one being replaced
+  for (bool directory : {false, true}) {
+    auto it = position(directory);
+    if (it != entries.end() && it->fileName == entry.fileName) entries.erase(it);
+  }
+  auto it = position(entry.fileMode == 040000);
+  entries.insert(it, std::move(entry));
+}
+
+std::optional<ObjectId> Tree::get(std::string_view fileName) const {
+  for (bool directory : {false, true}) {
+    auto it = std::lower_bound(entries.begin(), entries.end(), fileName, [directory](const DirEntry& e, std::string_view name) {
+      return TreeEntryLess(e.fileName, e.fileMode == 040000, name, directory);
+    });
+    if (it != entries.end() && it->fileName == fileName) return it->hash;
   }
+  return std::nullopt;
 }
 
-Tree Object::readAsTree() {
+void TreeView::iterator::parse() {
+  if (p == end) return;
+  const uint8_t* q = p;
+  uint32_t mode = 0;
+  while (q != end && *q >= '0' && *q <= '7') {
+    mode = (mode << 3) | (*q++ - '0');
+  }
+  if (q == p || q == end || *q != ' ' || mode > 0xFFFF) {
+    throw std::runtime_error("Invalid tree entry, repo corrupted");
+  }
+  const uint8_t* name = ++q;
+  q = (const uint8_t*)memchr(name, '\0', end - name);
+  if (not q || end - q < 21) {
+    throw std::runtime_error("Invalid tree entry, repo corrupted");
+  }
+  entry.fileMode = mode;
+  entry.fileName = std::string_view((const char*)name, q - name);
+  memcpy(entry.hash.data(), q + 1, 20);
+  next = q + 21;
+}
+
+TreeView Object::viewAsTree() const {
   if (type() != Type::Tree) {
     throw std::runtime_error("Non-tree object in tree position, repo corrupted");
   }
+  return TreeView(data());
+}
+
+Tree Object::readAsTree() const {
   Tree t;
-  Bini::reader r(data());
-  while (r.sizeleft()) {
-    std::string_view str(r.getStringNT());
-    size_t space = str.find(" ");
-    uint16_t mode = std::stol(std::string(str.substr(0, space)), nullptr, 8);
-    std::array<uint8_t, 20> hash(r.getArray<20>());
-    t.entries.push_back(DirEntry{mode, std::string(str.substr(space+1)), {}});
-    t.entries.back().hash = hash;
+  TreeView view = viewAsTree();
+  t.entries.reserve(std::distance(view.begin(), view.end()));
+  for (auto& entry : view) {
+    t.entries.push_back(DirEntry{entry.fileMode, std::string(entry.fileName), entry.hash});
   }
   return t;
 }
 
 Object::Object(Commit commit) {
-  std::string body = "tree " + asId(commit.root) + "\n";
-  if (commit.parent) body += "parent " + asId(commit.parent.value()) + "\n";
+  std::string body = "tree " + commit.root.hex() + "\n";
+  if (commit.parent) body += "parent " + commit.parent->hex() + "\n";
+  for (auto& parent : commit.mergeParents) body += "parent " + parent.hex() + "\n";
   body += "author " + to_string(commit.author) + "\n";
   body += "committer " + to_string(commit.committer) + "\n\n";
   body += commit.message;
-  std::string prefix = "commit " + std::to_string(body.size());
-  buffer.resize(prefix.size() + body.size() + 1);
-  memcpy(buffer.data(), prefix.data(), prefix.size() + 1);
-  memcpy(buffer.data() + prefix.size() + 1, body.data(), body.size());
+  memcpy(allocate(Object::Type::Commit, body.size()), body.data(), body.size());
 }
 
-Commit Object::readAsCommit() {
+Commit Object::readAsCommit() const {
   if (type() != Object::Type::Commit) {
     throw std::runtime_error("Non-commit object in commit position, repo corrupted");
   }
@@ -142,51 +252,43 @@ Commit Object::readAsCommit() {
     } else if (name == "tree") {
       commit.root = fromId(value);
     } else if (name == "parent") {
-      commit.parent = fromId(value);
+      if (commit.parent) {
+        commit.mergeParents.push_back(fromId(value));
+      } else {
+        commit.parent = fromId(value);
+      }
     }
   }
   return commit;
 }
 
-Object::Object(Object::Type type, std::vector<uint8_t> data) 
-: buffer(std::move(data))
+Object::Object(Object::Type type, std::span<const uint8_t> data) {
+  memcpy(allocate(type, data.size()), data.data(), data.size());
+}
+
+Object::Object(Object::Type type, std::vector<uint8_t>&& payload)
+: buffer(std::move(payload))
 {
-  std::string prefix;
-  switch(type) {
-    case Object::Type::Tree: prefix = "tree "; break;
-    case Object::Type::Commit: prefix = "commit "; break;
-    case Object::Type::Object: prefix = "blob "; break;
-    case Object::Type::Invalid: prefix = "invalid "; break;
-  }
-  prefix += std::to_string(data.size());
-  buffer.resize(prefix.size() + 1 + data.size());
-  memcpy(buffer.data(), prefix.data(), prefix.size() + 1);
-  memcpy(buffer.data() + prefix.size() + 1, data.data(), data.size());
+  std::string prefix = std::string(typeName(type)) + " " + std::to_string(buffer.size());
+  buffer.insert(buffer.begin(), prefix.data(), prefix.data() + prefix.size() + 1);
+  objectType = type;
+  payloadOffset = prefix.size() + 1;
 }
 
 Object::Object(std::vector<uint8_t> data) 
 : buffer(std::move(data))
 {
-}
-
-Object::Type Object::type() const {
   const char* start = (const char*)buffer.data();
-  const char* end = strchr(start, ' ');
-  std::string_view sv{start, end};
-  if (sv == "tree") {
-    return Object::Type::Tree;
-  } else if (sv == "commit") {
-    return Object::Type::Commit;
-  } else if (sv == "blob") {
-    return Object::Type::Object;
-  } else {
-    return Object::Type::Invalid;
+  const char* end = start + buffer.size();
+  const char* nul = std::find(start, end, '\0');
+  auto header = nul == end ? std::nullopt : ParseObjectHeader(std::string_view(start, nul));
+  if (not header) {
+    throw std::runtime_error("Invalid object header");
+  }
+  objectType = header->type;
+  payloadOffset = nul + 1 - start;
+  if (header->size != buffer.size() - payloadOffset) {
+    throw std::runtime_error("Object size does not match its header");
   }
-}
-
-std::span<const uint8_t> Object::data() const {
-  auto it = std::find(buffer.begin(), buffer.end(), '\0');
-  ++it;
-  return {it, buffer.end()};
 }
 
@@ -0,0 +1,45 @@
+#include "piget/ObjectId.hpp"
+
+namespace {
+
+// Both characters of every byte value, so encoding is one table load and one 2-byte store per byte
+struct HexTables {
+  std::array<char, 512> pairs;
+  std::array<int8_t, 256> nibbles;
+  constexpr HexTables() : pairs(), nibbles() {
+    constexpr char digits[] = "0123456789abcdef";
+    for (size_t n = 0; n < 256; n++) {
+      pairs[n * 2] = digits[n >> 4];
+      pairs[n * 2 + 1] = digits[n & 0xF];
+      nibbles[n] = -1;
+    }
+    for (size_t n = 0; n < 10; n++) nibbles['0' + n] = n;
+    for (size_t n = 0; n < 6; n++) {
+      nibbles['a' + n] = 10 + n;
+      nibbles['A' + n] = 10 + n;
+    }
+  }
+};
+
+constexpr HexTables tables;
+
+}
+
+void HexEncode(std::span<const uint8_t> in, char* out) {
+  for (uint8_t byte : in) {
+    memcpy(out, tables.pairs.data() + byte * 2, 2);
+    out += 2;
+  }
+}
+
+bool HexDecode(std::string_view in, uint8_t* out) {
+  if (in.size() % 2) return false;
+  // Invalid characters are collected with an OR so the loop has no early exit
+  int8_t invalid = 0;
+  for (size_t n = 0; n < in.size(); n += 2) {
+    int8_t high = tables.nibbles[(uint8_t)in[n]], low = tables.nibbles[(uint8_t)in[n + 1]];
+    invalid |= high | low;
+    out[n / 2] = (high << 4) | (low & 0xF);
+  }
+  return invalid >= 0;
+}
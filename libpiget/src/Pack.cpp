@@ -1,19 +1,30 @@
 #include "piget/Object.hpp"
 #include "piget/GitCAM.hpp"
+#include "piget/Pack.hpp"
+#include "piget/FileIO.hpp"
+#include "piget/Hash.hpp"
+#include "piget/Parallel.hpp"
 #include "bini/writer.h"
 #include "bini/reader.h"
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <caligo/sha1.h>
 #include <caligo/crc.h>
 #include <fstream>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
-std::vector<uint8_t> CreateIndexFile(std::vector<Pack::IndexEntry> index) {
+// Without a pack checksum the trailer is left off, for indices that only live in memory
+std::vector<uint8_t> CreateIndexFile(std::vector<Pack::IndexEntry> index, std::span<const uint8_t> packChecksum = {}) {
   std::sort(index.begin(), index.end(), [](const Pack::IndexEntry& lhs, const Pack::IndexEntry& rhs) {
-    for (size_t n = 0; n < 20; n++) {
-      if (lhs.id[n] < rhs.id[n]) return true;
-      if (lhs.id[n] > rhs.id[n]) return false;
-    } 
-    return false;
+    return lhs.id < rhs.id;
   });
   Bini::writer main, crcs, ids, offsets, largeoffsets, ii;
   uint16_t lastId = 0;
@@ -29,7 +40,7 @@ std::vector<uint8_t> CreateIndexFile(std::vector<Pack::IndexEntry> index) {
     if (index[n].offset < 0x8000'0000) {
       offsets.add32be(index[n].offset);
     } else {
-      offsets.add32be(largeoffsets.size() | 0x8000'0000);
+      offsets.add32be(largeoffsets.size() / 8 | 0x8000'0000);
       largeoffsets.add64be(index[n].offset);
     }
   }
@@ -44,77 +55,810 @@ std::vector<uint8_t> CreateIndexFile(std::vector<Pack::IndexEntry> index) {
   main.add(crcs);
   main.add(offsets);
   main.add(largeoffsets);
+  if (not packChecksum.empty()) {
+    main.add(packChecksum);
+    main.add(Caligo::SHA1{main}.data());
+  }
   return main;
 }
 
-std::pair<std::vector<uint8_t>, std::vector<uint8_t>> WritePack(const Database& db, std::vector<std::array<uint8_t, 20>> objectIds) {
+static constexpr uint8_t PACK_OFS_DELTA = 6;
+static constexpr uint8_t PACK_REF_DELTA = 7;
+// Anything smaller can't win against a plain entry; anything larger is left alone like core.bigFileThreshold does
+static constexpr size_t MIN_DELTA_SIZE = 64;
+static constexpr size_t MAX_DELTA_SIZE = 512 << 20;
+
+uint32_t PackNameHash(std::string_view path) {
+  uint32_t hash = 0;
+  for (char c : path) {
+    if (isspace((unsigned char)c)) continue;
+    hash = (hash >> 2) + (uint32_t(uint8_t(c)) << 24);
+  }
+  return hash;
+}
+
+static void addDeltaOffset(Bini::writer& w, size_t distance) {
+  uint8_t buffer[10];
+  size_t pos = sizeof(buffer) - 1;
+  buffer[pos] = distance & 0x7F;
+  while (distance >>= 7) {
+    buffer[--pos] = 0x80 | (--distance & 0x7F);
+  }
+  w.add(std::span<const uint8_t>(buffer + pos, sizeof(buffer) - pos));
+}
+
+struct PlannedDelta {
+  size_t base = SIZE_MAX;
+  size_t depth = 0;
+  Object::Type type = Object::Type::Invalid;
+  // Deltas are kept deflated, as they will be written, from the moment they are chosen
+  size_t size = 0;
+  std::vector<uint8_t> compressed;
+};
+
+static std::vector<PlannedDelta> FindDeltas(const Database& db, const std::vector<PackObject>& objects, const PackWriteOptions& options) {
+  std::vector<PlannedDelta> plan(objects.size());
+  if (options.window == 0 || options.depth == 0) return plan;
+
+  struct Candidate {
+    size_t position;
+    Object::Type type;
+    uint32_t nameHash;
+    size_t size;
+  };
+  std::vector<Candidate> candidates;
+  for (size_t n = 0; n < objects.size(); n++) {
+    auto info = db.info(objects[n].id);
+    if (not info) {
+      throw std::runtime_error("Invalid object id");
+    }
+    if (info->size >= MIN_DELTA_SIZE && info->size <= MAX_DELTA_SIZE) {
+      candidates.push_back({n, info->type, objects[n].nameHash, info->size});
+    }
+  }
+  // Same type and path next to each other, largest first so deltas mostly remove data
+  std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& lhs, const Candidate& rhs) {
+    return std::tie(lhs.type, lhs.nameHash, rhs.size) < std::tie(rhs.type, rhs.nameHash, lhs.size);
+  });
+
+  struct WindowEntry {
+    size_t position;
+    size_t size;
+    Object object;
+    std::optional<DeltaIndex> index;
+  };
+  std::deque<std::unique_ptr<WindowEntry>> window;
+  for (auto& c : candidates) {
+    if (not window.empty() && plan[window.front()->position].type != c.type) {
+      window.clear();
+    }
+    auto obj = db.get(objects[c.position].id);
+    if (not obj) {
+      throw std::runtime_error("Invalid object id");
+    }
+    PlannedDelta& best = plan[c.position];
+    best.type = c.type;
+    std::vector<uint8_t> bestDelta;
+    for (auto& entry : window) {
+      if (plan[entry->position].depth >= options.depth) continue;
+      // A delta has to be at most half the size of the object it replaces
+      size_t maxSize = bestDelta.empty() ? c.size / 2 - 20 : bestDelta.size() - 1;
+      if (entry->size < c.size / 32) continue;
+      if (c.size > entry->size && c.size - entry->size >= maxSize) continue;
+      if (not entry->index) {
+        entry->index.emplace(entry->object.data());
+      }
+      auto delta = entry->index->createDelta(obj->data(), maxSize);
+      if (delta) {
+        best.base = entry->position;
+        best.depth = plan[entry->position].depth + 1;
+        bestDelta = std::move(*delta);
+      }
+    }
+    if (not bestDelta.empty()) {
+      best.size = bestDelta.size();
+      best.compressed = Decoco::compress(Decoco::ZlibCompressor(), bestDelta);
+    }
+    window.push_front(std::make_unique<WindowEntry>(c.position, c.size, std::move(*obj), std::nullopt));
+    if (window.size() > options.window) {
+      window.pop_back();
+    }
+  }
+  return plan;
+}
+
+struct CompressedEntry {
+  uint8_t type;
+  size_t size;
+  std::vector<uint8_t> data;
+};
+
+// Deltas were compressed when they were chosen, so only whole objects are read again here
+static CompressedEntry CompressEntry(const Database& db, const PackObject& object, PlannedDelta& delta) {
+  if (delta.base != SIZE_MAX) {
+    return { PACK_OFS_DELTA, delta.size, std::move(delta.compressed) };
+  }
+  auto objR = db.get(object.id);
+  if (not objR) {
+    throw std::runtime_error("Invalid object id");
+  }
+  Object& obj = *objR;
+  return { (uint8_t)obj.type(), obj.data().size(), Decoco::compress(Decoco::ZlibCompressor(), obj.data()) };
+}
+
+std::pair<std::vector<uint8_t>, std::vector<uint8_t>> WritePack(const Database& db, std::vector<PackObject> objects, const PackWriteOptions& options) {
+  std::vector<PlannedDelta> plan = FindDeltas(db, objects, options);
+
+  // OFS_DELTA can only point backwards, so a base is written just before its first delta
+  std::vector<size_t> order;
+  std::vector<bool> placed(objects.size());
+  order.reserve(objects.size());
+  std::function<void(size_t)> place = [&](size_t n) {
+    if (placed[n]) return;
+    placed[n] = true;
+    if (plan[n].base != SIZE_MAX) {
+      place(plan[n].base);
+    }
+    order.push_back(n);
+  };
+  for (size_t n = 0; n < objects.size(); n++) {
+    place(n);
+  }
+
   Bini::writer w;
-  w.add32be(0x4F41434B);
+  w.add32be(0x5041434B);
   w.add32be(2);
-  w.add32be(objectIds.size());
+  w.add32be(objects.size());
   std::vector<Pack::IndexEntry> index;
+  std::vector<size_t> offsets(objects.size());
+
+  // Workers compress in any order; whoever completes the next entry in line appends it
+  std::vector<std::optional<CompressedEntry>> pending(order.size());
+  size_t written = 0;
+  std::mutex writerMutex;
+  ParallelFor(order.size(), options.threads, [&](size_t i) {
+    size_t n = order[i];
+    CompressedEntry entry = CompressEntry(db, objects[n], plan[n]);
+    std::lock_guard<std::mutex> l(writerMutex);
+    pending[i] = std::move(entry);
+    while (written < order.size() && pending[written]) {
+      size_t pos = order[written];
+      CompressedEntry& e = *pending[written];
+      offsets[pos] = w.size();
+      size_t s = e.size;
+      s = ((s & 0xFFFFFFFFFFFFF0) << 3) | (s & 0xF) | (e.type << 4);
+      w.addPB(s);
+      if (e.type == PACK_OFS_DELTA) {
+        addDeltaOffset(w, offsets[pos] - offsets[plan[pos].base]);
+      }
+      w.add(e.data);
+      // the idx CRC covers the entry exactly as stored, header included
+      Caligo::CRC32 crc(std::span<const uint8_t>(w).subspan(offsets[pos]));
+      index.push_back({objects[pos].id, crc.data(), offsets[pos], e.type == PACK_OFS_DELTA ? plan[pos].type : (Object::Type)e.type});
+      pending[written].reset();
+      written++;
+    }
+  });
+  std::array<uint8_t, 20> checksum = Caligo::SHA1{w}.data();
+  w.add(checksum);
+  return { std::move(w), CreateIndexFile(std::move(index), checksum) };
+}
+
+std::pair<std::vector<uint8_t>, std::vector<uint8_t>> WritePack(const Database& db, std::vector<ObjectId> objectIds, const PackWriteOptions& options) {
+  std::vector<PackObject> objects;
+  objects.reserve(objectIds.size());
   for (auto& id : objectIds) {
-    auto objR = db.get(id);
-    if (not objR) {
-      throw std::runtime_error("Invalid object id");
+    objects.push_back({id});
+  }
+  return WritePack(db, std::move(objects), options);
+}
+
+struct EntryHeader {
+  uint8_t type;
+  size_t size;
+};
+
+static EntryHeader readEntryHeader(Bini::reader& r) {
+  uint64_t header = r.getPB();
+  return { uint8_t((header >> 4) & 0x7), ((header & 0xFFFF'FFFF'FFFF'FF80) >> 3) | (header & 0xF) };
+}
+
+// OFS_DELTA base distances use their own encoding, where every continuation adds one
+static size_t readDeltaOffset(Bini::reader& r) {
+  uint8_t c = r.read8();
+  size_t offset = c & 0x7F;
+  while (c & 0x80) {
+    c = r.read8();
+    offset = ((offset + 1) << 7) | (c & 0x7F);
+  }
+  return offset;
+}
+
+struct Pack::DeltaBaseCache {
+  struct Entry {
+    size_t offset;
+    Unpacked object;
+  };
+  std::optional<Unpacked> get(size_t offset) {
+    std::lock_guard<std::mutex> l(m);
+    auto it = entries.find(offset);
+    if (it == entries.end()) return std::nullopt;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->object;
+  }
+  void put(size_t offset, const Unpacked& object) {
+    size_t size = object.data->size();
+    std::lock_guard<std::mutex> l(m);
+    if (size > limit || entries.contains(offset)) return;
+    lru.push_front({offset, object});
+    entries[offset] = lru.begin();
+    bytes += size;
+    shrink();
+  }
+  void setLimit(size_t newLimit) {
+    std::lock_guard<std::mutex> l(m);
+    limit = newLimit;
+    shrink();
+  }
+private:
+  void shrink() {
+    while (bytes > limit) {
+      bytes -= lru.back().object.data->size();
+      entries.erase(lru.back().offset);
+      lru.pop_back();
     }
-    Object& obj = *objR;
-    index.push_back({id, Caligo::CRC32(obj.data()), w.size(), obj.type()});
-    size_t s = obj.data().size();
-    s = ((s & 0xFFFFFFFFFFFFF0) << 3) | (s & 0xF) | ((int)obj.type() << 4);
-    w.addPB(s);
-    w.add(Decoco::compress(Decoco::ZlibCompressor(), obj.data()));
   }
-  w.add(Caligo::SHA1{w}.data());
-  return { std::move(w), CreateIndexFile(std::move(index)) };
+  std::mutex m;
+  std::list<Entry> lru;
+  std::unordered_map<size_t, std::list<Entry>::iterator> entries;
+  size_t bytes = 0;
+  // Same default as git's core.deltaBaseCacheLimit
+  size_t limit = 96 << 20;
+};
+
+Pack::Pack(std::filesystem::path packFile)
+: baseCache(std::make_unique<DeltaBaseCache>())
+, packMapping(packFile)
+{
+  data = packMapping.data();
+  std::filesystem::path indexFile = packFile.replace_extension(".idx");
+  if (std::filesystem::is_regular_file(indexFile)) {
+    indexMapping = MappedFile(indexFile);
+  }
+  if (not LoadIndex(indexMapping.data())) {
+    RegenerateIndex();
+  }
 }
 
 Pack::Pack(std::span<const uint8_t> data, std::span<const uint8_t> in_index)
-: data(data)
+: baseCache(std::make_unique<DeltaBaseCache>())
+, data(data)
 {
-  LoadIndex(in_index);
-
-  if (index.empty()) {
+  if (not LoadIndex(in_index)) {
     RegenerateIndex();
   }
 };
 
-void Pack::LoadIndex(std::span<const uint8_t> in) {
-  (void)in;
-  // TODO: load index
+Pack::Pack(Pack&&) = default;
+
+Pack::~Pack() = default;
+
+void Pack::setDeltaBaseCacheLimit(size_t bytes) {
+  baseCache->setLimit(bytes);
+}
+
+bool Pack::LoadIndex(std::span<const uint8_t> in) {
+  static constexpr size_t headerSize = 8, fanoutSize = 256 * 4;
+  if (in.size() < headerSize + fanoutSize ||
+      ReadBE32(in.data()) != 0xFF744F63 ||
+      ReadBE32(in.data() + 4) != 2) {
+    return false;
+  }
+  const uint8_t* table = in.data() + headerSize;
+  size_t count = ReadBE32(table + 255 * 4);
+  size_t tablesEnd = headerSize + fanoutSize + count * (20 + 4 + 4);
+  if (tablesEnd > in.size()) {
+    return false;
+  }
+  fanout = table;
+  ids = fanout + fanoutSize;
+  crcs = ids + count * 20;
+  offsets = crcs + count * 4;
+  largeOffsets = offsets + count * 4;
+  // git ends the file with the pack checksum and its own; indices without them are still read
+  size_t tail = in.size() - tablesEnd;
+  largeOffsetCount = (tail >= 40 ? tail - 40 : tail) / 8;
+  objectCount = count;
+  return true;
 }
 
 void Pack::RegenerateIndex() {
-  Bini::reader r(data);
-  uint32_t magic = r.read32be();
-  uint32_t version = r.read32be();
-  (void)magic;
-  (void)version;
-  uint32_t objcount = r.read32be();
-  for (size_t n = 0; n < objcount; n++) {
-    uint64_t size = r.getPB();
-    Object::Type type = (Object::Type)((size >> 4) & 0x7);
-    size = ((size & 0xFFFF'FFFF'FFFF'FF80) >> 3) | (size & 0xF);
-    std::vector<uint8_t> data;
-    auto decomp = Decoco::ZlibDecompressor();
-    Bini::reader r2 = r;
-    data = Decoco::decompress(decomp, r2.get(r2.sizeleft()));
-    index.push_back({Caligo::SHA1(data).data(), Caligo::CRC32(data).data(), data.size() - r.sizeleft(), type});
-    r.skip(decomp->bytesUsed());
-  }
-}
-
-std::optional<Object> Pack::get(std::array<uint8_t, 20> id) {
-  auto it = std::lower_bound(index.begin(), index.end(), id, [](const IndexEntry& e, const std::array<uint8_t, 20>& id) {
-    for (size_t n = 0; n < 20; n++) {
-      if (e.id[n] < id[n]) return true;
-      if (e.id[n] > id[n]) return false;
+  regeneratedIndex = IndexPack(data);
+  LoadIndex(regeneratedIndex);
+}
+
+std::vector<uint8_t> IndexPack(std::span<const uint8_t> pack, size_t threads) {
+  if (pack.size() < 32 || ReadBE32(pack.data()) != 0x5041434B || ReadBE32(pack.data() + 4) != 2) {
+    throw std::runtime_error("Invalid pack");
+  }
+  std::span<const uint8_t> body = pack.first(pack.size() - 20);
+  std::span<const uint8_t> trailer = pack.last(20);
+  size_t count = ReadBE32(pack.data() + 8);
+
+  struct Entry {
+    size_t offset = 0, dataStart = 0, end = 0;
+    uint8_t type = 0;
+    // Entry index of an OFS_DELTA base, or the id a REF_DELTA names
+    size_t base = 0;
+    ObjectId baseId;
+    ObjectId id;
+    Object::Type resolvedType = Object::Type::Invalid;
+    std::array<uint8_t, 4> crc = {};
+    // Whether an OFS_DELTA seen so far is based on this entry
+    bool isBase = false;
+    // A whole object kept from the walk for resolving its deltas; empty when it was dropped over the budget
+    std::shared_ptr<const Object> object;
+    // Inflated delta instructions kept from the walk; empty when they were over the budget
+    std::vector<uint8_t> delta;
+  };
+  std::vector<Entry> entries;
+  entries.reserve(count);
+
+  // What the walk keeps inflated for the resolve pass; anything beyond is inflated again from the pack there
+  static constexpr size_t keptObjectBytes = 64 << 20, keptDeltaBytes = 64 << 20;
+  // Whole objects are hashed in batches, bounded so a large pack is never held decompressed at once
+  static constexpr size_t batchBytes = 16 << 20;
+  std::vector<std::shared_ptr<const Object>> batch;
+  std::vector<size_t> batchEntries;
+  size_t batchSize = 0;
+  auto flush = [&]() {
+    std::vector<std::span<const uint8_t>> buffers(batch.size());
+    for (size_t n = 0; n < batch.size(); n++) {
+      buffers[n] = batch[n]->buffer;
+    }
+    auto batchIds = HashBuffers(buffers, threads);
+    for (size_t n = 0; n < batch.size(); n++) {
+      entries[batchEntries[n]].id = batchIds[n];
+    }
+    batch.clear();
+    batchEntries.clear();
+    batchSize = 0;
+  };
+
+  // The trailer is checked on one thread while the entries are walked on the other
+  bool checksumMatches = false;
+  ParallelFor(2, threads, [&](size_t task) {
+    if (task == 1) {
+      checksumMatches = HashBuffer(body) == ObjectId(Bini::reader(trailer).getArray<20>());
+      return;
+    }
+    // Kept objects, oldest first. Known bases move to the second queue and are only dropped once the
+    // others are gone, since a REF_DELTA base is only known after the walk.
+    std::deque<size_t> kept, keptBases;
+    size_t objectBytes = 0, deltaBytes = 0;
+    auto keep = [&](size_t n) {
+      kept.push_back(n);
+      objectBytes += entries[n].object->buffer.size();
+      while (objectBytes > keptObjectBytes) {
+        std::deque<size_t>& from = kept.empty() ? keptBases : kept;
+        Entry& oldest = entries[from.front()];
+        from.pop_front();
+        if (&from == &kept && oldest.isBase) {
+          keptBases.push_back(&oldest - entries.data());
+          continue;
+        }
+        objectBytes -= oldest.object->buffer.size();
+        oldest.object.reset();
+      }
+    };
+    // Every entry is inflated once here, which is also the only way to find where it ends
+    size_t position = 12;
+    for (size_t n = 0; n < count; n++) {
+      if (position >= body.size()) {
+        throw std::runtime_error("Truncated pack");
+      }
+      Bini::reader r(body.subspan(position));
+      EntryHeader header = readEntryHeader(r);
+      Entry e;
+      e.offset = position;
+      e.type = header.type;
+      if (header.type == PACK_OFS_DELTA) {
+        size_t distance = readDeltaOffset(r);
+        if (distance == 0 || distance > position) {
+          throw std::runtime_error("Invalid delta base offset");
+        }
+        auto base = std::lower_bound(entries.begin(), entries.end(), position - distance, [](const Entry& entry, size_t offset) {
+          return entry.offset < offset;
+        });
+        if (base == entries.end() || base->offset != position - distance) {
+          throw std::runtime_error("Invalid delta base offset");
+        }
+        e.base = base - entries.begin();
+        base->isBase = true;
+      } else if (header.type == PACK_REF_DELTA) {
+        e.baseId = r.getArray<20>();
+      } else if (header.type < (uint8_t)Object::Type::Commit || header.type > (uint8_t)Object::Type::Tag) {
+        throw std::runtime_error("Invalid pack entry type " + std::to_string(header.type));
+      } else {
+        e.resolvedType = (Object::Type)header.type;
+      }
+      if (r.fail()) {
+        throw std::runtime_error("Truncated pack");
+      }
+      e.dataStart = body.size() - r.sizeleft();
+      auto decompressor = Decoco::ZlibDecompressor();
+      std::vector<uint8_t> inflated = Decoco::decompress(decompressor, body.subspan(e.dataStart));
+      if (inflated.size() != header.size) {
+        throw std::runtime_error("Pack entry has the wrong size");
+      }
+      e.end = e.dataStart + decompressor->bytesUsed();
+      // git's CRC covers the entry exactly as stored, header included
+      e.crc = Caligo::CRC32(body.subspan(position, e.end - position)).data();
+      position = e.end;
+      if (e.resolvedType == Object::Type::Invalid) {
+        if (deltaBytes + inflated.size() <= keptDeltaBytes) {
+          deltaBytes += inflated.size();
+          e.delta = std::move(inflated);
+        }
+        entries.push_back(std::move(e));
+      } else {
+        e.object = std::make_shared<const Object>(e.resolvedType, std::move(inflated));
+        batchSize += e.object->buffer.size();
+        batch.push_back(e.object);
+        entries.push_back(std::move(e));
+        batchEntries.push_back(entries.size() - 1);
+        keep(entries.size() - 1);
+        if (batchSize >= batchBytes) flush();
+      }
+    }
+    flush();
+    if (position != body.size()) {
+      throw std::runtime_error("Pack has data after its last entry");
+    }
+  });
+  if (not checksumMatches) {
+    throw std::runtime_error("Pack checksum mismatch");
+  }
+
+  // Deltas hang off their base, so every whole object roots a tree that one thread resolves top-down
+  std::unordered_map<size_t, std::vector<size_t>> offsetChildren;
+  std::unordered_map<ObjectId, std::vector<size_t>> idChildren;
+  for (size_t n = 0; n < entries.size(); n++) {
+    if (entries[n].type == PACK_OFS_DELTA) {
+      offsetChildren[entries[n].base].push_back(n);
+    } else if (entries[n].type == PACK_REF_DELTA) {
+      idChildren[entries[n].baseId].push_back(n);
+    }
+  }
+  std::vector<size_t> roots;
+  for (size_t n = 0; n < entries.size(); n++) {
+    if (entries[n].resolvedType != Object::Type::Invalid && (offsetChildren.contains(n) || idChildren.contains(entries[n].id))) {
+      roots.push_back(n);
+    } else {
+      entries[n].object.reset();
+    }
+  }
+  auto inflate = [&](const Entry& e) {
+    return Decoco::decompress(Decoco::ZlibDecompressor(), body.subspan(e.dataStart, e.end - e.dataStart));
+  };
+  // A REF_DELTA base that is in the pack twice roots two trees; the delta is only resolved once
+  std::unique_ptr<std::atomic<bool>[]> claimed(new std::atomic<bool>[entries.size()]());
+  ParallelFor(roots.size(), threads, [&](size_t root) {
+    struct Resolved {
+      size_t entry;
+      std::shared_ptr<const Object> object;
+    };
+    Entry& base = entries[roots[root]];
+    std::shared_ptr<const Object> baseObject = std::move(base.object);
+    if (not baseObject) baseObject = std::make_shared<const Object>(base.resolvedType, inflate(base));
+    std::vector<Resolved> stack = { { roots[root], std::move(baseObject) } };
+    while (not stack.empty()) {
+      Resolved parent = std::move(stack.back());
+      stack.pop_back();
+      auto resolve = [&](size_t child) {
+        if (claimed[child].exchange(true)) return;
+        Entry& e = entries[child];
+        std::vector<uint8_t> delta = e.delta.empty() ? inflate(e) : std::move(e.delta);
+        e.resolvedType = parent.object->type();
+        auto result = std::make_shared<const Object>(e.resolvedType, ApplyDelta(parent.object->data(), delta));
+        e.id = result->id();
+        if (offsetChildren.contains(child) || idChildren.contains(e.id)) {
+          stack.push_back({child, std::move(result)});
+        }
+      };
+      if (auto it = offsetChildren.find(parent.entry); it != offsetChildren.end()) {
+        for (size_t child : it->second) resolve(child);
+      }
+      if (auto it = idChildren.find(entries[parent.entry].id); it != idChildren.end()) {
+        for (size_t child : it->second) resolve(child);
+      }
     }
-    return false;
   });
-  if (it == index.end() ||
-      it->id != id) return std::nullopt;
-  return Object(it->type, Decoco::decompress(Decoco::ZlibDecompressor(), data.subspan(it->offset)));
+  std::vector<Pack::IndexEntry> index;
+  index.reserve(entries.size());
+  for (auto& e : entries) {
+    if (e.resolvedType == Object::Type::Invalid) {
+      throw std::runtime_error("Pack contains deltas against missing bases");
+    }
+    index.push_back({e.id, e.crc, e.offset, e.resolvedType});
+  }
+  return CreateIndexFile(std::move(index), trailer);
+}
+
+std::filesystem::path IndexPack(int fd, const std::filesystem::path& packDirectory, size_t threads) {
+  std::filesystem::create_directories(packDirectory);
+  std::string packTemp, indexTemp;
+  try {
+    int out = CreateTemporary(packDirectory, "tmp_pack_", packTemp);
+    try {
+      std::vector<uint8_t> buffer(1 << 20);
+      while (true) {
+        ssize_t got = read(fd, buffer.data(), buffer.size());
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+          throw std::runtime_error("error " + std::to_string(errno) + " reading pack");
+        }
+        if (got == 0) break;
+        WriteAll(out, std::span<const uint8_t>(buffer).first(got), packTemp);
+      }
+    } catch (...) {
+      close(out);
+      throw;
+    }
+    SyncAndClose(out, packTemp);
+
+    MappedFile mapping(packTemp);
+    std::vector<uint8_t> index = IndexPack(mapping.data(), threads);
+    out = CreateTemporary(packDirectory, "tmp_pack_", indexTemp);
+    try {
+      WriteAll(out, index, indexTemp);
+    } catch (...) {
+      close(out);
+      throw;
+    }
+    SyncAndClose(out, indexTemp);
+
+    // named after the pack checksum, like git's own packs; the .idx appears last
+    ObjectId checksum(Bini::reader(mapping.data().last(20)).getArray<20>());
+    std::filesystem::path packFile = packDirectory / ("pack-" + checksum.hex() + ".pack");
+    std::filesystem::rename(packTemp, packFile);
+    packTemp.clear();
+    std::filesystem::rename(indexTemp, std::filesystem::path(packFile).replace_extension(".idx"));
+    indexTemp.clear();
+    SyncDirectory(packDirectory);
+    return packFile;
+  } catch (...) {
+    if (not packTemp.empty()) unlink(packTemp.c_str());
+    if (not indexTemp.empty()) unlink(indexTemp.c_str());
+    throw;
+  }
+}
+
+size_t Pack::offsetAt(size_t n) const {
+  uint32_t offset = ReadBE32(offsets + n * 4);
+  if ((offset & 0x8000'0000) == 0) return offset;
+  size_t large = offset & 0x7FFF'FFFF;
+  if (large >= largeOffsetCount) {
+    throw std::runtime_error("Pack index corrupted");
+  }
+  return ReadBE64(largeOffsets + large * 8);
+}
+
+std::optional<size_t> Pack::find(const ObjectId& id) const {
+  auto n = position(id);
+  if (not n) return std::nullopt;
+  return offsetAt(*n);
+}
+
+std::optional<size_t> Pack::position(const ObjectId& id) const {
+  if (objectCount == 0) return std::nullopt;
+  size_t low = id[0] ? ReadBE32(fanout + (id[0] - 1) * 4) : 0;
+  size_t high = ReadBE32(fanout + id[0] * 4);
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    auto cmp = ObjectId::compare(ids + mid * 20, id.data());
+    if (cmp == 0) return mid;
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return std::nullopt;
+}
+
+void FindIdsWithPrefix(const uint8_t* fanout, const uint8_t* ids, const IdPrefix& prefix, std::vector<ObjectId>& out, size_t limit) {
+  uint8_t first = prefix.bytes[0];
+  size_t low = first ? ReadBE32(fanout + (first - 1) * 4) : 0;
+  size_t high = ReadBE32(fanout + first * 4);
+  // the prefix padded with zero bits sorts at or before everything it matches
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (ObjectId::compare(ids + mid * 20, prefix.bytes.data()) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  size_t end = ReadBE32(fanout + first * 4);
+  for (size_t found = 0; low < end && found < limit && prefix.matches(ids + low * 20); low++, found++) {
+    ObjectId id;
+    memcpy(id.data(), ids + low * 20, 20);
+    out.push_back(id);
+  }
 }
 
+void Pack::findPrefix(const IdPrefix& prefix, std::vector<ObjectId>& out, size_t limit) const {
+  if (objectCount == 0) return;
+  FindIdsWithPrefix(fanout, ids, prefix, out, limit);
+}
+
+std::optional<Pack::Unpacked> Pack::unpack(size_t offset, size_t depth) {
+  // git itself refuses to create chains deeper than 4095
+  if (depth > 10000) {
+    throw std::runtime_error("Delta chain too long");
+  }
+  if (offset >= data.size()) {
+    throw std::runtime_error("Pack offset out of range");
+  }
+  Bini::reader r(data.subspan(offset));
+  EntryHeader header = readEntryHeader(r);
+  size_t baseOffset;
+  switch (header.type) {
+  case PACK_OFS_DELTA: {
+    size_t distance = readDeltaOffset(r);
+    if (distance == 0 || distance > offset) {
+      throw std::runtime_error("Invalid delta base offset");
+    }
+    baseOffset = offset - distance;
+    break;
+  }
+  case PACK_REF_DELTA: {
+    auto base = find(r.getArray<20>());
+    if (not base) return std::nullopt;
+    baseOffset = *base;
+    break;
+  }
+  case (uint8_t)Object::Type::Commit:
+  case (uint8_t)Object::Type::Tree:
+  case (uint8_t)Object::Type::Object:
+  case (uint8_t)Object::Type::Tag: {
+    auto body = Decoco::decompress(Decoco::ZlibDecompressor(), data.last(r.sizeleft()));
+    if (body.size() != header.size) {
+      throw std::runtime_error("Pack entry has the wrong size");
+    }
+    return Unpacked{(Object::Type)header.type, std::make_shared<const std::vector<uint8_t>>(std::move(body))};
+  }
+  default:
+    throw std::runtime_error("Invalid pack entry type " + std::to_string(header.type));
+  }
+
+  auto delta = Decoco::decompress(Decoco::ZlibDecompressor(), data.last(r.sizeleft()));
+  if (delta.size() != header.size) {
+    throw std::runtime_error("Pack entry has the wrong size");
+  }
+  std::optional<Unpacked> base = baseCache->get(baseOffset);
+  if (not base) {
+    base = unpack(baseOffset, depth + 1);
+    if (not base) return std::nullopt;
+    baseCache->put(baseOffset, *base);
+  }
+  return Unpacked{base->type, std::make_shared<const std::vector<uint8_t>>(ApplyDelta(*base->data, delta))};
+}
+
+ObjectInfo Pack::infoAt(size_t offset) const {
+  std::optional<size_t> size;
+  for (size_t depth = 0;; depth++) {
+    if (depth > 10000) {
+      throw std::runtime_error("Delta chain too long");
+    }
+    if (offset >= data.size()) {
+      throw std::runtime_error("Pack offset out of range");
+    }
+    Bini::reader r(data.subspan(offset));
+    EntryHeader header = readEntryHeader(r);
+    size_t baseOffset;
+    switch (header.type) {
+    case PACK_OFS_DELTA: {
+      size_t distance = readDeltaOffset(r);
+      if (distance == 0 || distance > offset) {
+        throw std::runtime_error("Invalid delta base offset");
+      }
+      baseOffset = offset - distance;
+      break;
+    }
+    case PACK_REF_DELTA: {
+      auto base = find(r.getArray<20>());
+      if (not base) {
+        throw std::runtime_error("Delta base missing from pack");
+      }
+      baseOffset = *base;
+      break;
+    }
+    case (uint8_t)Object::Type::Commit:
+    case (uint8_t)Object::Type::Tree:
+    case (uint8_t)Object::Type::Object:
+    case (uint8_t)Object::Type::Tag:
+      return { (Object::Type)header.type, size ? *size : header.size };
+    default:
+      throw std::runtime_error("Invalid pack entry type " + std::to_string(header.type));
+    }
+    if (not size) {
+      // The result size is the second number of the delta header, so only its start is inflated
+      auto decompressor = Decoco::ZlibDecompressor();
+      std::span<const uint8_t> in = data.last(r.sizeleft());
+      std::vector<uint8_t> start;
+      while (start.size() < 20 && not decompressor->done() && not in.empty()) {
+        std::span<const uint8_t> chunk = in.first(std::min<size_t>(in.size(), 64));
+        in = in.subspan(chunk.size());
+        std::vector<uint8_t> inflated = decompressor->add(chunk);
+        start.insert(start.end(), inflated.begin(), inflated.end());
+      }
+      Bini::reader deltaHeader(start);
+      deltaHeader.getPB();
+      size = deltaHeader.getPB();
+      if (deltaHeader.fail()) {
+        throw std::runtime_error("Truncated delta");
+      }
+    }
+    offset = baseOffset;
+  }
+}
+
+bool Pack::streamAt(size_t offset, const std::function<void(std::span<const uint8_t>)>& out) const {
+  static constexpr size_t chunkSize = 16 * 1024;
+  if (offset >= data.size()) {
+    throw std::runtime_error("Pack offset out of range");
+  }
+  Bini::reader r(data.subspan(offset));
+  EntryHeader header = readEntryHeader(r);
+  if (header.type == PACK_OFS_DELTA || header.type == PACK_REF_DELTA) return false;
+  auto decompressor = Decoco::ZlibDecompressor();
+  std::span<const uint8_t> in = data.last(r.sizeleft());
+  size_t total = 0;
+  while (not decompressor->done()) {
+    if (in.empty()) {
+      throw std::runtime_error("Pack entry is truncated");
+    }
+    std::span<const uint8_t> chunk = in.first(std::min(in.size(), chunkSize));
+    in = in.subspan(chunk.size());
+    std::vector<uint8_t> inflated = decompressor->add(chunk);
+    total += inflated.size();
+    if (total > header.size) break;
+    if (not inflated.empty()) out(inflated);
+  }
+  if (total != header.size) {
+    throw std::runtime_error("Pack entry has the wrong size");
+  }
+  return true;
+}
+
+ObjectId Pack::checksum() const {
+  if (data.size() < 20) {
+    throw std::runtime_error("Invalid pack");
+  }
+  ObjectId id;
+  memcpy(id.data(), data.data() + data.size() - 20, 20);
+  return id;
+}
+
+ObjectId Pack::idAt(size_t n) const {
+  ObjectId id;
+  memcpy(id.data(), ids + n * 20, 20);
+  return id;
+}
+
+std::optional<Object> Pack::get(ObjectId id) {
+  auto offset = find(id);
+  if (not offset) return std::nullopt;
+  return getAt(*offset);
+}
+
+Object Pack::getAt(size_t offset) {
+  auto unpacked = unpack(offset);
+  if (not unpacked) {
+    throw std::runtime_error("Delta base missing from pack");
+  }
+  return Object(unpacked->type, *unpacked->data);
+}
 
@@ -0,0 +1,51 @@
+#include "piget/Parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+size_t WorkerCount(size_t requested) {
+  if (requested) return requested;
+  size_t cores = std::thread::hardware_concurrency();
+  return cores ? cores : 1;
+}
+
+void ParallelFor(size_t count, size_t threads, const std::function<void(size_t)>& fn) {
+  threads = std::min(WorkerCount(threads), count);
+  if (threads <= 1) {
+    for (size_t n = 0; n < count; n++) {
+      fn(n);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next = 0;
+  std::mutex errorMutex;
+  std::exception_ptr error;
+  auto worker = [&]() {
+    size_t n;
+    while ((n = next++) < count) {
+      try {
+        fn(n);
+      } catch (...) {
+        std::lock_guard<std::mutex> l(errorMutex);
+        if (not error) error = std::current_exception();
+        next = count;
+      }
+    }
+  };
+  std::vector<std::thread> helpers;
+  for (size_t n = 1; n < threads; n++) {
+    helpers.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : helpers) {
+    t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
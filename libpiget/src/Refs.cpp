@@ -0,0 +1,106 @@
+#include "piget/Refs.hpp"
+#include "piget/GitCAM.hpp"
+#include <algorithm>
+#include <fstream>
+
+std::vector<PackedRef> ReadPackedRefs(const std::filesystem::path& gitDir) {
+  std::vector<PackedRef> refs;
+  std::ifstream in(gitDir / "packed-refs");
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.starts_with("#")) continue;
+    // peeled lines give the object the annotated tag above points to
+    if (line.starts_with("^")) {
+      if (not refs.empty()) refs.back().peeled = ObjectId::fromHex(std::string_view(line).substr(1, 40));
+      continue;
+    }
+    auto id = ObjectId::fromHex(std::string_view(line).substr(0, 40));
+    if (not id || line.size() < 42 || line[40] != ' ') continue;
+    refs.push_back({line.substr(41), *id, std::nullopt});
+  }
+  return refs;
+}
+
+// Where a ref points: an object id, or "ref: <name>" for a symbolic ref; nullopt when there is no loose ref file
+static std::optional<std::string> readLooseRef(const std::filesystem::path& gitDir, const std::string& ref) {
+  // ref names never climb out of the .git directory
+  if (ref.empty() || ref.starts_with("/") || ref.find("..") != std::string::npos) return std::nullopt;
+  std::ifstream in(gitDir / ref);
+  std::string line;
+  if (not std::getline(in, line)) return std::nullopt;
+  return line;
+}
+
+std::optional<ObjectId> ReadRef(const std::filesystem::path& gitDir, const std::string& ref) {
+  std::string name = ref;
+  // git gives up on symbolic refs nested deeper than this
+  for (int depth = 0; depth < 5; depth++) {
+    auto line = readLooseRef(gitDir, name);
+    if (not line) {
+      auto packed = ReadPackedRefs(gitDir);
+      auto it = std::find_if(packed.begin(), packed.end(), [&](const PackedRef& r) { return r.name == name; });
+      if (it == packed.end()) return std::nullopt;
+      return it->id;
+    }
+    if (not line->starts_with("ref: ")) return ObjectId::fromHex(std::string_view(*line).substr(0, 40));
+    name = line->substr(5);
+  }
+  return std::nullopt;
+}
+
+std::optional<std::string> ReadSymbolicRef(const std::filesystem::path& gitDir, const std::string& ref) {
+  auto line = readLooseRef(gitDir, ref);
+  if (not line || not line->starts_with("ref: ")) return std::nullopt;
+  return line->substr(5);
+}
+
+static void addTip(std::vector<ObjectId>& tips, std::string_view hex) {
+  auto id = ObjectId::fromHex(hex.substr(0, 40));
+  // reflogs record ref creation and deletion as the all-zero id
+  if (id && *id != ObjectId()) tips.push_back(*id);
+}
+
+static void readRefFile(std::vector<ObjectId>& tips, const std::filesystem::path& file) {
+  std::ifstream in(file);
+  std::string line;
+  // symbolic refs name another ref rather than an object
+  if (std::getline(in, line) && not line.starts_with("ref:")) addTip(tips, line);
+}
+
+std::vector<ObjectId> ReadRefTips(const std::filesystem::path& gitDir) {
+  std::vector<ObjectId> tips;
+  std::error_code ec;
+  readRefFile(tips, gitDir / "HEAD");
+  for (auto& entry : std::filesystem::recursive_directory_iterator(gitDir / "refs", ec)) {
+    if (entry.is_regular_file()) readRefFile(tips, entry.path());
+  }
+  for (auto& ref : ReadPackedRefs(gitDir)) {
+    tips.push_back(ref.id);
+    if (ref.peeled) tips.push_back(*ref.peeled);
+  }
+
+  // Objects only a reflog still knows about stay reachable, like in git
+  std::string line;
+  for (auto& entry : std::filesystem::recursive_directory_iterator(gitDir / "logs", ec)) {
+    if (not entry.is_regular_file()) continue;
+    std::ifstream log(entry.path());
+    while (std::getline(log, line)) {
+      if (line.size() < 81) continue;
+      addTip(tips, line);
+      addTip(tips, std::string_view(line).substr(41));
+    }
+  }
+  std::sort(tips.begin(), tips.end());
+  tips.erase(std::unique(tips.begin(), tips.end()), tips.end());
+  return tips;
+}
+
+std::optional<ObjectId> ResolveRevision(const std::filesystem::path& gitDir, const Database& db, std::string_view name) {
+  if (name == "HEAD") return ReadRef(gitDir, "HEAD");
+  std::string n(name);
+  for (auto& ref : { n.starts_with("refs/") ? n : "", "refs/" + n, "refs/tags/" + n, "refs/heads/" + n, "refs/remotes/" + n, "refs/remotes/" + n + "/HEAD" }) {
+    if (ref.empty()) continue;
+    if (auto id = ReadRef(gitDir, ref)) return id;
+  }
+  return db.resolve(name);
+}
@@ -0,0 +1,107 @@
+#include "piget/Repack.hpp"
+#include "piget/Bitmap.hpp"
+#include "piget/FileIO.hpp"
+#include "piget/MultiPackIndex.hpp"
+#include "piget/Object.hpp"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+RepackResult Repack(const std::filesystem::path& gitDir, std::span<const ObjectId> extraTips, const RepackOptions& options) {
+  std::filesystem::path objectDir = gitDir / "objects", packDir = objectDir / "pack";
+  auto expiry = std::filesystem::file_time_type::clock::now() - options.gracePeriod;
+  RepackResult result;
+
+  std::vector<ObjectId> tips = ReadRefTips(gitDir);
+  tips.insert(tips.end(), extraTips.begin(), extraTips.end());
+
+  std::vector<std::filesystem::path> oldPacks;
+  std::vector<std::unique_ptr<Pack>> keptPacks;
+  std::error_code ec;
+  for (auto& entry : std::filesystem::directory_iterator(packDir, ec)) {
+    std::filesystem::path file = entry.path();
+    if (file.extension() != ".pack") continue;
+    if (std::filesystem::exists(std::filesystem::path(file).replace_extension(".keep"))) {
+      keptPacks.push_back(std::make_unique<Pack>(file));
+    } else {
+      oldPacks.push_back(file);
+    }
+  }
+
+  Database db(objectDir);
+  // Nothing is deleted before this walk has found every reachable object
+  std::vector<PackObject> reachable = db.objectsBetween(tips);
+  std::unordered_set<ObjectId> reachableIds;
+  for (auto& object : reachable) {
+    reachableIds.insert(object.id);
+  }
+  std::erase_if(reachable, [&](const PackObject& object) {
+    return std::any_of(keptPacks.begin(), keptPacks.end(), [&](auto& pack) { return pack->find(object.id).has_value(); });
+  });
+
+  if (not reachable.empty()) {
+    auto [packData, indexData] = WritePack(db, reachable, options.pack);
+    ObjectId checksum;
+    memcpy(checksum.data(), packData.data() + packData.size() - 20, 20);
+    result.pack = packDir / ("pack-" + checksum.hex() + ".pack");
+    std::filesystem::create_directories(packDir);
+    // the .idx is what makes a pack visible, so it goes last
+    WriteDurably(result.pack, packData);
+    WriteDurably(std::filesystem::path(result.pack).replace_extension(".idx"), indexData);
+    if (options.writeBitmap) WritePackBitmap(db, result.pack, tips);
+    SyncDirectory(packDir);
+    result.packed = reachable.size();
+  }
+
+  // Unreachable objects of the replaced packs become loose with the pack's age, so the grace period still applies
+  for (auto& file : oldPacks) {
+    if (file == result.pack) continue;
+    auto packTime = std::filesystem::last_write_time(file);
+    if (packTime > expiry) {
+      Pack pack(file);
+      std::vector<Object> loosened;
+      for (size_t n = 0; n < pack.size(); n++) {
+        ObjectId id = pack.idAt(n);
+        if (reachableIds.contains(id) || db.cam.contains(id)) continue;
+        loosened.push_back(pack.getAt(pack.offsetAt(n)));
+      }
+      // One batch, so the objects are synced together instead of one fsync each
+      for (auto& id : db.cam.add(loosened, options.pack.threads)) {
+        std::string hex = id.hex();
+        std::filesystem::last_write_time(objectDir / hex.substr(0, 2) / hex.substr(2), packTime);
+      }
+    }
+    for (auto extension : { ".idx", ".pack", ".rev", ".bitmap" }) {
+      std::filesystem::remove(std::filesystem::path(file).replace_extension(extension), ec);
+    }
+  }
+
+  for (size_t byte = 0; byte < 256; byte++) {
+    uint8_t firstByte = byte;
+    std::string fanout(2, '\0');
+    HexEncode(std::span<const uint8_t>(&firstByte, 1), fanout.data());
+    std::filesystem::path dir = objectDir / fanout;
+    for (auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+      std::string name = entry.path().filename().string();
+      auto id = ObjectId::fromHex(fanout + name);
+      bool stale = entry.last_write_time(ec) < expiry;
+      if (id ? reachableIds.contains(*id) || stale : name.starts_with("tmp_obj_") && stale) {
+        if (std::filesystem::remove(entry.path(), ec) && id) result.pruned++;
+      }
+    }
+    // fails, as it should, when anything is left
+    rmdir(dir.c_str());
+  }
+
+  std::filesystem::path midx = packDir / "multi-pack-index";
+  if (std::filesystem::exists(midx)) {
+    std::filesystem::remove(midx);
+    if (not result.pack.empty() || not keptPacks.empty()) WriteMultiPackIndex(packDir);
+  }
+  return result;
+}
@@ -1,11 +1,41 @@
 #include "catch2/catch_all.hpp"
 #include "piget/GitCAM.hpp"
 #include "piget/Object.hpp"
+#include "piget/CommitGraph.hpp"
+#include "piget/Diff.hpp"
+#include "piget/Ignore.hpp"
+#include "piget/Pack.hpp"
+#include "piget/Refs.hpp"
+#include <fstream>
 
 namespace Piget {
 
+// Index works on the worktree in the current directory, so its tests run inside a fresh one
+struct Worktree {
+  Worktree(const std::string& name)
+  : previous(std::filesystem::current_path())
+  {
+    std::filesystem::remove_all(name);
+    std::filesystem::create_directories(name + "/.git/objects");
+    std::filesystem::current_path(name);
+  }
+  ~Worktree() {
+    std::filesystem::current_path(previous);
+  }
+  std::filesystem::path previous;
+};
+
+static void writeFile(const std::filesystem::path& path, const std::string& contents) {
+  std::ofstream(path, std::ios::binary) << contents;
+}
+
+static std::string readFile(const std::filesystem::path& path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
 TEST_CASE("store and read file from gitcam") {
-  std::array<uint8_t, 20> helloid;
+  ObjectId helloid;
   {
     Object hello("libpiget/test/hello.txt");
     helloid = hello.id();
@@ -21,4 +51,665 @@ TEST_CASE("store and read file from gitcam") {
   }
 }
 
+TEST_CASE("stream a file into gitcam") {
+  GitCAM db("objects");
+  SECTION("small file") {
+    Object hello("libpiget/test/hello.txt");
+    REQUIRE(db.addFile("libpiget/test/hello.txt") == hello.id());
+    REQUIRE(db.get(hello.id())->buffer == hello.buffer);
+  }
+
+  SECTION("file spanning many chunks") {
+    {
+      std::ofstream out("large.txt");
+      for (size_t n = 0; n < 100000; n++) {
+        out << "line " << n << "\n";
+      }
+    }
+    Object large("large.txt");
+    REQUIRE(db.addFile("large.txt") == large.id());
+    REQUIRE(db.get(large.id())->buffer == large.buffer);
+    REQUIRE(db.addFile("large.txt") == large.id());
+  }
+
+  SECTION("several files at once") {
+    std::vector<std::filesystem::path> paths = { "libpiget/test/hello.txt", "libpiget/test/world.txt", "libpiget/test/hello.txt" };
+    auto ids = db.addFiles(paths, 2);
+    REQUIRE(ids.size() == 3);
+    for (size_t n = 0; n < paths.size(); n++) {
+      Object file(paths[n]);
+      REQUIRE(ids[n] == file.id());
+      REQUIRE(db.get(ids[n])->buffer == file.buffer);
+    }
+  }
+}
+
+TEST_CASE("add a batch of objects to gitcam") {
+  GitCAM db("objects");
+  std::vector<Object> objects;
+  for (size_t n = 0; n < 64; n++) {
+    std::string text = "object " + std::to_string(n) + "\n";
+    objects.emplace_back(Object::Type::Object, std::span<const uint8_t>((const uint8_t*)text.data(), text.size()));
+  }
+  auto ids = db.add(objects, 4);
+  REQUIRE(ids.size() == objects.size());
+  for (size_t n = 0; n < objects.size(); n++) {
+    REQUIRE(ids[n] == objects[n].id());
+    REQUIRE(db.get(ids[n])->buffer == objects[n].buffer);
+  }
+  REQUIRE(db.add(objects, 4) == ids);
+}
+
+TEST_CASE("Database caches loose and missing object ids") {
+  std::filesystem::remove_all("lookupobjects");
+  std::string text = "written elsewhere\n";
+  Object hello("libpiget/test/hello.txt");
+  Object late(Object::Type::Object, std::span<const uint8_t>((const uint8_t*)text.data(), text.size()));
+
+  Database db("lookupobjects");
+  REQUIRE(not db.contains(hello.id()));
+  db.add(hello);
+  REQUIRE(db.contains(hello.id()));
+  REQUIRE(db.get(hello.id())->buffer == hello.buffer);
+
+  SECTION("Objects written around the database are still found") {
+    db.cam.add(late);
+    REQUIRE(db.get(late.id())->buffer == late.buffer);
+  }
+
+  SECTION("Misses through cam are forgotten") {
+    REQUIRE(not db.get(late.id()));
+    db.cam.add(late);
+    REQUIRE(db.contains(late.id()));
+    REQUIRE(db.get(late.id())->buffer == late.buffer);
+  }
+
+  // Another GitCAM stands in for another process; only a probe of the loose file could find what it wrote
+  SECTION("Remembered misses do no filesystem probe until refresh") {
+    REQUIRE(not db.get(late.id()));
+    GitCAM("lookupobjects").add(late);
+    REQUIRE(not db.get(late.id()));
+    REQUIRE(not db.contains(late.id()));
+    REQUIRE(not db.info(late.id()));
+    db.refresh();
+    REQUIRE(db.get(late.id())->buffer == late.buffer);
+  }
+
+  SECTION("A first miss is not probed either once the loose objects are listed") {
+    db.probeOrder = Database::ProbeOrder::PacksFirst;
+    GitCAM("lookupobjects").add(late);
+    REQUIRE(not db.get(late.id()));
+    REQUIRE(not db.stream(late.id(), [](std::span<const uint8_t>) {}));
+    db.refresh();
+    REQUIRE(db.contains(late.id()));
+  }
+
+  SECTION("Packs can be probed first") {
+    db.probeOrder = Database::ProbeOrder::PacksFirst;
+    REQUIRE(db.get(hello.id())->buffer == hello.buffer);
+  }
+}
+
+TEST_CASE("Database caches decoded trees but not blobs") {
+  Object hello("libpiget/test/hello.txt");
+  Object dir(Tree{std::vector<DirEntry>{
+    DirEntry{0100644, "hello.txt", hello.id()},
+    }});
+  Database db("objects");
+  db.add(hello);
+  db.add(dir);
+
+  REQUIRE(db.get(dir.id())->buffer == dir.buffer);
+  REQUIRE(db.get(dir.id())->buffer == dir.buffer);
+  REQUIRE(db.get(hello.id())->buffer == hello.buffer);
+  REQUIRE(db.get(hello.id())->buffer == hello.buffer);
+  auto stats = db.objectCacheStats();
+  REQUIRE(stats.hits == 1);
+  REQUIRE(stats.misses == 3);
+  REQUIRE(stats.entries == 1);
+  REQUIRE(stats.bytes == dir.buffer.size());
+
+  db.setObjectCachePolicy({ .byteLimit = 0 });
+  REQUIRE(db.objectCacheStats().entries == 0);
+  REQUIRE(db.get(dir.id())->buffer == dir.buffer);
+  REQUIRE(db.objectCacheStats().entries == 0);
+}
+
+TEST_CASE("Shared handles point at the cached object") {
+  Object hello("libpiget/test/hello.txt");
+  Object dir(Tree{std::vector<DirEntry>{
+    DirEntry{0100644, "hello.txt", hello.id()},
+    }});
+  Database db("objects");
+  db.add(hello);
+  db.add(dir);
+
+  auto first = db.getShared(dir.id());
+  REQUIRE(first->buffer == dir.buffer);
+  REQUIRE(db.getShared(dir.id()) == first);
+  REQUIRE(db.objectCacheStats().hits == 1);
+  // uncached blobs are still handed out, each read on its own
+  auto blob = db.getShared(hello.id());
+  REQUIRE(blob->buffer == hello.buffer);
+  REQUIRE(db.getShared(hello.id()) != blob);
+  REQUIRE(not db.getShared(Object(Object::Type::Object, std::span<const uint8_t>()).id()));
+}
+
+TEST_CASE("Resolve abbreviated object ids") {
+  std::filesystem::remove_all("abbrevobjects");
+  Database db("abbrevobjects");
+  std::vector<Object> objects;
+  std::map<std::string, size_t> byPrefix;
+  std::string ambiguous;
+  for (size_t n = 0; ambiguous.empty(); n++) {
+    std::string text = std::to_string(n);
+    objects.emplace_back(Object::Type::Object, std::span<const uint8_t>((const uint8_t*)text.data(), text.size()));
+    db.add(objects.back());
+    std::string prefix = objects.back().id().hex().substr(0, 4);
+    if (byPrefix.contains(prefix)) ambiguous = prefix;
+    byPrefix[prefix] = n;
+  }
+
+  std::string first = objects[0].id().hex();
+  REQUIRE(db.resolve(first.substr(0, 12)) == objects[0].id());
+  REQUIRE(db.resolve(first) == objects[0].id());
+  REQUIRE(db.findPrefix(ambiguous).size() == 2);
+  REQUIRE_THROWS(db.resolve(ambiguous));
+  REQUIRE(not db.resolve("xyz1234"));
+
+  size_t length = db.uniqueAbbreviationLength();
+  REQUIRE(length > 4);
+  for (auto& object : objects) {
+    REQUIRE(db.resolve(object.id().hex().substr(0, length)) == object.id());
+  }
+}
+
+TEST_CASE("Walk history through a commit-graph") {
+  Object dir(Tree{});
+  UserWithTime author{{"Piget", "piget@example.com"}, 1000, 0};
+  auto commit = [&](std::string message, std::vector<ObjectId> parents) {
+    Commit c = Commit(dir.id(), author).setMessage(message);
+    if (not parents.empty()) {
+      c.parent = parents[0];
+      c.mergeParents.assign(parents.begin() + 1, parents.end());
+    }
+    return Object(c);
+  };
+  Object root = commit("root\n", {});
+  Object left = commit("left\n", { root.id() });
+  Object right = commit("right\n", { root.id() });
+  Object merge = commit("merge\n", { left.id(), right.id() });
+  Object top = commit("top\n", { merge.id() });
+
+  std::filesystem::remove_all("graphobjects");
+  {
+    Database db("graphobjects");
+    for (auto& object : { dir, root, left, right, merge, top }) {
+      db.add(object);
+    }
+    REQUIRE(db.mergeBases(left.id(), right.id()) == std::vector<ObjectId>{ root.id() });
+    WriteCommitGraph(db, "graphobjects", std::vector<ObjectId>{ top.id() });
+  }
+
+  CommitGraph graph("graphobjects/info/commit-graph");
+  REQUIRE(graph.size() == 5);
+  REQUIRE(graph.generationAt(*graph.find(top.id())) == 4);
+  REQUIRE(graph.timeAt(*graph.find(top.id())) == 1000);
+  REQUIRE(graph.isAncestor(*graph.find(right.id()), *graph.find(top.id())));
+  REQUIRE(not graph.isAncestor(*graph.find(right.id()), *graph.find(left.id())));
+
+  Database db("graphobjects");
+  Object after = commit("after\n", { top.id() });
+  db.add(after);
+  auto info = db.commitInfo(merge.id());
+  REQUIRE(info->root == dir.id());
+  REQUIRE(info->parents == std::vector<ObjectId>{ left.id(), right.id() });
+  REQUIRE(info->generation == 3);
+  REQUIRE(db.commitInfo(after.id())->generation == 0);
+  REQUIRE(db.isAncestor(root.id(), after.id()));
+  REQUIRE(not db.isAncestor(after.id(), root.id()));
+  REQUIRE(db.mergeBases(after.id(), right.id()) == std::vector<ObjectId>{ right.id() });
+  REQUIRE(db.mergeBases(left.id(), right.id()) == std::vector<ObjectId>{ root.id() });
+}
+
+TEST_CASE("Read refs from loose files and packed-refs") {
+  ObjectId tag = *ObjectId::fromHex("ce013625030ba8dba906f756967f9e9ca394464a");
+  ObjectId main = *ObjectId::fromHex("cc628ccd10742baea8241c5924df992b5c019f71");
+  ObjectId loose = *ObjectId::fromHex("e69de29bb2d1d6434b8b29ae775ad8c2e48c5391");
+  std::filesystem::remove_all("refsgit");
+  std::filesystem::create_directories("refsgit/refs/heads");
+  std::ofstream("refsgit/HEAD") << "ref: refs/heads/main\n";
+  std::ofstream("refsgit/packed-refs") << "# pack-refs with: peeled fully-peeled sorted \n"
+                                       << main.hex() << " refs/heads/main\n"
+                                       << tag.hex() << " refs/tags/v1\n"
+                                       << "^" << main.hex() << "\n";
+
+  auto packed = ReadPackedRefs("refsgit");
+  REQUIRE(packed.size() == 2);
+  REQUIRE(packed[1].name == "refs/tags/v1");
+  REQUIRE(packed[1].peeled == main);
+  REQUIRE(ReadRef("refsgit", "HEAD") == main);
+  REQUIRE(ReadSymbolicRef("refsgit", "HEAD") == "refs/heads/main");
+  REQUIRE(ReadRef("refsgit", "refs/tags/v1") == tag);
+  REQUIRE(not ReadRef("refsgit", "refs/heads/other"));
+  REQUIRE(not ReadRef("refsgit", "../refsgit/HEAD"));
+
+  // a loose ref is newer than the packed one
+  std::ofstream("refsgit/refs/heads/main") << loose.hex() << "\n";
+  REQUIRE(ReadRef("refsgit", "HEAD") == loose);
+}
+
+TEST_CASE("Resolve revision arguments") {
+  Object hello("libpiget/test/hello.txt");
+  ObjectId tag = *ObjectId::fromHex("ce013625030ba8dba906f756967f9e9ca394464a");
+  ObjectId main = *ObjectId::fromHex("cc628ccd10742baea8241c5924df992b5c019f71");
+  std::filesystem::remove_all("revgit");
+  std::filesystem::create_directories("revgit/refs/heads");
+  std::filesystem::create_directories("revgit/refs/tags");
+  std::ofstream("revgit/HEAD") << "ref: refs/heads/main\n";
+  std::ofstream("revgit/refs/heads/v1") << main.hex() << "\n";
+  std::ofstream("revgit/refs/tags/v1") << tag.hex() << "\n";
+  Database db("revgit/objects");
+  db.add(hello);
+
+  // an unborn branch
+  REQUIRE(not ResolveRevision("revgit", db, "HEAD"));
+  std::ofstream("revgit/refs/heads/main") << main.hex() << "\n";
+  REQUIRE(ResolveRevision("revgit", db, "HEAD") == main);
+  REQUIRE(ResolveRevision("revgit", db, "main") == main);
+  REQUIRE(ResolveRevision("revgit", db, "v1") == tag);
+  REQUIRE(ResolveRevision("revgit", db, "heads/v1") == main);
+  REQUIRE(ResolveRevision("revgit", db, hello.id().hex().substr(0, 7)) == hello.id());
+
+  // what the CLI reports as "Not a valid object name"
+  REQUIRE(not ResolveRevision("revgit", db, "nosuchref"));
+  REQUIRE(not ResolveRevision("revgit", db, "HEAD~1"));
+  REQUIRE(not ResolveRevision("revgit", db, "deadbeef"));
+}
+
+TEST_CASE("Diff two trees") {
+  Object hello("libpiget/test/hello.txt");
+  Object world("libpiget/test/world.txt");
+  Object sub(Tree{std::vector<DirEntry>{ DirEntry{0100644, "x", hello.id()} }});
+  // never stored: identical subtrees must not be read
+  Object same(Tree{std::vector<DirEntry>{ DirEntry{0100644, "y", world.id()} }});
+  Object before(Tree{std::vector<DirEntry>{
+    DirEntry{0100644, "a.txt", hello.id()},
+    DirEntry{040000, "same", same.id()},
+    DirEntry{040000, "sub", sub.id()},
+    }});
+  Object after(Tree{std::vector<DirEntry>{
+    DirEntry{0100755, "a.txt", world.id()},
+    DirEntry{0100644, "new.txt", world.id()},
+    DirEntry{040000, "same", same.id()},
+    DirEntry{0100644, "sub", hello.id()},
+    }});
+
+  std::filesystem::remove_all("diffobjects");
+  Database db("diffobjects");
+  for (auto& object : { sub, before, after }) {
+    db.add(object);
+  }
+  auto changes = DiffTrees(db, before.id(), after.id());
+  REQUIRE(changes.size() == 4);
+  REQUIRE(changes[0].path == "a.txt");
+  REQUIRE(changes[0].status == TreeChange::Status::Modified);
+  REQUIRE(changes[0].oldMode == 0100644);
+  REQUIRE(changes[0].newMode == 0100755);
+  REQUIRE(changes[0].newId == world.id());
+  REQUIRE(changes[1].path == "new.txt");
+  REQUIRE(changes[1].status == TreeChange::Status::Added);
+  REQUIRE(changes[2].path == "sub");
+  REQUIRE(changes[2].status == TreeChange::Status::Added);
+  REQUIRE(changes[3].path == "sub/x");
+  REQUIRE(changes[3].status == TreeChange::Status::Deleted);
+  REQUIRE(changes[3].oldId == hello.id());
+
+  REQUIRE(DiffTrees(db, after.id(), after.id()).empty());
+  REQUIRE(DiffTrees(db, std::nullopt, sub.id()).size() == 1);
+}
+
+TEST_CASE("Stream objects in pieces") {
+  std::vector<uint8_t> large(300000);
+  for (size_t n = 0; n < large.size(); n++) {
+    large[n] = uint8_t(n * 7919 >> 5);
+  }
+  Object blob(Object::Type::Object, large);
+  Object hello("libpiget/test/hello.txt");
+  auto read = [](const Database& db, const ObjectId& id) {
+    std::vector<uint8_t> out;
+    bool found = db.stream(id, [&](std::span<const uint8_t> data) { out.insert(out.end(), data.begin(), data.end()); });
+    REQUIRE(found);
+    return out;
+  };
+
+  std::filesystem::remove_all("streamobjects");
+  Database db("streamobjects");
+  db.add(blob);
+  REQUIRE(read(db, blob.id()) == large);
+  REQUIRE(not db.packLocation(blob.id()));
+
+  auto [packData, indexData] = WritePack(db, std::vector<ObjectId>{ blob.id() });
+  db.addPack(Pack(packData, indexData));
+  db.add(hello);
+  db.probeOrder = Database::ProbeOrder::PacksFirst;
+  REQUIRE(db.packLocation(blob.id()));
+  REQUIRE(read(db, blob.id()) == large);
+  REQUIRE(read(db, hello.id()) == std::vector<uint8_t>(hello.data().begin(), hello.data().end()));
+  REQUIRE(not db.stream(ObjectId(), [](std::span<const uint8_t>) {}));
+}
+
+TEST_CASE("Checkout keeps local changes and untracked files") {
+  Worktree worktree("checkoutrepo");
+  Database db(".git/objects");
+  auto blob = [&](const std::string& text) {
+    Object object(Object::Type::Object, std::span<const uint8_t>((const uint8_t*)text.data(), text.size()));
+    db.add(object);
+    return object.id();
+  };
+  auto tree = [&](std::vector<DirEntry> entries) {
+    Object object{Tree{std::move(entries)}};
+    db.add(object);
+    return object.id();
+  };
+  ObjectId hello = blob("hello\n"), world = blob("world\n");
+  ObjectId before = tree({{0100644, "a.txt", hello}, {0100644, "b.txt", world}});
+  ObjectId after = tree({{0100644, "a.txt", world}, {0100644, "c.txt", hello}});
+  Index index(db.cam);
+  index.checkout(db, before);
+  REQUIRE(readFile("a.txt") == "hello\n");
+  REQUIRE(readFile("b.txt") == "world\n");
+
+  SECTION("A clean worktree is switched") {
+    index.checkout(db, after);
+    REQUIRE(readFile("a.txt") == "world\n");
+    REQUIRE(readFile("c.txt") == "hello\n");
+    REQUIRE(not std::filesystem::exists("b.txt"));
+    REQUIRE(index.entries().at("a.txt").hash == world);
+  }
+
+  SECTION("Local changes and untracked files survive a refused checkout") {
+    writeFile("a.txt", "local\n");
+    writeFile("c.txt", "untracked\n");
+    REQUIRE_THROWS(index.checkout(db, after));
+    REQUIRE(readFile("a.txt") == "local\n");
+    REQUIRE(readFile("b.txt") == "world\n");
+    REQUIRE(readFile("c.txt") == "untracked\n");
+    REQUIRE(index.entries().at("a.txt").hash == hello);
+  }
+
+  SECTION("Files the tree leaves unchanged keep their local changes") {
+    writeFile("a.txt", "local\n");
+    index.checkout(db, tree({{0100644, "a.txt", hello}}));
+    REQUIRE(readFile("a.txt") == "local\n");
+    REQUIRE(not std::filesystem::exists("b.txt"));
+    REQUIRE(index.refresh() == std::vector<std::filesystem::path>{ "a.txt" });
+  }
+
+  SECTION("Files are not written through a symlinked directory") {
+    std::filesystem::create_directory("outside");
+    std::filesystem::create_directory_symlink("outside", "d");
+    REQUIRE_THROWS(index.checkout(db, tree({{040000, "d", tree({{0100644, "x.txt", hello}})}})));
+    REQUIRE(not std::filesystem::exists("outside/x.txt"));
+    REQUIRE(readFile("a.txt") == "hello\n");
+  }
+}
+
+TEST_CASE("Match gitignore patterns") {
+  REQUIRE(WildMatch("*.log", "a.log"));
+  REQUIRE(not WildMatch("*.log", "dir/a.log"));
+  REQUIRE(WildMatch("a?c", "abc"));
+  REQUIRE(not WildMatch("a?c", "a/c"));
+  REQUIRE(WildMatch("[a-c]x[!0-9]", "bxy"));
+  REQUIRE(not WildMatch("[a-c]x[!0-9]", "bx1"));
+  REQUIRE(WildMatch("[[:digit:]]*", "7up"));
+  REQUIRE(WildMatch("\\#hash", "#hash"));
+  REQUIRE(WildMatch("**/foo", "foo"));
+  REQUIRE(WildMatch("**/foo", "a/b/foo"));
+  REQUIRE(WildMatch("a/**/b", "a/b"));
+  REQUIRE(WildMatch("a/**/b", "a/x/y/b"));
+  REQUIRE(WildMatch("a/**", "a/x/y"));
+  REQUIRE(not WildMatch("a/**", "a"));
+  REQUIRE(not WildMatch("a**b", "a/b"));
+}
+
+TEST_CASE("Excluded files are not added or listed as untracked") {
+  Worktree worktree("ignorerepo");
+  std::filesystem::create_directories(".git/info");
+  std::filesystem::create_directories("build/deep");
+  std::filesystem::create_directories("src/gen");
+  writeFile(".git/info/exclude", "local.txt\n");
+  writeFile(".gitignore", "# build output\nbuild/\n*.log\n!keep.log\n/top.txt\n");
+  writeFile("src/.gitignore", "gen\n!debug.log\n");
+  for (auto name : { "a.log", "keep.log", "top.txt", "local.txt", "main.c", "build/out", "build/deep/out",
+                     "src/top.txt", "src/debug.log", "src/other.log", "src/gen/g.c" }) {
+    writeFile(name, "data\n");
+  }
+  Database db(".git/objects");
+  Index index(db.cam);
+
+  SECTION("addAll skips excluded files and directories") {
+    index.addAll(".");
+    std::vector<std::string> added;
+    for (auto& [name, _] : index.entries()) added.push_back(name);
+    REQUIRE(added == std::vector<std::string>{ ".gitignore", "keep.log", "main.c", "src/.gitignore", "src/debug.log", "src/top.txt" });
+
+    // Tracked files are updated even below an excluded directory; a directory argument inside one adds nothing new
+    writeFile("build/out", "tracked\n");
+    index.add("build/out");
+    writeFile("build/out", "changed\n");
+    index.addAll("build");
+    REQUIRE(index.entries().size() == 7);
+    REQUIRE(index.entries().at("build/out").hash == Object(Object::Type::Object, std::span<const uint8_t>((const uint8_t*)"changed\n", 8)).id());
+  }
+
+  SECTION("status leaves excluded files out, and sees changed exclude files at once") {
+    index.add(".gitignore");
+    auto status = index.status(db, std::nullopt);
+    REQUIRE(status.untracked == std::vector<std::string>{ "keep.log", "main.c", "src/" });
+    writeFile(".gitignore", "build/\n*.log\n/top.txt\n*.c\n");
+    status = index.status(db, std::nullopt);
+    REQUIRE(status.untracked == std::vector<std::string>{ "src/" });
+  }
+}
+
+TEST_CASE("Symlinks are added as links, not as their targets") {
+  Worktree worktree("linkrepo");
+  std::filesystem::create_directories("dir");
+  writeFile("target.txt", "target contents\n");
+  std::filesystem::create_symlink("target.txt", "link");
+  std::filesystem::create_symlink("../missing", "dir/dangling");
+  auto linkBlob = [](std::string target) {
+    return Object(Object::Type::Object, std::span<const uint8_t>((const uint8_t*)target.data(), target.size())).id();
+  };
+  Database db(".git/objects");
+  Index index(db.cam);
+
+  SECTION("add stores the link target with mode 120000") {
+    index.add("link");
+    REQUIRE(index.entries().at("link").mode == 0120000);
+    REQUIRE(index.entries().at("link").hash == linkBlob("target.txt"));
+    REQUIRE(db.get(linkBlob("target.txt")));
+  }
+
+  SECTION("addAll takes symlinks, dangling ones included, and status sees them tracked") {
+    index.addAll(".");
+    REQUIRE(index.entries().size() == 3);
+    REQUIRE(index.entries().at("dir/dangling").mode == 0120000);
+    REQUIRE(index.entries().at("dir/dangling").hash == linkBlob("../missing"));
+    REQUIRE(index.entries().at("target.txt").mode == 0100644);
+    REQUIRE(index.status(db, std::nullopt).untracked.empty());
+    REQUIRE(index.refresh().empty());
+
+    std::filesystem::remove("link");
+    std::filesystem::create_symlink("dir", "link");
+    REQUIRE(index.refresh() == std::vector<std::filesystem::path>{ "link" });
+  }
+}
+
+TEST_CASE("Status reuses directory listings until a directory changes") {
+  Worktree worktree("statusrepo");
+  std::filesystem::create_directories("dir/sub");
+  writeFile("tracked.txt", "tracked\n");
+  writeFile("loose.txt", "loose\n");
+  writeFile("dir/sub/file.txt", "file\n");
+  // Directories changed within the current second are listed again every time, so these are made older
+  for (auto dir : { ".", "dir", "dir/sub" }) {
+    std::filesystem::last_write_time(dir, std::filesystem::file_time_type::clock::now() - std::chrono::hours(1));
+  }
+  Database db(".git/objects");
+  {
+    Index index(db.cam, Index::Lock::Required);
+    index.add("tracked.txt");
+    auto status = index.status(db, std::nullopt);
+    REQUIRE(status.staged.size() == 1);
+    REQUIRE(status.staged[0].path == "tracked.txt");
+    REQUIRE(status.untracked == std::vector<std::string>{ "dir/", "loose.txt" });
+    index.save();
+  }
+  // The cache lives outside the index, which git reads without warnings
+  REQUIRE(readFile(".git/index").find("UNTP") == std::string::npos);
+  REQUIRE(std::filesystem::exists(".git/piget-untracked"));
+
+  SECTION("An unchanged directory comes from the cache") {
+    auto mtime = std::filesystem::last_write_time(".");
+    writeFile("sneaked.txt", "");
+    std::filesystem::last_write_time(".", mtime);
+    Index index(db.cam);
+    REQUIRE(index.status(db, std::nullopt).untracked == std::vector<std::string>{ "dir/", "loose.txt" });
+  }
+
+  SECTION("A new file changes the mtime of its directory") {
+    writeFile("dir/new.txt", "");
+    writeFile("new.txt", "");
+    Index index(db.cam);
+    REQUIRE(index.status(db, std::nullopt).untracked == std::vector<std::string>{ "dir/", "loose.txt", "new.txt" });
+  }
+
+  SECTION("Cached files that were added since are not untracked") {
+    Index index(db.cam, Index::Lock::Required);
+    index.add("dir/sub/file.txt");
+    REQUIRE(index.status(db, std::nullopt).untracked == std::vector<std::string>{ "loose.txt" });
+    index.remove("dir/sub/file.txt");
+    REQUIRE(index.status(db, std::nullopt).untracked == std::vector<std::string>{ "dir/", "loose.txt" });
+  }
+}
+
+TEST_CASE("Index trusts stat data unless an entry is racily clean") {
+  Worktree worktree("statrepo");
+  writeFile("old.txt", "old\n");
+  writeFile("empty.txt", "");
+  writeFile("future.txt", "future\n");
+  auto now = std::filesystem::file_time_type::clock::now();
+  std::filesystem::last_write_time("old.txt", now - std::chrono::hours(1));
+  std::filesystem::last_write_time("empty.txt", now - std::chrono::hours(1));
+  // Written after the index, as far as the timestamps go
+  std::filesystem::last_write_time("future.txt", now + std::chrono::hours(1));
+  Database db(".git/objects");
+  {
+    Index index(db.cam, Index::Lock::Required);
+    for (auto name : { "old.txt", "empty.txt", "future.txt" }) index.add(name);
+    index.save();
+  }
+  // A file that is hashed again is stored again, so removing its object shows whether it was read
+  auto objectFile = [&](const std::string& name) {
+    std::string hex = Index(db.cam).entries().at(name).hash.hex();
+    return std::filesystem::path(".git/objects") / hex.substr(0, 2) / hex.substr(2);
+  };
+  std::map<std::string, std::filesystem::path> objects;
+  for (auto name : { "old.txt", "empty.txt", "future.txt" }) {
+    objects[name] = objectFile(name);
+    std::filesystem::remove(objects[name]);
+  }
+
+  Index index(db.cam, Index::Lock::Required);
+  for (auto name : { "old.txt", "empty.txt", "future.txt" }) index.add(name);
+  REQUIRE(not std::filesystem::exists(objects["old.txt"]));
+  REQUIRE(not std::filesystem::exists(objects["empty.txt"]));
+  REQUIRE(std::filesystem::exists(objects["future.txt"]));
+  REQUIRE(index.refresh().empty());
+
+  // Racily clean entries are stored with size 0, so the next index checks their content too
+  index.save();
+  REQUIRE(Index(db.cam).entries().at("future.txt").filesize == 0);
+  REQUIRE(Index(db.cam).entries().at("old.txt").filesize == 4);
+
+  writeFile("old.txt", "new\n");
+  REQUIRE(Index(db.cam).refresh() == std::vector<std::filesystem::path>{ "old.txt" });
+}
+
+TEST_CASE("Index TREE extension is written like git writes it") {
+  Worktree worktree("treerepo");
+  for (auto dir : { "ab/c", "b", "a-b", "a.b", "z" }) std::filesystem::create_directories(dir);
+  for (auto name : { "ab/c/1", "b/2", "a-b/3", "a.b/4", "z/5", "top" }) writeFile(name, name + std::string("\n"));
+  // From git add . && git write-tree on the same files
+  std::string expected;
+  for (auto [name, counts, hex] : std::initializer_list<std::array<std::string, 3>>{
+      { "", "6 5", "3500b5b3ff15328f222e368d22cc0047ac05dc55" },
+      { "b", "1 0", "3db5372322030e80a1aadd74fb9fc1f625224333" },
+      { "z", "1 0", "4a559301127ef70e8592bf2019a6583619cbe55f" },
+      { "ab", "1 1", "c25d7027811e63abdc0c433d69e1c679517e94a4" },
+      { "c", "1 0", "1acd58f7a62f7a7f717a1b06d38a55bedfbafe0a" },
+      { "a-b", "1 0", "8c90a73f4e9431018b38307404681ac3fa9790e7" },
+      { "a.b", "1 0", "9ab15c897a4cb49541b1cba2231ac5bf47c92d77" } }) {
+    ObjectId id = *ObjectId::fromHex(hex);
+    expected += name + '\0' + counts + '\n' + std::string((const char*)id.data(), id.size());
+  }
+  auto treeExtension = [] {
+    std::string index = readFile(".git/index");
+    size_t start = index.find("TREE");
+    REQUIRE(start != std::string::npos);
+    auto size = ReadBE32((const uint8_t*)index.data() + start + 4);
+    return index.substr(start + 8, size);
+  };
+  Database db(".git/objects");
+  {
+    Index index(db.cam, Index::Lock::Required);
+    index.addAll(".");
+    REQUIRE(index.toTree().id().hex() == "3500b5b3ff15328f222e368d22cc0047ac05dc55");
+    index.save();
+  }
+  REQUIRE(treeExtension() == expected);
+
+  // Read back, the cache tree gives the root without building anything, and writes out unchanged
+  {
+    Index index(db.cam, Index::Lock::Required);
+    REQUIRE(index.toTree().id().hex() == "3500b5b3ff15328f222e368d22cc0047ac05dc55");
+    index.save();
+  }
+  REQUIRE(treeExtension() == expected);
+
+  // A changed file invalidates its directories up to the root, and nothing else
+  writeFile("ab/c/1", "changed\n");
+  Index index(db.cam, Index::Lock::Required);
+  index.add("ab/c/1");
+  index.save();
+  using namespace std::string_literals;
+  std::string invalidated = treeExtension();
+  REQUIRE(invalidated.starts_with("\0-1 5\nb\0001 0\n"s));
+  REQUIRE(invalidated.find("ab\0-1 1\nc\0-1 0\na-b\0001 0\n"s) != std::string::npos);
+}
+
+TEST_CASE("Index builds trees in git order") {
+  Worktree worktree("orderrepo");
+  // "a-b" < "a.b" < "a/" < "a0": a directory sorts as if its name ended in '/'
+  for (auto dir : { "a/b", "a.b", "a-b", "x/y/z" }) std::filesystem::create_directories(dir);
+  for (auto name : { "a/b/1", "a.b/2", "a-b/3", "a/4", "x/y/z/5", "a0", "top" }) writeFile(name, name + std::string("\n"));
+  Database db(".git/objects");
+  Index index(db.cam);
+  index.addAll(".");
+  // Both ids are what git write-tree gives for the same files
+  Object root = index.toTree();
+  REQUIRE(root.id().hex() == "92cdabc5bb103f2cd2dda804c6b35b622a8ac6d7");
+  std::vector<std::string> names;
+  for (auto& entry : root.viewAsTree()) names.emplace_back(entry.fileName);
+  REQUIRE(names == std::vector<std::string>{ "a-b", "a.b", "a", "a0", "top", "x" });
+
+  // Built again from the cache tree, with only the changed directories written anew
+  writeFile("x/y/z/6", "x/y/z/6\n");
+  index.add("x/y/z/6");
+  REQUIRE(index.toTree().id().hex() == "1b59d0600371ffa3fdacab0e5f3a7e99b68307ff");
+  REQUIRE(db.get(*ObjectId::fromHex("1b59d0600371ffa3fdacab0e5f3a7e99b68307ff")));
+}
+
 }
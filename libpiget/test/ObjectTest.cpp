@@ -1,6 +1,8 @@
 #include "catch2/catch_all.hpp"
 #include "piget/GitCAM.hpp"
+#include "piget/Hash.hpp"
 #include "piget/Object.hpp"
+#include "caligo/sha1.h"
 
 namespace Piget {
 
@@ -17,7 +19,7 @@ TEST_CASE("Convert file to GitCAM object") {
 
   auto objhash = obj.id();
   SECTION("Object hash is correct") {
-    std::array<uint8_t,20> correctHash = { 
+    std::array<uint8_t, 20> correctHash = { 
       0xce, 0x01, 0x36, 0x25, 0x03, 0x0b, 0xa8, 0xdb, 0xa9, 0x06, 0xf7, 0x56, 0x96, 0x7f, 0x9e, 0x9c, 0xa3, 0x94, 0x46, 0x4a, 
     };
     REQUIRE(correctHash == objhash);
@@ -30,7 +32,7 @@ TEST_CASE("Convert file to GitCAM object") {
         0x31, 0x30, 0x30, 0x36, 0x34, 0x34, 0x20, 0x77, 0x6f, 0x72, 0x6c, 0x64, 0x2e, 0x74, 0x78, 0x74, 0x00, 
         0xcc, 0x62, 0x8c, 0xcd, 0x10, 0x74, 0x2b, 0xae, 0xa8, 0x24, 0x1c, 0x59, 0x24, 0xdf, 0x99, 0x2b, 0x5c, 0x01, 0x9f, 0x71, 
       };
-      std::array<uint8_t,20> worldhash = {
+      std::array<uint8_t, 20> worldhash = {
         0xcc, 0x62, 0x8c, 0xcd, 0x10, 0x74, 0x2b, 0xae, 0xa8, 0x24, 0x1c, 0x59, 0x24, 0xdf, 0x99, 0x2b, 0x5c, 0x01, 0x9f, 0x71, 
       };
       Object dir(Tree{std::vector<DirEntry>{
@@ -46,7 +48,7 @@ TEST_CASE("Convert file to GitCAM object") {
   }
 
   SECTION("Commit is correct") {
-    std::array<uint8_t,20> correctHash = { 
+    std::array<uint8_t, 20> correctHash = { 
       0xce, 0x01, 0x36, 0x25, 0x03, 0x0b, 0xa8, 0xdb, 0xa9, 0x06, 0xf7, 0x56, 0x96, 0x7f, 0x9e, 0x9c, 0xa3, 0x94, 0x46, 0x4a, 
     };
     UserWithTime me{ { "Peter", "peter.bindels@tomtom.com" }, 1664781426, 200 };
@@ -84,7 +86,7 @@ TEST_CASE("Directory entry length cornercase") {
       0x31, 0x30, 0x30, 0x36, 0x34, 0x34, 0x20, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x77, 0x6f, 0x72, 0x6c, 0x64, 0x2e, 0x74, 0x78, 0x74, 0x00, 
       0xcc, 0x62, 0x8c, 0xcd, 0x10, 0x74, 0x2b, 0xae, 0xa8, 0x24, 0x1c, 0x59, 0x24, 0xdf, 0x99, 0x2b, 0x5c, 0x01, 0x9f, 0x71, 
     };
-    std::array<uint8_t,20> worldhash = {
+    std::array<uint8_t, 20> worldhash = {
       0xcc, 0x62, 0x8c, 0xcd, 0x10, 0x74, 0x2b, 0xae, 0xa8, 0x24, 0x1c, 0x59, 0x24, 0xdf, 0x99, 0x2b, 0x5c, 0x01, 0x9f, 0x71, 
     };
     Object dir(Tree{std::vector<DirEntry>{
@@ -102,7 +104,7 @@ TEST_CASE("Directory entry length cornercase") {
       0x31, 0x30, 0x30, 0x36, 0x34, 0x34, 0x20, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x77, 0x6f, 0x72, 0x6c, 0x64, 0x2e, 0x74, 0x78, 0x74, 0x00, 
       0xcc, 0x62, 0x8c, 0xcd, 0x10, 0x74, 0x2b, 0xae, 0xa8, 0x24, 0x1c, 0x59, 0x24, 0xdf, 0x99, 0x2b, 0x5c, 0x01, 0x9f, 0x71, 
     };
-    std::array<uint8_t,20> worldhash = {
+    std::array<uint8_t, 20> worldhash = {
       0xcc, 0x62, 0x8c, 0xcd, 0x10, 0x74, 0x2b, 0xae, 0xa8, 0x24, 0x1c, 0x59, 0x24, 0xdf, 0x99, 0x2b, 0x5c, 0x01, 0x9f, 0x71, 
     };
     Object dir(Tree{std::vector<DirEntry>{
@@ -113,5 +115,93 @@ TEST_CASE("Directory entry length cornercase") {
   }
 }
 
+TEST_CASE("Object header is validated on load") {
+  Object hello("libpiget/test/hello.txt");
+  Object copy(hello.buffer);
+  REQUIRE(copy.type() == Object::Type::Object);
+  REQUIRE(copy.data().size() == 6);
+  REQUIRE(copy.id() == hello.id());
+
+  std::vector<uint8_t> truncated(hello.buffer.begin(), hello.buffer.end() - 1);
+  REQUIRE_THROWS(Object(truncated));
+  std::vector<uint8_t> noHeader = { 'b', 'l', 'o', 'b' };
+  REQUIRE_THROWS(Object(noHeader));
+}
+
+TEST_CASE("Tree entries in git order") {
+  ObjectId file = *ObjectId::fromHex("ce013625030ba8dba906f756967f9e9ca394464a");
+  ObjectId dir = *ObjectId::fromHex("cc628ccd10742baea8241c5924df992b5c019f71");
+  Tree tree;
+  tree.set("a.c", DirEntry{0100644, "", file});
+  tree.set("a", DirEntry{040000, "", dir});
+  tree.set("a-b", DirEntry{0100755, "", file});
+  tree.set("a0", DirEntry{0120000, "", file});
+  // '-' and '.' sort before the '/' the directory is compared with, '0' after it
+  REQUIRE(tree.entries.size() == 4);
+  REQUIRE(tree.entries[0].fileName == "a-b");
+  REQUIRE(tree.entries[1].fileName == "a.c");
+  REQUIRE(tree.entries[2].fileName == "a");
+  REQUIRE(tree.entries[3].fileName == "a0");
+  REQUIRE(tree.get("a") == dir);
+  REQUIRE(tree.get("a.c") == file);
+  REQUIRE(not tree.get("b"));
+
+  tree.set("a", DirEntry{0100644, "", file});
+  REQUIRE(tree.entries.size() == 4);
+  REQUIRE(tree.entries[0].fileName == "a");
+  REQUIRE(tree.get("a") == file);
+
+  Object object(tree);
+  std::vector<TreeView::Entry> entries(object.viewAsTree().begin(), object.viewAsTree().end());
+  REQUIRE(entries.size() == 4);
+  REQUIRE(entries[0].fileMode == 0100644);
+  REQUIRE(entries[0].fileName == "a");
+  REQUIRE(entries[0].hash == file);
+  REQUIRE(entries[3].fileMode == 0120000);
+  REQUIRE(entries[3].fileName == "a0");
+  REQUIRE(Object(object.readAsTree()).buffer == object.buffer);
+
+  Object broken(Object::Type::Tree, object.data().first(object.data().size() - 1));
+  REQUIRE_THROWS(std::distance(broken.viewAsTree().begin(), broken.viewAsTree().end()));
+  REQUIRE_THROWS(Object("libpiget/test/hello.txt").viewAsTree());
+}
+
+TEST_CASE("ObjectId hex codec and ordering") {
+  auto id = ObjectId::fromHex("ce013625030ba8dba906f756967f9e9ca394464a");
+  REQUIRE(id);
+  REQUIRE(id->hex() == "ce013625030ba8dba906f756967f9e9ca394464a");
+  REQUIRE(ObjectId::fromHex("CE013625030BA8DBA906F756967F9E9CA394464A") == id);
+  REQUIRE(not ObjectId::fromHex("ce013625030ba8dba906f756967f9e9ca394464"));
+  REQUIRE(not ObjectId::fromHex("ce013625030ba8dba906f756967f9e9ca394464g"));
+
+  ObjectId low = *id, high = *id;
+  high[19]++;
+  REQUIRE(low < high);
+  low[8] = 0xff;
+  REQUIRE(high < low);
+  REQUIRE(std::hash<ObjectId>{}(*id) == std::hash<ObjectId>{}(ObjectId(*id)));
+}
+
+TEST_CASE("Batch hashing matches scalar SHA-1") {
+  std::vector<std::vector<uint8_t>> buffers;
+  uint32_t seed = 1;
+  for (size_t size = 0; size < 300; size++) {
+    std::vector<uint8_t> buffer(size);
+    for (auto& byte : buffer) {
+      seed = seed * 1103515245 + 12345;
+      byte = seed >> 16;
+    }
+    buffers.push_back(std::move(buffer));
+  }
+  buffers.push_back(std::vector<uint8_t>(1 << 20, 'x'));
+  std::vector<std::span<const uint8_t>> spans(buffers.begin(), buffers.end());
+
+  auto ids = HashBuffers(spans, 4);
+  REQUIRE(ids.size() == buffers.size());
+  for (size_t n = 0; n < buffers.size(); n++) {
+    REQUIRE(ids[n] == ObjectId(Caligo::SHA1(buffers[n]).data()));
+    REQUIRE(HashBuffer(buffers[n]) == ids[n]);
+  }
 }
 
+}
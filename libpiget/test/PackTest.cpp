@@ -1,6 +1,13 @@
 #include "catch2/catch_all.hpp"
 #include "piget/GitCAM.hpp"
 #include "piget/Object.hpp"
+#include "piget/Pack.hpp"
+#include "piget/MultiPackIndex.hpp"
+#include "piget/Repack.hpp"
+#include "piget/Bitmap.hpp"
+#include "bini/writer.h"
+#include "caligo/sha1.h"
+#include <fstream>
 
 namespace Piget {
 
@@ -20,11 +27,11 @@ TEST_CASE("Create a pack from an object") {
 
   auto [packfile, indexfile] = WritePack(db, { hello.id(), world.id(), dir.id() });
   std::vector<uint8_t> expected_packfile = {
-    0x4f, 0x41, 0x43, 0x4b, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x03, 
+    0x50, 0x41, 0x43, 0x4b, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x03, 
       0x36, 0x78, 0x9c, 0xcb, 0x48, 0xcd, 0xc9, 0xc9, 0xe7, 0x02, 0x00, 0x08, 0x4b, 0x02, 0x1f, 
       0x36, 0x78, 0x9c, 0x2b, 0xcf, 0x2f, 0xca, 0x49, 0xe1, 0x02, 0x00, 0x08, 0xd9, 0x02, 0x33, 
       0xaa, 0x04, 0x78, 0x9c, 0x33, 0x34, 0x30, 0x30, 0x33, 0x31, 0x51, 0xc8, 0x48, 0xcd, 0xc9, 0xc9, 0xd7, 0x2b, 0xa9, 0x28, 0x61, 0x38, 0xc7, 0x68, 0xa6, 0xca, 0xcc, 0xbd, 0xe2, 0xf6, 0x4a, 0xb6, 0xef, 0x61, 0xd3, 0xea, 0xe7, 0xcd, 0x59, 0x3c, 0xc5, 0xcd, 0xcb, 0x10, 0xa2, 0xa8, 0x3c, 0xbf, 0x28, 0x27, 0x05, 0xac, 0xe8, 0x4c, 0x52, 0xcf, 0x59, 0x81, 0x12, 0xed, 0x75, 0x2b, 0x54, 0x64, 0x22, 0x55, 0xee, 0xcf, 0xd4, 0x8e, 0x61, 0x9c, 0x5f, 0x08, 0x00, 0xc7, 0x9c, 0x1b, 0x1d, 
-      0x26, 0x36, 0x4d, 0xe0, 0x1e, 0xb2, 0xbf, 0x0e, 0xba, 0x93, 0x87, 0x16, 0x97, 0x90, 0x25, 0x98, 0xbf, 0x08, 0xe8, 0xec, 
+      0x9b, 0x7d, 0xf6, 0x92, 0xcb, 0xea, 0x4d, 0x14, 0xd1, 0xc7, 0x2f, 0x27, 0x0a, 0xed, 0x8f, 0x34, 0xb6, 0x75, 0xcd, 0xd0, 
     };
   std::vector<uint8_t> expected_indexfile = {
     0xff, 0x74, 0x4f, 0x63, 0x00, 0x00, 0x00, 0x02, 
@@ -95,15 +102,309 @@ TEST_CASE("Create a pack from an object") {
     0x88, 0xe3, 0x87, 0x05, 0xfd, 0xbd, 0x36, 0x08, 0xcd, 0xdb, 0xe9, 0x04, 0xb6, 0x7c, 0x73, 0x1f, 0x32, 0x34, 0xc4, 0x5b, 
     0xcc, 0x62, 0x8c, 0xcd, 0x10, 0x74, 0x2b, 0xae, 0xa8, 0x24, 0x1c, 0x59, 0x24, 0xdf, 0x99, 0x2b, 0x5c, 0x01, 0x9f, 0x71, 
     0xce, 0x01, 0x36, 0x25, 0x03, 0x0b, 0xa8, 0xdb, 0xa9, 0x06, 0xf7, 0x56, 0x96, 0x7f, 0x9e, 0x9c, 0xa3, 0x94, 0x46, 0x4a, 
-    0x2d, 0x08, 0xc8, 0x59, 
-    0xdd, 0x38, 0x61, 0xa8, 
-    0x36, 0x3a, 0x30, 0x20, 
+    0xb7, 0xf2, 0x60, 0xc3, 
+    0xb2, 0xe5, 0x67, 0xe0, 
+    0x52, 0x94, 0x15, 0x00, 
     0x00, 0x00, 0x00, 0x2a, 
     0x00, 0x00, 0x00, 0x1b, 
     0x00, 0x00, 0x00, 0x0c,
+    0x9b, 0x7d, 0xf6, 0x92, 0xcb, 0xea, 0x4d, 0x14, 0xd1, 0xc7, 0x2f, 0x27, 0x0a, 0xed, 0x8f, 0x34, 0xb6, 0x75, 0xcd, 0xd0, 
+    0x8b, 0x7e, 0xe1, 0x66, 0xbb, 0x3d, 0x8a, 0x68, 0x64, 0x1f, 0xdc, 0xd6, 0x9e, 0x00, 0xbd, 0x3e, 0x3e, 0x54, 0xd8, 0x7a, 
     };
   REQUIRE(packfile == expected_packfile);
   REQUIRE(indexfile == expected_indexfile);
+  REQUIRE(IndexPack(packfile) == expected_indexfile);
+}
+
+TEST_CASE("Read objects back from a pack") {
+  Object hello("libpiget/test/hello.txt");
+  Object world("libpiget/test/world.txt");
+  ObjectId missing = {};
+
+  std::vector<uint8_t> packfile, indexfile;
+  {
+    Database db("objects");
+    db.add(hello);
+    db.add(world);
+    std::tie(packfile, indexfile) = WritePack(db, { hello.id(), world.id() });
+  }
+
+  SECTION("From an in-memory index") {
+    Pack pack(packfile, indexfile);
+    REQUIRE(pack.size() == 2);
+    REQUIRE(pack.get(hello.id())->buffer == hello.buffer);
+    REQUIRE(pack.get(world.id())->buffer == world.buffer);
+    REQUIRE(not pack.get(missing));
+  }
+
+  SECTION("From a mapped pack in the object store") {
+    std::filesystem::create_directories("packobjects/pack");
+    std::ofstream("packobjects/pack/pack-test.pack").write((const char*)packfile.data(), packfile.size());
+    std::ofstream("packobjects/pack/pack-test.idx").write((const char*)indexfile.data(), indexfile.size());
+    Database db("packobjects");
+    REQUIRE(db.packs.size() == 1);
+    REQUIRE(db.get(hello.id())->buffer == hello.buffer);
+    REQUIRE(db.get(world.id())->buffer == world.buffer);
+    REQUIRE(not db.get(missing));
+  }
+}
+
+TEST_CASE("Resolve deltified pack entries") {
+  Object hello("libpiget/test/hello.txt");
+  std::string text = "hello\nworld\n";
+  Object helloworld(Object::Type::Object, std::vector<uint8_t>(text.begin(), text.end()));
+  // copy the 6 bytes of "hello\n", then insert "world\n"
+  std::vector<uint8_t> delta = { 0x06, 0x0c, 0x90, 0x06, 0x06, 'w', 'o', 'r', 'l', 'd', '\n' };
+  REQUIRE(ApplyDelta(hello.data(), delta) == std::vector<uint8_t>(text.begin(), text.end()));
+
+  auto makePack = [&](bool refDelta) {
+    Bini::writer w;
+    w.add32be(0x5041434B);
+    w.add32be(2);
+    w.add32be(2);
+    w.addPB(0x36);
+    w.add(Decoco::compress(Decoco::ZlibCompressor(), hello.data()));
+    size_t deltaOffset = w.size();
+    if (refDelta) {
+      w.addPB(0x7B);
+      w.add(hello.id());
+    } else {
+      w.addPB(0x6B);
+      w.add8(deltaOffset - 12);
+    }
+    w.add(Decoco::compress(Decoco::ZlibCompressor(), delta));
+    w.add(Caligo::SHA1{w}.data());
+    return std::vector<uint8_t>(std::move(w));
+  };
+
+  SECTION("OFS_DELTA") {
+    auto packfile = makePack(false);
+    Pack pack(packfile, {});
+    REQUIRE(pack.size() == 2);
+    REQUIRE(pack.get(helloworld.id())->buffer == helloworld.buffer);
+    REQUIRE(pack.get(hello.id())->buffer == hello.buffer);
+  }
+
+  SECTION("REF_DELTA") {
+    auto packfile = makePack(true);
+    Pack pack(packfile, {});
+    REQUIRE(pack.size() == 2);
+    REQUIRE(pack.get(helloworld.id())->buffer == helloworld.buffer);
+  }
+
+  SECTION("Index a pack in one pass") {
+    auto packfile = makePack(true);
+    Pack pack(packfile, IndexPack(packfile, 2));
+    REQUIRE(pack.get(helloworld.id())->buffer == helloworld.buffer);
+    packfile[20] ^= 1;
+    REQUIRE_THROWS(IndexPack(packfile));
+  }
+
+  SECTION("Corrupt delta") {
+    std::vector<uint8_t> badDelta = { 0x06, 0x0c, 0x90, 0x07, 0x06 };
+    REQUIRE_THROWS(ApplyDelta(hello.data(), badDelta));
+  }
+}
+
+TEST_CASE("Write deltified packs") {
+  std::vector<Object> versions;
+  std::string text;
+  for (size_t n = 0; n < 200; n++) {
+    text += "line " + std::to_string(n * 7919 % 1000) + " of a slowly growing file\n";
+    if (n % 40 == 39) {
+      versions.emplace_back(Object::Type::Object, std::vector<uint8_t>(text.begin(), text.end()));
+    }
+  }
+
+  SECTION("CreateDelta round trips") {
+    auto delta = CreateDelta(versions[2].data(), versions[4].data());
+    REQUIRE(delta);
+    REQUIRE(delta->size() < versions[4].data().size() / 4);
+    auto result = ApplyDelta(versions[2].data(), *delta);
+    REQUIRE(std::equal(result.begin(), result.end(), versions[4].data().begin(), versions[4].data().end()));
+    REQUIRE(not CreateDelta(versions[2].data(), versions[4].data(), 10));
+  }
+
+  SECTION("Pack with deltas reads back") {
+    Database db("objects");
+    std::vector<PackObject> objects;
+    for (auto& v : versions) {
+      db.add(v);
+      objects.push_back({v.id(), PackNameHash("file.txt")});
+    }
+    auto [plainPack, plainIndex] = WritePack(db, objects, PackWriteOptions{0, 0});
+    auto [packfile, indexfile] = WritePack(db, objects);
+    REQUIRE(packfile.size() < plainPack.size() / 2);
+
+    Pack pack(packfile, indexfile);
+    for (auto& v : versions) {
+      REQUIRE(pack.get(v.id())->buffer == v.buffer);
+      // Type and size come from the entry headers, through the delta chain
+      ObjectInfo info = pack.infoAt(*pack.find(v.id()));
+      REQUIRE(info.type == Object::Type::Object);
+      REQUIRE(info.size == v.data().size());
+      REQUIRE(db.info(v.id())->size == v.data().size());
+    }
+    REQUIRE(not db.info(Object(Object::Type::Object, std::span<const uint8_t>()).id()));
+    Pack regenerated(packfile, {});
+    for (auto& v : versions) {
+      REQUIRE(regenerated.get(v.id())->buffer == v.buffer);
+    }
+
+    auto [serialPack, serialIndex] = WritePack(db, objects, PackWriteOptions{10, 50, 1});
+    auto [threadedPack, threadedIndex] = WritePack(db, objects, PackWriteOptions{10, 50, 4});
+    REQUIRE(serialPack == packfile);
+    REQUIRE(threadedPack == packfile);
+    REQUIRE(threadedIndex == serialIndex);
+
+    auto [shallowPack, shallowIndex] = WritePack(db, objects, PackWriteOptions{10, 1});
+    REQUIRE(shallowPack.size() > packfile.size());
+    Pack shallow(shallowPack, shallowIndex);
+    for (auto& v : versions) {
+      REQUIRE(shallow.get(v.id())->buffer == v.buffer);
+    }
+  }
+}
+
+TEST_CASE("Look up objects through a multi-pack-index") {
+  Object hello("libpiget/test/hello.txt");
+  Object world("libpiget/test/world.txt");
+  ObjectId missing = {};
+
+  std::filesystem::remove_all("midxobjects");
+  std::filesystem::create_directories("midxobjects/pack");
+  {
+    Database db("objects");
+    db.add(hello);
+    db.add(world);
+    auto writePack = [&](std::string name, std::vector<ObjectId> ids) {
+      auto [packfile, indexfile] = WritePack(db, ids);
+      std::ofstream("midxobjects/pack/" + name + ".pack").write((const char*)packfile.data(), packfile.size());
+      std::ofstream("midxobjects/pack/" + name + ".idx").write((const char*)indexfile.data(), indexfile.size());
+    };
+    writePack("pack-a", { hello.id() });
+    writePack("pack-b", { hello.id(), world.id() });
+  }
+  WriteMultiPackIndex("midxobjects/pack");
+
+  MultiPackIndex midx("midxobjects/pack/multi-pack-index");
+  REQUIRE(midx.size() == 2);
+  REQUIRE(midx.packNames() == std::vector<std::string>{ "pack-a.idx", "pack-b.idx" });
+  REQUIRE(midx.find(world.id())->pack == 1);
+  REQUIRE(not midx.find(missing));
+
+  Database db("midxobjects");
+  REQUIRE(db.get(hello.id())->buffer == hello.buffer);
+  REQUIRE(db.get(world.id())->buffer == world.buffer);
+  REQUIRE(not db.get(missing));
+}
+
+TEST_CASE("Repack reachable objects and prune the rest") {
+  Object hello("libpiget/test/hello.txt");
+  Object world("libpiget/test/world.txt");
+  Object dir(Tree{std::vector<DirEntry>{
+    DirEntry{0100644, "hello.txt", hello.id()},
+    }});
+  UserWithTime author{{"Piget", "piget@example.com"}, 0, 0};
+  Object first(Commit(dir.id(), author).setMessage("first\n"));
+  Object side(Commit(dir.id(), author).setMessage("side\n"));
+  Commit mergeCommit = Commit(dir.id(), author).setParent(first.id()).setMessage("merge\n");
+  mergeCommit.mergeParents.push_back(side.id());
+  Object merge(mergeCommit);
+  REQUIRE(merge.readAsCommit().mergeParents == std::vector<ObjectId>{ side.id() });
+
+  std::filesystem::remove_all("repackgit");
+  std::filesystem::create_directories("repackgit/refs/heads");
+  std::ofstream("repackgit/HEAD") << "ref: refs/heads/master\n";
+  std::ofstream("repackgit/refs/heads/master") << merge.id().hex() << "\n";
+  {
+    Database db("repackgit/objects");
+    for (auto& object : { hello, world, dir, first, side, merge }) {
+      db.add(object);
+    }
+  }
+  REQUIRE(ReadRefTips("repackgit") == std::vector<ObjectId>{ merge.id() });
+
+  RepackOptions options;
+  options.gracePeriod = std::chrono::seconds(0);
+  auto result = Repack("repackgit", {}, options);
+  REQUIRE(result.packed == 5);
+  REQUIRE(result.pruned == 6);
+  REQUIRE(std::filesystem::exists(std::filesystem::path(result.pack).replace_extension(".idx")));
+
+  Database db("repackgit/objects");
+  REQUIRE(db.packs.size() == 1);
+  REQUIRE(not db.cam.contains(hello.id()));
+  REQUIRE(db.get(side.id())->buffer == side.buffer);
+  REQUIRE(db.get(hello.id())->buffer == hello.buffer);
+  REQUIRE(not db.get(world.id()));
+}
+
+TEST_CASE("Answer reachability from pack bitmaps") {
+  SECTION("EWAH round trips runs and literals") {
+    Bitmap bitmap;
+    for (size_t bit = 64; bit < 320; bit++) bitmap.set(bit);
+    bitmap.set(1000);
+    bitmap.set(1003);
+    auto encoded = EwahEncode(bitmap, 1100);
+    Bitmap decoded;
+    REQUIRE(EwahDecode(encoded, decoded) == encoded.size());
+    // decoding always covers the full bit count
+    bitmap.words.resize(18);
+    REQUIRE(decoded.words == bitmap.words);
+  }
+
+  Object hello("libpiget/test/hello.txt");
+  Object world("libpiget/test/world.txt");
+  Object firstTree(Tree{std::vector<DirEntry>{
+    DirEntry{0100644, "hello.txt", hello.id()},
+    }});
+  Object secondTree(Tree{std::vector<DirEntry>{
+    DirEntry{0100644, "hello.txt", hello.id()},
+    DirEntry{0100644, "world.txt", world.id()},
+    }});
+  UserWithTime author{{"Piget", "piget@example.com"}, 0, 0};
+  Object first(Commit(firstTree.id(), author).setMessage("first\n"));
+  Object second(Commit(secondTree.id(), author).setParent(first.id()).setMessage("second\n"));
+
+  std::filesystem::remove_all("bitmapgit");
+  std::filesystem::create_directories("bitmapgit/refs/heads");
+  std::ofstream("bitmapgit/HEAD") << "ref: refs/heads/master\n";
+  std::ofstream("bitmapgit/refs/heads/master") << second.id().hex() << "\n";
+  {
+    Database db("bitmapgit/objects");
+    for (auto& object : { hello, world, firstTree, secondTree, first, second }) {
+      db.add(object);
+    }
+  }
+  RepackOptions options;
+  options.gracePeriod = std::chrono::seconds(0);
+  auto result = Repack("bitmapgit", {}, options);
+  REQUIRE(std::filesystem::exists(std::filesystem::path(result.pack).replace_extension(".bitmap")));
+
+  Pack pack(result.pack);
+  PackBitmap bitmap(pack, std::filesystem::path(result.pack).replace_extension(".bitmap"));
+  auto reachable = bitmap.commitBitmap(second.id());
+  REQUIRE(reachable);
+  size_t count = 0;
+  reachable->forEach([&](size_t bit) {
+    REQUIRE(bitmap.idAt(bit) != ObjectId());
+    count++;
+  });
+  REQUIRE(count == 6);
+  REQUIRE(bitmap.nameHashAt(*bitmap.bitFor(world.id())) == PackNameHash("world.txt"));
+
+  Database db("bitmapgit/objects");
+  auto between = db.objectsBetween(std::vector<ObjectId>{ second.id() }, std::vector<ObjectId>{ first.id() });
+  std::vector<ObjectId> ids;
+  for (auto& object : between) {
+    ids.push_back(object.id);
+  }
+  std::sort(ids.begin(), ids.end());
+  std::vector<ObjectId> expected = { world.id(), secondTree.id(), second.id() };
+  std::sort(expected.begin(), expected.end());
+  REQUIRE(ids == expected);
+  REQUIRE(db.objectsBetween(std::vector<ObjectId>{ second.id() }).size() == 6);
 }
 
 }
@@ -1,4 +1,11 @@
 #include "piget/Repository.hpp"
+#include "piget/MultiPackIndex.hpp"
+#include "piget/CommitGraph.hpp"
+#include "piget/FileIO.hpp"
+#include "piget/MappedFile.hpp"
+#include "piget/Refs.hpp"
+#include "piget/Repack.hpp"
+#include "piget/Diff.hpp"
 #include <print>
 #include <span>
 #include <string_view>
@@ -17,11 +24,321 @@ void git_init(std::span<std::string_view> args) {
   }
 }
 
+void git_add(std::span<std::string_view> args) {
+  if (args.size() < 3) {
+    std::print("usage: {} add <pathspec>...\n", args[0]);
+    exit(-1);
+  }
+  auto repo = Piget::Repository::Open(std::filesystem::current_path());
+  if (not repo) {
+    std::print("Not a git repository\n");
+    exit(-1);
+  }
+  Index index(repo->objects, Index::Lock::Required);
+  for (auto& arg : args.subspan(2)) {
+    std::filesystem::path path(arg);
+    if (std::filesystem::is_directory(path)) {
+      index.addAll(path);
+    } else {
+      index.add(path);
+    }
+  }
+  index.save();
+}
+
 void git_commit(std::span<std::string_view> args) {
   (void)args;
 
 }
 
+void git_multi_pack_index(std::span<std::string_view> args) {
+  if (args.size() != 3 || args[2] != "write") {
+    std::print("usage: {} multi-pack-index write\n", args[0]);
+    exit(-1);
+  }
+  auto repo = Piget::Repository::Open(std::filesystem::current_path());
+  if (not repo) {
+    std::print("Not a git repository\n");
+    exit(-1);
+  }
+  WriteMultiPackIndex(repo->repository / "objects" / "pack");
+}
+
+void git_gc(std::span<std::string_view> args) {
+  RepackOptions options;
+  for (auto& arg : args.subspan(2)) {
+    if (arg == "--prune=now") {
+      options.gracePeriod = std::chrono::seconds(0);
+    } else {
+      std::print("usage: {} gc [--prune=now]\n", args[0]);
+      exit(-1);
+    }
+  }
+  auto repo = Piget::Repository::Open(std::filesystem::current_path());
+  if (not repo) {
+    std::print("Not a git repository\n");
+    exit(-1);
+  }
+  // staged content is reachable too, even before it is committed
+  std::vector<ObjectId> staged;
+  if (not repo->isBare) {
+    Index index(repo->objects);
+    for (auto& [name, entry] : index.entries()) {
+      staged.push_back(entry.hash);
+    }
+  }
+  auto result = Repack(repo->repository, staged, options);
+  std::print("Packed {} objects, pruned {} loose objects\n", result.packed, result.pruned);
+}
+
+void git_commit_graph(std::span<std::string_view> args) {
+  if (args.size() != 3 || args[2] != "write") {
+    std::print("usage: {} commit-graph write\n", args[0]);
+    exit(-1);
+  }
+  auto repo = Piget::Repository::Open(std::filesystem::current_path());
+  if (not repo) {
+    std::print("Not a git repository\n");
+    exit(-1);
+  }
+  Database db(repo->repository / "objects");
+  WriteCommitGraph(db, repo->repository / "objects", ReadRefTips(repo->repository));
+}
+
+// What a revision argument names, or git's fatal error for one that names nothing
+static ObjectId requireRevision(const std::filesystem::path& gitDir, const Database& db, std::string_view name) {
+  std::optional<ObjectId> id;
+  try {
+    id = ResolveRevision(gitDir, db, name);
+  } catch (std::exception& e) {
+    std::print("error: {}\n", e.what());
+  }
+  if (not id) {
+    std::print("fatal: Not a valid object name {}\n", name);
+    exit(128);
+  }
+  return *id;
+}
+
+// The object a tag points at, through any number of tags; id is updated to it. Other objects are their own target.
+static std::optional<Object> peelTags(const Database& db, ObjectId& id) {
+  for (int depth = 0; depth < 10; depth++) {
+    auto object = db.get(id);
+    if (not object || object->type() != Object::Type::Tag) return object;
+    std::string_view header((const char*)object->data().data(), object->data().size());
+    auto target = header.starts_with("object ") ? ObjectId::fromHex(header.substr(7, 40)) : std::nullopt;
+    if (not target) return std::nullopt;
+    id = *target;
+  }
+  return std::nullopt;
+}
+
+static std::optional<ObjectId> peelToCommit(const Database& db, ObjectId id) {
+  auto object = peelTags(db, id);
+  if (not object || object->type() != Object::Type::Commit) return std::nullopt;
+  return id;
+}
+
+// The tree of a commit or of what a tag points at
+static std::optional<ObjectId> peelToTree(const Database& db, ObjectId id) {
+  auto object = peelTags(db, id);
+  if (not object) return std::nullopt;
+  if (object->type() == Object::Type::Tree) return id;
+  if (object->type() == Object::Type::Commit) return object->readAsCommit().root;
+  return std::nullopt;
+}
+
+void git_merge_base(std::span<std::string_view> args) {
+  bool isAncestor = args.size() == 5 && args[2] == "--is-ancestor";
+  if (args.size() != 4 && not isAncestor) {
+    std::print("usage: {} merge-base [--is-ancestor] <commit> <commit>\n", args[0]);
+    exit(-1);
+  }
+  auto repo = Piget::Repository::Open(std::filesystem::current_path());
+  if (not repo) {
+    std::print("Not a git repository\n");
+    exit(-1);
+  }
+  Database db(repo->repository / "objects");
+  auto lhs = peelToCommit(db, requireRevision(repo->repository, db, args[args.size() - 2]));
+  auto rhs = peelToCommit(db, requireRevision(repo->repository, db, args[args.size() - 1]));
+  if (not lhs || not rhs) {
+    std::print("Not a valid commit name\n");
+    exit(-1);
+  }
+  if (isAncestor) {
+    exit(db.isAncestor(*lhs, *rhs) ? 0 : 1);
+  }
+  auto bases = db.mergeBases(*lhs, *rhs);
+  if (bases.empty()) exit(1);
+  std::print("{}\n", bases.front().hex());
+}
+
+void git_rev_list(std::span<std::string_view> args) {
+  bool count = false;
+  std::vector<std::string_view> names;
+  for (auto& arg : args.subspan(2)) {
+    if (arg == "--count") {
+      count = true;
+    } else if (arg != "--objects") {
+      names.push_back(arg);
+    }
+  }
+  if (args.size() < 4 || args[2] != "--objects" || names.empty()) {
+    std::print("usage: {} rev-list --objects [--count] <commit>... [^<commit>...]\n", args[0]);
+    exit(-1);
+  }
+  auto repo = Piget::Repository::Open(std::filesystem::current_path());
+  if (not repo) {
+    std::print("Not a git repository\n");
+    exit(-1);
+  }
+  Database db(repo->repository / "objects");
+  std::vector<ObjectId> wants, haves;
+  for (auto& name : names) {
+    bool exclude = name.starts_with("^");
+    (exclude ? haves : wants).push_back(requireRevision(repo->repository, db, exclude ? name.substr(1) : name));
+  }
+  auto objects = db.objectsBetween(wants, haves);
+  if (count) {
+    std::print("{}\n", objects.size());
+    return;
+  }
+  for (auto& object : objects) {
+    std::print("{}\n", object.id.hex());
+  }
+}
+
+void git_diff(std::span<std::string_view> args) {
+  if (args.size() != 5 || args[2] != "--name-status") {
+    std::print("usage: {} diff --name-status <commit> <commit>\n", args[0]);
+    exit(-1);
+  }
+  auto repo = Piget::Repository::Open(std::filesystem::current_path());
+  if (not repo) {
+    std::print("Not a git repository\n");
+    exit(-1);
+  }
+  Database db(repo->repository / "objects");
+  std::optional<ObjectId> trees[2];
+  for (size_t n = 0; n < 2; n++) {
+    trees[n] = peelToTree(db, requireRevision(repo->repository, db, args[3 + n]));
+    if (not trees[n]) {
+      std::print("Not a valid tree-ish {}\n", args[3 + n]);
+      exit(-1);
+    }
+  }
+  for (auto& change : DiffTrees(db, trees[0], trees[1])) {
+    char status = change.status == TreeChange::Status::Added ? 'A' : change.status == TreeChange::Status::Deleted ? 'D' : 'M';
+    // a file that became a symlink or a submodule, or the other way around
+    if (status == 'M' && (change.oldMode & 0170000) != (change.newMode & 0170000)) status = 'T';
+    std::print("{}\t{}\n", status, change.path);
+  }
+}
+
+void git_status(std::span<std::string_view> args) {
+  if (args.size() != 2) {
+    std::print("usage: {} status\n", args[0]);
+    exit(-1);
+  }
+  auto repo = Piget::Repository::Open(std::filesystem::current_path());
+  if (not repo || repo->isBare) {
+    std::print("Not a git repository with a worktree\n");
+    exit(-1);
+  }
+  Database db(repo->repository / "objects");
+  std::optional<ObjectId> headTree;
+  if (auto head = ResolveRevision(repo->repository, db, "HEAD")) headTree = peelToTree(db, *head);
+  Index index(repo->objects, Index::Lock::IfFree);
+  auto status = index.status(db, headTree);
+  // refreshed stat data and the untracked cache make the next status cheaper
+  index.save();
+
+  // Short format: staged state, then worktree state, for every path that has either
+  std::map<std::string, std::pair<char, char>> changes;
+  for (auto& change : status.staged) {
+    char state = change.status == TreeChange::Status::Added ? 'A' : change.status == TreeChange::Status::Deleted ? 'D' : 'M';
+    if (state == 'M' && (change.oldMode & 0170000) != (change.newMode & 0170000)) state = 'T';
+    changes[change.path] = { state, ' ' };
+  }
+  for (auto& path : status.modified) {
+    changes.try_emplace(path, ' ', ' ').first->second.second = 'M';
+  }
+  for (auto& path : status.deleted) {
+    changes.try_emplace(path, ' ', ' ').first->second.second = 'D';
+  }
+  for (auto& [path, state] : changes) {
+    std::print("{}{} {}\n", state.first, state.second, path);
+  }
+  for (auto& path : status.untracked) {
+    std::print("?? {}\n", path);
+  }
+}
+
+void git_checkout(std::span<std::string_view> args) {
+  if (args.size() != 3) {
+    std::print("usage: {} checkout <branch|commit>\n", args[0]);
+    exit(-1);
+  }
+  auto repo = Piget::Repository::Open(std::filesystem::current_path());
+  if (not repo || repo->isBare) {
+    std::print("Not a git repository with a worktree\n");
+    exit(-1);
+  }
+  Database db(repo->repository / "objects");
+  auto commit = peelToCommit(db, requireRevision(repo->repository, db, args[2]));
+  auto tree = commit ? peelToTree(db, *commit) : std::nullopt;
+  if (not tree) {
+    std::print("Not a valid commit {}\n", args[2]);
+    exit(-1);
+  }
+
+  // A branch is checked out by name, HEAD stays what it is, and anything else detaches HEAD at its commit
+  std::optional<std::string> head;
+  std::string branch = "refs/heads/" + std::string(args[2]);
+  if (args[2] != "HEAD") head = ReadRef(repo->repository, branch) ? "ref: " + branch : commit->hex();
+  LockFile headLock;
+  if (head) headLock = LockFile(repo->repository / "HEAD");
+  try {
+    Index index(repo->objects, Index::Lock::Required);
+    index.checkout(db, *tree);
+    index.save();
+  } catch (std::exception& e) {
+    headLock.rollback();
+    std::print("error: {}\n", e.what());
+    exit(1);
+  }
+  if (head) {
+    *head += "\n";
+    headLock.write(std::span<const uint8_t>((const uint8_t*)head->data(), head->size()));
+    headLock.commit();
+  }
+}
+
+void git_index_pack(std::span<std::string_view> args) {
+  if (args.size() != 3) {
+    std::print("usage: {} index-pack (--stdin | <pack-file>)\n", args[0]);
+    exit(-1);
+  }
+  if (args[2] == "--stdin") {
+    auto repo = Piget::Repository::Open(std::filesystem::current_path());
+    if (not repo) {
+      std::print("Not a git repository\n");
+      exit(-1);
+    }
+    auto packFile = IndexPack(0, repo->repository / "objects" / "pack");
+    std::print("{}\n", packFile.stem().string().substr(5));
+    return;
+  }
+  std::filesystem::path packFile = std::filesystem::absolute(args[2]);
+  MappedFile mapping(packFile);
+  auto index = IndexPack(mapping.data());
+  WriteDurably(std::filesystem::path(packFile).replace_extension(".idx"), index);
+  std::string checksum(40, '\0');
+  HexEncode(mapping.data().last(20), checksum.data());
+  std::print("{}\n", checksum);
+}
+
 void git_help(std::span<std::string_view> args);
 
 struct Operation {
@@ -30,9 +347,19 @@ struct Operation {
 };
 
 std::map<std::string_view, Operation> operations = {
+  { "add", { "Add file contents to the index", git_add } },
+  { "index-pack", { "Build the index of a pack file or a pack read from stdin", git_index_pack } },
   { "init", { "Create an empty Git repository or reinitialize an existing one", git_init } },
   { "help", { "Show an overview of commands that can be run", git_help } },
+  { "checkout", { "Switch branches or write a commit out to the working tree", git_checkout } },
   { "commit", { "Record changes to the repository", git_commit } },
+  { "commit-graph", { "Write a commit-graph file for fast history walks", git_commit_graph } },
+  { "diff", { "Show the files that differ between two commits", git_diff } },
+  { "gc", { "Pack reachable objects and prune loose and unreachable ones", git_gc } },
+  { "merge-base", { "Find the best common ancestor of two commits", git_merge_base } },
+  { "multi-pack-index", { "Write a single index covering every pack", git_multi_pack_index } },
+  { "rev-list", { "List the objects reachable from some commits but not others", git_rev_list } },
+  { "status", { "Show the working tree status", git_status } },
 };
 
 void git_help(std::span<std::string_view> args) {